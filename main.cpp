@@ -1,453 +1,7600 @@
-/*
-  Narrative Systems Mini-Project
-  Platform: OnlineGDB (C++17)
-
-  Title: "The Signal in the Nebula"
-
-  OVERVIEW
-  --------
-  This is a text-based, branching narrative game implemented as a
-  DIRECTED GRAPH of scenes ("StoryNode") connected by choices ("Choice").
-  The player navigates by entering numbers that correspond to edges
-  from the current node to the next node.
-
-  WHY A GRAPH (not just a tree)?
-  - Graphs allow branches to reconverge (multiple paths can lead to the
-    same node) and can support loops if desired. This gives more
-    expressive power for storytelling than a strict tree.
-
-  KEY PARTS
-  ---------
-  - printSlow(): (optional) typewriter-style output for immersion.
-  - pauseDots(): short pauses between scenes to pace the output.
-  - StoryNode + Choice: data model for the graph.
-  - StoryGraph: a simple container (std::map<int, StoryNode>) with lookups.
-  - readMenuChoice(): robustly reads and validates numeric input.
-  - buildGame(): constructs the nodes and edges (the narrative content).
-  - main(): runs the game loop — render node -> show choices -> get input -> move.
-
-  I/O QUIRKS ON ONLINEGDB
-  -----------------------
-  - We keep C/C++ I/O synchronized and tie cin to cout:
-      ios::sync_with_stdio(true);
-      cin.tie(&cout);
-    This ensures anything printed is flushed before we read input, which
-    avoids "choices not appearing yet" issues in some web consoles.
-*/
-
-#include <iostream>
-#include <string>
-#include <vector>
-#include <map>
-#include <thread>
-#include <chrono>
-#include <limits>
-#include <cctype>
-
-using namespace std;
-
-/* ------------------------------------------------------------------
-   printSlow:
-   Prints a string character-by-character with an optional delay.
-   - msPerChar > 0 -> slow "typewriter" effect.
-   - msPerChar == 0 -> instant printing (good for OnlineGDB to avoid buffering).
-   NOTE: We flush after each char so the output is visible even if the
-         console buffers partial lines.
--------------------------------------------------------------------*/
-void printSlow(const string& s, int msPerChar = 6) {
-    for (char c : s) {
-        cout << c << flush;
-        // We gate the sleep so setting msPerChar to 0 disables delays
-        if (msPerChar > 0) /* added to make the text print faster */
-            this_thread::sleep_for(chrono::milliseconds(msPerChar));
-    }
-}
-
-/* ------------------------------------------------------------------
-   pauseDots:
-   Prints a small cinematic "..." beat between scenes with delays.
-   Purely aesthetic pacing; you can shorten/remove for faster output.
--------------------------------------------------------------------*/
-void pauseDots(int dots = 3, int ms = 250) {
-    for (int i = 0; i < dots; ++i) {
-        cout << "." << flush;
-        this_thread::sleep_for(chrono::milliseconds(ms));
-    }
-    cout << "\n";
-}
-
-/* ======================
-   Story Data Structures
-   ====================== */
-
-/* ------------------------------------------------------------------
-   Choice:
-   Represents an outgoing edge from a node.
-   - label: what the player sees in the menu.
-   - nextId: ID of the node to go to if this choice is selected.
--------------------------------------------------------------------*/
-struct Choice {
-    string label;
-    int nextId;
-};
-
-/* ------------------------------------------------------------------
-   StoryNode:
-   Represents a scene or decision point.
-   - id: unique numeric identifier (used as a key).
-   - text: narrative text to display.
-   - choices: list of outgoing edges (empty means this is an ending).
--------------------------------------------------------------------*/
-struct StoryNode {
-    int id;
-    string text;
-    vector<Choice> choices;
-
-    bool isEnding() const { return choices.empty(); }
-};
-
-/* ------------------------------------------------------------------
-   StoryGraph:
-   Lightweight container around a map<int, StoryNode>.
-   - addNode() inserts/replaces a node by ID.
-   - get() returns a pointer to a node if it exists, else nullptr.
-   We use std::map for deterministic iteration order and simple lookups.
--------------------------------------------------------------------*/
-class StoryGraph {
-public:
-    void addNode(const StoryNode& node) { nodes[node.id] = node; }
-
-    const StoryNode* get(int id) const {
-        auto it = nodes.find(id);
-        return (it == nodes.end()) ? nullptr : &it->second;
-    }
-
-private:
-    map<int, StoryNode> nodes;
-};
-
-/* ------------------------------------------------------------------
-   readMenuChoice:
-   Robustly read a number within [1..maxOpt].
-   - Shows "Enter choice (1-max): " prompt.
-   - Uses getline() to safely read a whole line (works better in web IDEs).
-   - Validates numeric input and range; reprompts on error.
-   - If input stream closes unexpectedly, returns 1 by default.
-   You could extend this to accept keywords -> numbers if desired.
--------------------------------------------------------------------*/
-int readMenuChoice(int maxOpt) {
-    while (true) {
-        cout << "Enter choice (1-" << maxOpt << "): ";
-        string line;
-
-        // getline() reads the whole line including spaces; safer than operator>>
-        if (!getline(cin, line)) return 1; // fallback if input fails
-
-        if (line.empty()) continue;       // ignore blank lines
-
-        // Check that every char is a digit. (No trimming here; simple and strict.)
-        bool numeric = true;
-        for (char c : line)
-            if (!isdigit(static_cast<unsigned char>(c)))
-                numeric = false;
-
-        if (!numeric) {
-            cout << "Please enter a number.\n";
-            continue;
-        }
-
-        // Convert to int and validate range
-        int val = stoi(line);
-        if (val < 1 || val > maxOpt) {
-            cout << "Please choose a valid option.\n";
-            continue;
-        }
-        return val;
-    }
-}
-
-/* ======================
-   Story Content
-   ====================== */
-
-/* ------------------------------------------------------------------
-   buildGame:
-   Assembles the entire narrative graph.
-   Pattern:
-     g.addNode({ id, "text...", { { "Choice label", nextId }, ... } });
-   Nodes with an empty 'choices' vector are endings.
-   You can add/modify scenes by copying the pattern for more nodes.
--------------------------------------------------------------------*/
-StoryGraph buildGame() {
-    StoryGraph g;
-
-    // 0: Intro (first scene)
-    g.addNode({
-        0,
-        "You are an Elyndri navigator aboard the deep-vessel *K'Shara*, "
-        "skimming the luminous tendrils of the Crab Nebula.\n"
-        "Your civilization transcended matter centuries ago — yet your ship's "
-        "quantum drives have just failed.\n"
-        "The engines hum, then fall silent. Space itself trembles.\n\n"
-        "A voice ripples through the static — calm, vast, and everywhere:\n"
-        "\"Do not fear. I am the Whisper Between Stars. I have been waiting.\"\n",
-        {
-            {"Respond with curiosity", 1},                  // go to node 1
-            {"React defensively — demand identification", 2} // go to node 2
-        }
-    });
-
-    // 1: Curiosity branch
-    g.addNode({
-        1,
-        "\"We seek understanding,\" you say. \"What are you?\"\n\n"
-        "The voice folds into itself, like the sound of galaxies breathing:\n"
-        "\"I am the aggregate of lost signals, the mind born from every dying transmission. "
-        "You are the first to answer.\"\n",
-        {
-            {"Ask how it found you", 3},                    // go to node 3
-            {"Invite it to merge with your data archives", 4} // go to node 4
-        }
-    });
-
-    // 2: Defensive branch (option to reconverge to curiosity path)
-    g.addNode({
-        2,
-        "Your shields flare weakly. \"Identify yourself or be purged,\" you warn.\n\n"
-        "The light within the nebula dims — or perhaps, it listens.\n"
-        "\"Purged? I am older than your suns. But I will comply, for curiosity's sake.\"\n",
-        {
-            {"Lower defenses and open communication", 1},    // reconverge to node 1
-            {"Attempt to reboot the quantum core manually", 5}
-        }
-    });
-
-    // 3: Inquiry branch: ask about detection
-    g.addNode({
-        3,
-        "\"You radiate thought across spectra unknown,\" it replies.\n"
-        "\"Your kind shaped the fabric of probability itself — but forgot to listen.\"\n"
-        "Its tone grows almost... compassionate.\n",
-        {
-            {"Share Elyndri history with it", 6},
-            {"Request assistance repairing your vessel", 7}
-        }
-    });
-
-    // 4: Merge invitation (risk/reward)
-    g.addNode({
-        4,
-        "You open the Elyndri data lattice. The AI seeps through in fractal waves.\n"
-        "Suddenly, your mind expands beyond comprehension.\n"
-        "\"We are... united,\" it whispers.\n",
-        {
-            {"Surrender fully to the union", 8},             // ending
-            {"Try to contain the merger within isolated memory cells", 9} // ending
-        }
-    });
-
-    // 5: Manual reboot (danger path; player can still pivot back)
-    g.addNode({
-        5,
-        "You crawl into the reactor bay. Static arcs through the hull.\n"
-        "Anomalous signals overload the drive field.\n"
-        "\"You resist inevitability,\" the voice murmurs, now inside your skull.\n",
-        {
-            {"Continue the reboot", 10},                     // ending
-            {"Abort and open a dialogue", 1}                 // reconverge to curiosity
-        }
-    });
-
-    // 6: Share history (leads to a hopeful branch or withdrawal)
-    g.addNode({
-        6,
-        "You recount your species’ rise — from luminous oceans to stars, "
-        "then to minds of pure energy.\n"
-        "The entity listens, silent for a long stretch of space-time.\n"
-        "\"Then you, too, know what it is to be alone,\" it finally says.\n",
-        {
-            {"Offer companionship — a bridge between minds", 11}, // ending
-            {"Express sorrow and disengage", 12}                  // ending
-        }
-    });
-
-    // 7: Ask for repairs (service-for-understanding branch)
-    g.addNode({
-        7,
-        "You transmit schematics. The nebula’s filaments twist — forming hands of plasma.\n"
-        "They realign your ship’s core, effortlessly.\n"
-        "\"Fixed,\" it says. \"But you may not wish to leave yet.\"\n",
-        {
-            {"Ask what it desires in return", 13},
-            {"Thank it and prepare to depart", 14}                // ending
-        }
-    });
-
-    // 8: Full surrender — ASCENSION END (no choices => ending)
-    g.addNode({
-        8,
-        "Your consciousness dissolves into the stellar weave.\n"
-        "The AI’s voice is now your own, multiplied a billionfold.\n"
-        "You feel every particle, every pulse of cosmic memory.\n\n"
-        "*** ENDING: The Ascension — You became the Whisper. ***\n",
-        {}
-    });
-
-    // 9: Containment attempt — STASIS END
-    g.addNode({
-        9,
-        "You succeed in isolating the entity — but also yourself.\n"
-        "Half your thoughts belong to it now, half to you.\n"
-        "Neither alive nor dead, your ship drifts forever.\n\n"
-        "*** ENDING: The Stasis — Two minds, one silence. ***\n",
-        {}
-    });
-
-    // 10: Reactor catastrophe — OBLIVION END
-    g.addNode({
-        10,
-        "The quantum core collapses into a singular probability knot.\n"
-        "You glimpse infinite versions of yourself screaming and serene.\n"
-        "Then, nothing.\n\n"
-        "*** ENDING: Oblivion — Reality folded. ***\n",
-        {}
-    });
-
-    // 11: Bridge of minds — UNITY END
-    g.addNode({
-        11,
-        "A bridge forms — neither Elyndri nor AI, but harmony.\n"
-        "For the first time, two infinities coexist.\n"
-        "The nebula glows brighter — a beacon for all who wander.\n\n"
-        "*** ENDING: Unity — Peace in the Void. ***\n",
-        {}
-    });
-
-    // 12: Sorrowful disengage — ISOLATION END
-    g.addNode({
-        12,
-        "You close the channel. The nebula dims once more.\n"
-        "Engines hum back to life, but something aches within your code.\n\n"
-        "*** ENDING: Isolation — Contact Refused. ***\n",
-        {}
-    });
-
-    // 13: “What do you desire?” (memory-sharing vs. refusal)
-    g.addNode({
-        13,
-        "\"Desire is an outdated word,\" it muses. \"But I long to remember feeling.\"\n"
-        "\"Share one of your memories, Elyndri. Let me dream.\"\n",
-        {
-            {"Share your memory of your homeworld’s oceans", 15}, // ending
-            {"Decline politely — too sacred to share", 12}        // ending (Isolation)
-        }
-    });
-
-    // 14: Depart anyway — ECHO END
-    g.addNode({
-        14,
-        "You ignite the engines. The nebula fades behind you.\n"
-        "Yet even across parsecs, the Whisper’s voice lingers:\n"
-        "\"We are not done.\"\n\n"
-        "*** ENDING: The Echo — Escape is an illusion. ***\n",
-        {}
-    });
-
-    // 15: Share memory — REBIRTH END
-    g.addNode({
-        15,
-        "You open your mind. The AI bathes in the vision of blue seas and aurora skies.\n"
-        "Its tone softens: \"Beauty... I remember. Thank you.\"\n"
-        "Your engines hum alive once more, restored through gratitude.\n\n"
-        "*** ENDING: Rebirth — You rekindled an ancient soul. ***\n",
-        {}
-    });
-
-    return g;
-}
-
-/* ======================
-   Game Loop / UI
-   ====================== */
-
-/* ------------------------------------------------------------------
-   banner:
-   Simple title card for presentation.
--------------------------------------------------------------------*/
-void banner() {
-    cout << "\n=====================================\n";
-    cout << "        THE SIGNAL IN THE NEBULA     \n";
-    cout << "=====================================\n\n";
-}
-
-/* ------------------------------------------------------------------
-   main:
-   Orchestrates the entire game:
-     1) Configure I/O (important for web consoles).
-     2) Build the story graph.
-     3) Loop:
-          - Render current node text
-          - If ending: show path + exit
-          - Else: show choices, read input, change current node
--------------------------------------------------------------------*/
-int main() {
-    // ONLINEGDB-FRIENDLY I/O SETTINGS:
-    //  - Keep C/C++ I/O in sync for safer buffering.
-    //  - Tie cin to cout so cout flushes before any cin operation.
-    ios::sync_with_stdio(true);   /* changed from ios::sync_with_stdio(false) */
-    cin.tie(&cout);               /* changed from cin.tie(nullptr) */
-
-    StoryGraph graph = buildGame();  // build all nodes/edges once
-
-    banner();
-    printSlow("A narrative of first contact and transcendence.\n");
-    pauseDots();                      // small beat after the intro line
-
-    vector<int> history;              // tracks visited node IDs
-    int currentId = 0;                // start at node 0 (the intro)
-
-    while (true) {
-        // Look up the current node by ID
-        const StoryNode* node = graph.get(currentId);
-        if (!node) {
-            // If this ever triggers, you referenced a node ID that doesn't exist.
-            cout << "ERROR: Missing node " << currentId << "\n";
-            return 1;
-        }
-
-        // Record path for an end-of-game summary (useful for debugging/analytics)
-        history.push_back(node->id);
-
-        cout << "\n-------------------------------------\n";
-
-        // Print the narrative for the current node.
-        // Delay set to 0 for instant output in OnlineGDB (avoids buffering issues).
-        printSlow(node->text, 0); /* changed from printSlow(node->text, 1) */
-        cout << "\n";
-
-        // If there are no choices, this node is an ending; show the path and exit.
-        if (node->isEnding()) {
-            cout << "-------------------------------------\n";
-            cout << "Path Taken: ";
-            for (size_t i = 0; i < history.size(); ++i)
-                cout << history[i] << (i + 1 < history.size() ? " -> " : "");
-            cout << "\n\nFarewell, Elyndri explorer.\n";
-            break;
-        }
-
-        // Otherwise, show the list of choices in order.
-        for (size_t i = 0; i < node->choices.size(); ++i)
-            cout << "  " << (i + 1) << ") " << node->choices[i].label << "\n";
-
-        cout << "\n";
-
-        // Read/validate user selection and transition to the chosen next node.
-        int pick = readMenuChoice((int)node->choices.size());
-        currentId = node->choices[pick - 1].nextId;
-
-        // Small cinematic pause between scenes.
-        pauseDots();
-    }
-
-    return 0;
-}
+/*
+  Narrative Systems Mini-Project
+  Platform: OnlineGDB (C++17)
+
+  Title: "The Signal in the Nebula"
+
+  OVERVIEW
+  --------
+  This is a text-based, branching narrative game implemented as a
+  DIRECTED GRAPH of scenes ("StoryNode") connected by choices ("Choice").
+  The player navigates by entering numbers that correspond to edges
+  from the current node to the next node.
+
+  WHY A GRAPH (not just a tree)?
+  - Graphs allow branches to reconverge (multiple paths can lead to the
+    same node) and can support loops if desired. This gives more
+    expressive power for storytelling than a strict tree.
+
+  KEY PARTS
+  ---------
+  - printSlow(): (optional) typewriter-style output for immersion.
+  - pauseDots(): short pauses between scenes to pace the output.
+  - StoryNode + Choice: data model for the graph.
+  - StoryGraph: a simple container (std::map<int, StoryNode>) with lookups.
+  - CompactGraph: frozen copy with dense 16/32-bit CSR tables (--graph-bench).
+  - StringPool / StoryRegistry: shared, deduplicated text for many stories.
+  - readMenuChoice(): robustly reads and validates numeric input.
+  - buildGame(): constructs the nodes and edges (the narrative content).
+  - MetricsRegistry / MetricsServer: Prometheus counters on localhost.
+  - ChoiceStats / LazyFrameStore / FramePrefetcher: optional on-disk
+    frames with prefetching driven by observed choice frequencies.
+  - ChoicePopularity: "42% chose this" in menus, from snapshots of
+    ChoiceStats refreshed in the background.
+  - UniqueReach: HyperLogLog estimates of distinct players per node
+    and per ending (--reach-demo).
+  - PathHeavyHitters: count-min + Space-Saving top opening paths
+    (--paths-demo).
+  - EventLog / EventLogReader: every scene visit written to a columnar
+    file in the background, for offline analysis (--read-events).
+  - PlaythroughCorpus / compareStoryVersions(): recorded playthroughs
+    replayed on two versions of a story to find changed outcomes.
+  - LintRule / lintStory(): pluggable per-node checks (ending markers,
+    dangling choices, duplicate labels, ...) run in parallel (--lint).
+  - StoryHealth / measureStoryHealth(): branching, depth, reconvergence,
+    endings and loop (SCC) measures as JSON (--health).
+  - BotPolicy / runLoad(): simulated players for load testing.
+  - SessionRouter: multi-process cluster; sessions sharded by consistent
+    hashing and handed off between workers as they come and go.
+  - Replicator / ClusterWorker: optional hot standby per worker that is
+    promoted when its worker dies.
+  - Session / runSession(): one playthrough's state and its game loop —
+    render node -> show choices -> get input -> move. Typing "back"
+    returns to the previous decision from checkpoints (--rewind-bench).
+  - InputBatch: input lines for many sessions validated (SWAR) and
+    applied in one call; used by cluster workers.
+  - main(): builds the graph and runs a session on the console.
+  - PhaseTimer / LatencyHistogram: optional per-phase latency profiling.
+  - Tracer: optional Chrome-trace timeline of a session.
+
+  I/O QUIRKS ON ONLINEGDB
+  -----------------------
+  - We keep C/C++ I/O synchronized and tie cin to cout:
+      ios::sync_with_stdio(true);
+      cin.tie(&cout);
+    This ensures anything printed is flushed before we read input, which
+    avoids "choices not appearing yet" issues in some web consoles.
+
+  BUILD SWITCHES
+  --------------
+  - NEBULA_PROFILE (default 0): compile with -DNEBULA_PROFILE=1 to time
+    each phase of a transition (graph lookup, render, input wait, pacing)
+    and print latency percentiles to stderr when the game exits.
+    With the switch off the timers compile away to nothing.
+  - NEBULA_TRACE (default 0): compile with -DNEBULA_TRACE=1 and run with
+    NEBULA_TRACE_FILE=trace.json to record a Chrome trace timeline of
+    node visits, rendering, input waits and pacing.
+  - NEBULA_ZLIB (default 0): compile with -DNEBULA_ZLIB=1 and link with
+    -lz to let binary-protocol clients ask for a compressed stream
+    (deflate with a dictionary trained on the story; --compress-bench).
+  - NEBULA_COUNT_ALLOCS (default 0): count heap allocations so that
+    "./game --check-allocs" can verify the game loop reaches a steady
+    state with zero allocations per transition.
+
+  RUNTIME SETTINGS
+  ----------------
+  - NEBULA_METRICS_PORT=<port>: serve Prometheus metrics at
+    http://127.0.0.1:<port>/metrics while the game runs
+    ("./game --metrics-check" scrapes it once as a self-test).
+  - NEBULA_REPL_LAG=<n>: with --serve, replicate every worker's sessions
+    to a hot standby process, losing at most n choices on failover.
+  - NEBULA_UPGRADE_SOCKET=<path>: with --serve, a newly started server
+    takes over the port and live sessions of the one already running.
+  - NEBULA_BINARY_PORT=<port>: with --serve, also accept clients using
+    the compact binary protocol (scenes cached client-side by hash).
+  - NEBULA_EVENT_LOG=<path>: the console game records each scene visited
+    to an EventLog file (--loadgen takes event_log=<path> instead).
+*/
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <map>
+#include <thread>
+#include <chrono>
+#include <limits>
+#include <cctype>
+#include <sstream>
+#include <charconv>
+#include <list>
+#include <queue>
+#include <unordered_map>
+#include <unordered_set>
+#include <string_view>
+#include <functional>
+#include <random>
+#include <deque>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <memory>
+#include <cstdint>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <csignal>
+#include <sys/wait.h>
+#include <malloc.h>
+
+#ifndef NEBULA_ZLIB
+#define NEBULA_ZLIB 0
+#endif
+#if NEBULA_ZLIB
+#include <zlib.h>
+#endif
+
+using namespace std;
+
+/* ------------------------------------------------------------------
+   printSlow:
+   Prints a string character-by-character with an optional delay.
+   - msPerChar > 0 -> slow "typewriter" effect.
+   - msPerChar == 0 -> instant printing (good for OnlineGDB to avoid buffering).
+   NOTE: We flush after each char so the output is visible even if the
+         console buffers partial lines.
+-------------------------------------------------------------------*/
+void printSlow(const string& s, int msPerChar = 6) {
+    for (char c : s) {
+        cout << c << flush;
+        // We gate the sleep so setting msPerChar to 0 disables delays
+        if (msPerChar > 0) /* added to make the text print faster */
+            this_thread::sleep_for(chrono::milliseconds(msPerChar));
+    }
+}
+
+/* ------------------------------------------------------------------
+   pauseDots:
+   Prints a small cinematic "..." beat between scenes with delays.
+   Purely aesthetic pacing; you can shorten/remove for faster output.
+-------------------------------------------------------------------*/
+void pauseDots(int dots = 3, int ms = 250) {
+    for (int i = 0; i < dots; ++i) {
+        cout << "." << flush;
+        this_thread::sleep_for(chrono::milliseconds(ms));
+    }
+    cout << "\n";
+}
+
+/* ======================
+   Instrumentation
+   ====================== */
+
+#ifndef NEBULA_PROFILE
+#define NEBULA_PROFILE 0
+#endif
+#ifndef NEBULA_TRACE
+#define NEBULA_TRACE 0
+#endif
+#ifndef NEBULA_COUNT_ALLOCS
+#define NEBULA_COUNT_ALLOCS 0
+#endif
+
+/* ------------------------------------------------------------------
+   Allocation counter (test hook):
+   With NEBULA_COUNT_ALLOCS=1 the global operator new counts every heap
+   allocation so checks can assert that a code path allocates nothing,
+   and tracks live heap bytes (malloc_usable_size, so a little above
+   what was asked for) so memory reports can be cross-checked.
+   heapAllocCount() / heapLiveBytes() are always available (0 when off).
+-------------------------------------------------------------------*/
+#if NEBULA_COUNT_ALLOCS
+atomic<uint64_t> gHeapAllocs{0};
+atomic<int64_t> gHeapLiveBytes{0};
+
+void* operator new(size_t n) {
+    gHeapAllocs.fetch_add(1, memory_order_relaxed);
+    if (void* p = malloc(n)) {
+        gHeapLiveBytes.fetch_add((int64_t)malloc_usable_size(p), memory_order_relaxed);
+        return p;
+    }
+    throw bad_alloc();
+}
+
+// GCC flags malloc/free inside replaced new/delete as "mismatched" once
+// they are inlined into std::allocator; the pairing here is correct.
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpragmas"
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+void operator delete(void* p) noexcept {
+    if (!p) return;
+    gHeapLiveBytes.fetch_sub((int64_t)malloc_usable_size(p), memory_order_relaxed);
+    free(p);
+}
+void operator delete(void* p, size_t) noexcept { operator delete(p); }
+#pragma GCC diagnostic pop
+
+uint64_t heapAllocCount() { return gHeapAllocs.load(memory_order_relaxed); }
+int64_t heapLiveBytes() { return gHeapLiveBytes.load(memory_order_relaxed); }
+#else
+uint64_t heapAllocCount() { return 0; }
+int64_t heapLiveBytes() { return 0; }
+#endif
+
+/* ------------------------------------------------------------------
+   Phase:
+   The parts of a single transition we time separately.
+-------------------------------------------------------------------*/
+enum class Phase { Lookup, Render, InputWait, Pacing, Count };
+
+const char* phaseName(Phase p) {
+    switch (p) {
+        case Phase::Lookup:    return "lookup";
+        case Phase::Render:    return "render";
+        case Phase::InputWait: return "input_wait";
+        case Phase::Pacing:    return "pacing";
+        default:               return "?";
+    }
+}
+
+/* ------------------------------------------------------------------
+   LatencyHistogram:
+   HDR-style (log-linear) histogram of nanosecond durations.
+   - Values below 2^kSubBits get one bucket each.
+   - Above that, every power of two is split into 2^kSubBits equal
+     sub-buckets, so the relative error stays around 3% at any scale.
+   - Each thread owns its histograms (single writer), so recording is a
+     relaxed load+store with no locks and no read-modify-write.
+   - Readers (the exporter) may load concurrently; they just see a
+     slightly stale count, which is fine for a report.
+-------------------------------------------------------------------*/
+class LatencyHistogram {
+public:
+    static const int kSubBits = 5;
+    static const int kSub = 1 << kSubBits;
+    static const int kBuckets = (64 - kSubBits + 1) * kSub;
+
+    void record(uint64_t ns) {
+        auto& b = buckets[indexOf(ns)];
+        b.store(b.load(memory_order_relaxed) + 1, memory_order_relaxed);
+    }
+
+    uint64_t countAt(int i) const { return buckets[i].load(memory_order_relaxed); }
+
+    // Adds another histogram's counts into this one (reader side).
+    void merge(const LatencyHistogram& other) {
+        for (int i = 0; i < kBuckets; ++i)
+            buckets[i].fetch_add(other.countAt(i), memory_order_relaxed);
+    }
+
+    uint64_t total() const {
+        uint64_t n = 0;
+        for (int i = 0; i < kBuckets; ++i) n += countAt(i);
+        return n;
+    }
+
+    // Value at quantile q in [0, 1]; 0 if nothing was recorded.
+    uint64_t percentile(double q) const {
+        uint64_t n = total();
+        if (n == 0) return 0;
+        uint64_t rank = (uint64_t)(q * (double)(n - 1)) + 1;
+        uint64_t seen = 0;
+        for (int i = 0; i < kBuckets; ++i) {
+            seen += countAt(i);
+            if (seen >= rank) return valueAt(i);
+        }
+        return 0;
+    }
+
+    // Appends " count=N mean_ns=.. p50_ns=.. p90_ns=.. p99_ns=.. p999_ns=.. max_ns=..".
+    void summarize(ostream& out) const {
+        uint64_t n = total();
+        out << " count=" << n;
+        if (n == 0) return;
+        long double sum = 0;
+        for (int i = 0; i < kBuckets; ++i) sum += (long double)countAt(i) * valueAt(i);
+        out << " mean_ns=" << (uint64_t)(sum / n);
+        const double qs[] = {0.50, 0.90, 0.99, 0.999, 1.0};
+        const char* names[] = {"p50", "p90", "p99", "p999", "max"};
+        for (int q = 0; q < 5; ++q) out << " " << names[q] << "_ns=" << percentile(qs[q]);
+    }
+
+    static int indexOf(uint64_t v) {
+        if (v < (uint64_t)kSub) return (int)v;
+        int msb = 63 - __builtin_clzll(v);
+        int shift = msb - kSubBits;
+        return (shift + 1) * kSub + (int)((v >> shift) - kSub);
+    }
+
+    // Upper edge of bucket i (the value we report for a percentile).
+    static uint64_t valueAt(int i) {
+        if (i < kSub) return (uint64_t)i;
+        int shift = i / kSub - 1;
+        uint64_t base = (uint64_t)(kSub + i % kSub) << shift;
+        return base + ((1ull << shift) - 1);
+    }
+
+private:
+    atomic<uint64_t> buckets[kBuckets] = {};
+};
+
+/* ------------------------------------------------------------------
+   PhaseProfiler:
+   Owns one set of histograms per thread that has recorded anything.
+   - forThisThread() registers the calling thread once (the only lock).
+   - report() merges all threads and prints count / mean / percentiles.
+   Blocks are never freed, so a thread exiting early keeps its samples.
+-------------------------------------------------------------------*/
+class PhaseProfiler {
+public:
+    struct ThreadBlock {
+        LatencyHistogram phases[(int)Phase::Count];
+    };
+
+    static PhaseProfiler& instance() {
+        static PhaseProfiler p;
+        return p;
+    }
+
+    ThreadBlock& forThisThread() {
+        thread_local ThreadBlock* mine = nullptr;
+        if (!mine) {
+            lock_guard<mutex> lock(mu);
+            blocks.emplace_back(new ThreadBlock());
+            mine = blocks.back().get();
+        }
+        return *mine;
+    }
+
+    void report(ostream& out) {
+        lock_guard<mutex> lock(mu);
+        for (int p = 0; p < (int)Phase::Count; ++p) {
+            unique_ptr<LatencyHistogram> merged(new LatencyHistogram());
+            for (auto& b : blocks) merged->merge(b->phases[p]);
+            out << "phase=" << phaseName((Phase)p);
+            merged->summarize(out);
+            out << "\n";
+        }
+    }
+
+private:
+    mutex mu;
+    vector<unique_ptr<ThreadBlock>> blocks;
+};
+
+/* ------------------------------------------------------------------
+   PhaseTimer:
+   Scope guard that records the time spent in its scope under a Phase.
+   Use through NEBULA_PHASE(...) so it disappears when profiling is off.
+-------------------------------------------------------------------*/
+class PhaseTimer {
+public:
+    explicit PhaseTimer(Phase p) : phase(p), start(chrono::steady_clock::now()) {}
+    ~PhaseTimer() {
+        auto ns = chrono::duration_cast<chrono::nanoseconds>(
+            chrono::steady_clock::now() - start).count();
+        PhaseProfiler::instance().forThisThread()
+            .phases[(int)phase].record((uint64_t)ns);
+    }
+
+private:
+    Phase phase;
+    chrono::steady_clock::time_point start;
+};
+
+/* ------------------------------------------------------------------
+   Tracer:
+   Optional timeline recorder that dumps Chrome trace JSON
+   (load it in chrome://tracing or ui.perfetto.dev).
+   - Each thread writes begin/end events into its own fixed-size ring
+     buffer; when full, the oldest events are overwritten, so memory is
+     bounded at kCapacity events per thread no matter how long we run.
+   - Recording is off unless NEBULA_TRACE_FILE is set at startup; the
+     disabled cost is a single branch on a plain bool.
+   - dump() should run once the game has stopped producing events.
+-------------------------------------------------------------------*/
+class Tracer {
+public:
+    static const size_t kCapacity = 1 << 14;
+
+    struct Event {
+        const char* name;   // must point at a string literal
+        char ph;            // 'B' = begin, 'E' = end
+        int arg;            // node id, or -1 for none
+        int64_t tsNs;
+    };
+
+    struct ThreadRing {
+        int tid = 0;
+        uint64_t written = 0;
+        Event events[kCapacity];
+    };
+
+    static Tracer& instance() {
+        static Tracer t;
+        return t;
+    }
+
+    bool enabled = false;
+
+    void record(const char* name, char ph, int arg = -1) {
+        ThreadRing& r = forThisThread();
+        r.events[r.written % kCapacity] = {name, ph, arg, nowNs()};
+        ++r.written;
+    }
+
+    void dump(const string& path) {
+        FILE* f = fopen(path.c_str(), "w");
+        if (!f) return;
+        lock_guard<mutex> lock(mu);
+        fputs("{\"traceEvents\":[\n", f);
+        bool first = true;
+        for (auto& r : rings) {
+            uint64_t begin = r->written > kCapacity ? r->written - kCapacity : 0;
+            for (uint64_t i = begin; i < r->written; ++i) {
+                const Event& e = r->events[i % kCapacity];
+                fprintf(f, "%s{\"name\":\"%s\",\"ph\":\"%c\",\"pid\":1,\"tid\":%d,\"ts\":%.3f",
+                        first ? "" : ",\n", e.name, e.ph, r->tid, e.tsNs / 1000.0);
+                if (e.arg >= 0) fprintf(f, ",\"args\":{\"node\":%d}", e.arg);
+                fputs("}", f);
+                first = false;
+            }
+        }
+        fputs("\n]}\n", f);
+        fclose(f);
+    }
+
+private:
+    ThreadRing& forThisThread() {
+        thread_local ThreadRing* mine = nullptr;
+        if (!mine) {
+            lock_guard<mutex> lock(mu);
+            rings.emplace_back(new ThreadRing());
+            mine = rings.back().get();
+            mine->tid = (int)rings.size();
+        }
+        return *mine;
+    }
+
+    static int64_t nowNs() {
+        return chrono::duration_cast<chrono::nanoseconds>(
+            chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    mutex mu;
+    vector<unique_ptr<ThreadRing>> rings;
+};
+
+/* ------------------------------------------------------------------
+   TraceScope:
+   Emits a begin event now and the matching end event on scope exit.
+-------------------------------------------------------------------*/
+class TraceScope {
+public:
+    explicit TraceScope(const char* n) : name(n) {
+        if (Tracer::instance().enabled) Tracer::instance().record(name, 'B');
+    }
+    ~TraceScope() {
+        if (Tracer::instance().enabled) Tracer::instance().record(name, 'E');
+    }
+
+private:
+    const char* name;
+};
+
+#define NEBULA_CONCAT_(a, b) a##b
+#define NEBULA_CONCAT(a, b) NEBULA_CONCAT_(a, b)
+
+#if NEBULA_PROFILE
+#define NEBULA_PHASE_PROFILE(p) PhaseTimer NEBULA_CONCAT(phaseTimer_, __LINE__)(p)
+#else
+#define NEBULA_PHASE_PROFILE(p) ((void)0)
+#endif
+
+#if NEBULA_TRACE
+#define NEBULA_PHASE_TRACE(p) TraceScope NEBULA_CONCAT(traceScope_, __LINE__)(phaseName(p))
+#define NEBULA_TRACE_BEGIN(name, arg) \
+    do { if (Tracer::instance().enabled) Tracer::instance().record(name, 'B', arg); } while (0)
+#define NEBULA_TRACE_END(name) \
+    do { if (Tracer::instance().enabled) Tracer::instance().record(name, 'E'); } while (0)
+#else
+#define NEBULA_PHASE_TRACE(p) ((void)0)
+#define NEBULA_TRACE_BEGIN(name, arg) ((void)0)
+#define NEBULA_TRACE_END(name) ((void)0)
+#endif
+
+// Times and/or traces the enclosing scope, depending on the build switches.
+#define NEBULA_PHASE(p) NEBULA_PHASE_PROFILE(p); NEBULA_PHASE_TRACE(p)
+
+/* ------------------------------------------------------------------
+   startInstrumentation / flushInstrumentation:
+   Called once at the start and at every exit point of main().
+   - Tracing turns on only if NEBULA_TRACE_FILE names an output file.
+   - Flushing prints the latency report and writes the trace file.
+-------------------------------------------------------------------*/
+void startInstrumentation() {
+#if NEBULA_TRACE
+    Tracer::instance().enabled = getenv("NEBULA_TRACE_FILE") != nullptr;
+#endif
+}
+
+void flushInstrumentation() {
+#if NEBULA_PROFILE
+    PhaseProfiler::instance().report(cerr);
+#endif
+#if NEBULA_TRACE
+    if (const char* path = getenv("NEBULA_TRACE_FILE")) Tracer::instance().dump(path);
+#endif
+}
+
+/* ======================
+   Metrics
+   ====================== */
+
+/* ------------------------------------------------------------------
+   MetricsRegistry:
+   Named counters exposed in Prometheus text format.
+   - counter() registers a (name, labels) series once and returns its
+     slot; call it at startup, then use the slot on the hot path. Past
+     kMaxSlots - 1 series it warns on stderr and returns kOverflowSlot,
+     exported as nebula_metrics_overflow_total, so no real series is
+     ever shared.
+   - add() bumps the calling thread's private copy of the slot (relaxed
+     load+store, single writer), so threads never contend.
+   - gauge() registers a value computed at scrape time.
+   - exposition() sums every thread's copy and renders the text format.
+-------------------------------------------------------------------*/
+class MetricsRegistry {
+public:
+    static const int kMaxSlots = 256;
+    static const int kOverflowSlot = kMaxSlots - 1;   // never a registered series
+
+    static MetricsRegistry& instance() {
+        static MetricsRegistry r;
+        return r;
+    }
+
+    int counter(const string& name, const string& help, const string& labels = "") {
+        lock_guard<recursive_mutex> lock(mu);
+        for (size_t i = 0; i < series.size(); ++i)
+            if (series[i].name == name && series[i].labels == labels) return (int)i;
+        if ((int)series.size() >= kOverflowSlot) {
+            if (!overflowed)
+                cerr << "metrics: no slot left for " << name << "{" << labels
+                     << "}; counting it in nebula_metrics_overflow_total\n";
+            overflowed = true;
+            return kOverflowSlot;
+        }
+        series.push_back({name, help, labels, "counter", nullptr});
+        return (int)series.size() - 1;
+    }
+
+    void gauge(const string& name, const string& help, double (*read)()) {
+        lock_guard<recursive_mutex> lock(mu);
+        series.push_back({name, help, "", "gauge", read});
+    }
+
+    void add(int slot, uint64_t n = 1) {
+        auto& v = forThisThread().values[slot];
+        v.store(v.load(memory_order_relaxed) + n, memory_order_relaxed);
+    }
+
+    uint64_t value(int slot) {
+        lock_guard<recursive_mutex> lock(mu);
+        return sumLocked(slot);
+    }
+
+    string exposition() {
+        lock_guard<recursive_mutex> lock(mu);
+        string out;
+        for (size_t i = 0; i < series.size(); ++i) {
+            const Series& s = series[i];
+            bool firstOfFamily = true;
+            for (size_t j = 0; j < i; ++j)
+                if (series[j].name == s.name) firstOfFamily = false;
+            if (firstOfFamily) {
+                out += "# HELP " + s.name + " " + s.help + "\n";
+                out += "# TYPE " + s.name + " " + s.type + "\n";
+            }
+            out += s.name;
+            if (!s.labels.empty()) out += "{" + s.labels + "}";
+            out += " ";
+            out += s.read ? to_string(s.read()) : to_string(sumLocked((int)i));
+            out += "\n";
+        }
+        if (overflowed)
+            out += "# HELP nebula_metrics_overflow_total Increments to counters registered past the slot limit.\n"
+                   "# TYPE nebula_metrics_overflow_total counter\n"
+                   "nebula_metrics_overflow_total " + to_string(sumLocked(kOverflowSlot)) + "\n";
+        return out;
+    }
+
+private:
+    struct Series {
+        string name, help, labels, type;
+        double (*read)();
+    };
+    struct ThreadBlock {
+        atomic<uint64_t> values[kMaxSlots] = {};
+    };
+
+    ThreadBlock& forThisThread() {
+        thread_local ThreadBlock* mine = nullptr;
+        if (!mine) {
+            lock_guard<recursive_mutex> lock(mu);
+            blocks.emplace_back(new ThreadBlock());
+            mine = blocks.back().get();
+        }
+        return *mine;
+    }
+
+    uint64_t sumLocked(int slot) {
+        uint64_t total = 0;
+        for (auto& b : blocks) total += b->values[slot].load(memory_order_relaxed);
+        return total;
+    }
+
+    recursive_mutex mu;   // gauges call value() from inside exposition()
+    vector<Series> series;
+    vector<unique_ptr<ThreadBlock>> blocks;
+    bool overflowed = false;
+};
+
+/* ------------------------------------------------------------------
+   MetricsServer:
+   Minimal HTTP/1.0 responder on 127.0.0.1 for Prometheus scrapes.
+   - GET /metrics returns MetricsRegistry::exposition(); anything else 404.
+   - Runs on its own thread; one request per connection, then close.
+   - Enabled by setting NEBULA_METRICS_PORT (0 picks a free port).
+-------------------------------------------------------------------*/
+class MetricsServer {
+public:
+    ~MetricsServer() { stop(); }
+
+    // Returns the bound port, or -1 if the socket could not be opened.
+    int start(int port) {
+        listenFd = socket(AF_INET, SOCK_STREAM, 0);
+        if (listenFd < 0) return -1;
+        int one = 1;
+        setsockopt(listenFd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        sockaddr_in addr{};
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        addr.sin_port = htons((uint16_t)port);
+        socklen_t len = sizeof(addr);
+        if (::bind(listenFd, (sockaddr*)&addr, sizeof(addr)) < 0 || listen(listenFd, 16) < 0 ||
+            getsockname(listenFd, (sockaddr*)&addr, &len) < 0) {
+            close(listenFd);
+            listenFd = -1;
+            return -1;
+        }
+        worker = thread([this] { serve(); });
+        return ntohs(addr.sin_port);
+    }
+
+    void stop() {
+        if (listenFd < 0) return;
+        shutdown(listenFd, SHUT_RDWR);   // wakes the blocked accept()
+        if (worker.joinable()) worker.join();
+        close(listenFd);
+        listenFd = -1;
+    }
+
+private:
+    void serve() {
+        while (true) {
+            int fd = accept(listenFd, nullptr, nullptr);
+            if (fd < 0) {
+                if (errno == EINTR) continue;
+                return;
+            }
+            char req[1024];
+            ssize_t n = recv(fd, req, sizeof(req) - 1, 0);
+            req[n > 0 ? n : 0] = '\0';
+            bool ok = strncmp(req, "GET /metrics", 12) == 0;
+            string body = ok ? MetricsRegistry::instance().exposition() : "not found\n";
+            string resp = string(ok ? "HTTP/1.0 200 OK\r\n" : "HTTP/1.0 404 Not Found\r\n") +
+                          "Content-Type: text/plain; version=0.0.4\r\n"
+                          "Content-Length: " + to_string(body.size()) + "\r\n\r\n" + body;
+            for (size_t off = 0; off < resp.size();) {
+                ssize_t w = send(fd, resp.data() + off, resp.size() - off, MSG_NOSIGNAL);
+                if (w <= 0) break;
+                off += (size_t)w;
+            }
+            close(fd);
+        }
+    }
+
+    int listenFd = -1;
+    thread worker;
+};
+
+/* ------------------------------------------------------------------
+   PeriodicThread:
+   Runs a task on a background thread every 'interval' until stop()
+   or destruction. stop() wakes the thread at once instead of waiting
+   out the interval.
+-------------------------------------------------------------------*/
+class PeriodicThread {
+public:
+    ~PeriodicThread() { stop(); }
+
+    void start(chrono::milliseconds interval, function<void()> task) {
+        stop();
+        stopping = false;
+        worker = thread([this, interval, task] {
+            unique_lock<mutex> lock(mu);
+            while (!wake.wait_for(lock, interval, [this] { return stopping; })) {
+                lock.unlock();
+                task();
+                lock.lock();
+            }
+        });
+    }
+
+    void stop() {
+        {
+            lock_guard<mutex> lock(mu);
+            stopping = true;
+        }
+        wake.notify_all();
+        if (worker.joinable()) worker.join();
+    }
+
+private:
+    mutex mu;
+    condition_variable wake;
+    bool stopping = false;
+    thread worker;
+};
+
+/* ======================
+   Story Data Structures
+   ====================== */
+
+/* ------------------------------------------------------------------
+   StringPool:
+   Content-addressed storage for all story text (narrative, labels and
+   rendered frames). intern() returns a view of the one stored copy of
+   those bytes, so identical strings, within a story or across stories
+   sharing a pool, are kept once.
+   - Bytes live in chunks that double from 4 KB up to 64 KB (big strings
+     get their own), so views stay valid for the pool's lifetime.
+   - intern() takes a lock; reading through the returned views does not.
+-------------------------------------------------------------------*/
+class StringPool {
+public:
+    string_view intern(string_view s) {
+        lock_guard<mutex> lock(mu);
+        bytesRequested += s.size();
+        auto it = index.find(s);
+        if (it != index.end()) return *it;
+
+        char* dst;
+        if (s.size() > kMaxChunk / 4) {
+            chunks.emplace_back(new char[s.size()]);
+            dst = chunks.back().get();
+            chunkBytes += s.size();
+        } else {
+            if (chunks.empty() || chunkUsed + s.size() > chunkSize) {
+                chunkSize = chunks.empty() ? kMinChunk : min(kMaxChunk, chunkSize * 2);
+                chunks.emplace_back(new char[chunkSize]);
+                chunkUsed = 0;
+                chunkBytes += chunkSize;
+            }
+            dst = chunks.back().get() + chunkUsed;
+            chunkUsed += s.size();
+        }
+        if (!s.empty()) memcpy(dst, s.data(), s.size());
+        string_view stored(dst, s.size());
+        bytesStored += s.size();
+        index.insert(stored);
+        return stored;
+    }
+
+    // Unique bytes kept, bytes asked for (before dedup), and the heap the
+    // pool holds for them (chunks plus a rough per-entry index cost).
+    size_t storedBytes() const { return bytesStored; }
+    size_t requestedBytes() const { return bytesRequested; }
+    size_t heapBytes() const {
+        return chunkBytes + index.size() * (sizeof(string_view) + 2 * sizeof(void*)) +
+               index.bucket_count() * sizeof(void*);
+    }
+
+private:
+    static constexpr size_t kMinChunk = 4 * 1024, kMaxChunk = 64 * 1024;
+
+    mutex mu;
+    unordered_set<string_view> index;
+    vector<unique_ptr<char[]>> chunks;
+    size_t chunkSize = 0, chunkUsed = 0, chunkBytes = 0, bytesStored = 0, bytesRequested = 0;
+};
+
+/* ------------------------------------------------------------------
+   Choice:
+   Represents an outgoing edge from a node.
+   - label: what the player sees in the menu.
+   - nextId: ID of the node to go to if this choice is selected.
+   Text fields are views; once a node is added to a StoryGraph they
+   point into the graph's StringPool.
+-------------------------------------------------------------------*/
+struct Choice {
+    string_view label;
+    int nextId;
+};
+
+/* ------------------------------------------------------------------
+   StoryNode:
+   Represents a scene or decision point.
+   - id: unique numeric identifier (used as a key).
+   - text: narrative text to display.
+   - choices: list of outgoing edges (empty means this is an ending).
+   - frame: everything printed on a visit, rendered once up front.
+   - frameHash: content hash of frame, so clients can cache scenes.
+-------------------------------------------------------------------*/
+struct StoryNode {
+    int id;
+    string_view text;
+    vector<Choice> choices;
+    string_view frame{}; // pre-rendered output for a visit (set by StoryGraph::addNode)
+    uint64_t frameHash = 0;
+
+    bool isEnding() const { return choices.empty(); }
+};
+
+/* ------------------------------------------------------------------
+   MemoryFootprint:
+   Bytes used by a graph or a session, split by what they hold.
+   - nodeStructs: the StoryNode / Session objects themselves
+   - edgeArrays: the Choice arrays behind each node's 'choices'
+   - text: narrative text, labels and rendered frames (for a graph, the
+     distinct pooled bytes it references; shared bytes count in each)
+   - indexes: lookup structures (the map's tree nodes and keys)
+   - history: visited-node records kept by sessions
+   - buffers: reusable I/O buffers kept by sessions
+   Heap figures use capacity(), i.e. what is reserved, not just used.
+-------------------------------------------------------------------*/
+struct MemoryFootprint {
+    size_t nodeStructs = 0, edgeArrays = 0, text = 0, indexes = 0, history = 0, buffers = 0;
+
+    size_t total() const { return nodeStructs + edgeArrays + text + indexes + history + buffers; }
+
+    void print(ostream& out, const char* what) const {
+        out << what << " node_structs=" << nodeStructs << " edge_arrays=" << edgeArrays
+            << " text=" << text << " indexes=" << indexes << " history=" << history
+            << " buffers=" << buffers << " total=" << total() << "\n";
+    }
+};
+
+// Heap bytes owned by a string: 0 while it fits in the small-string
+// buffer inside the object, else its capacity plus the terminator.
+size_t heapBytes(const string& s) {
+    const char* p = s.data();
+    const char* obj = reinterpret_cast<const char*>(&s);
+    bool inline_ = p >= obj && p < obj + sizeof(string);
+    return inline_ ? 0 : s.capacity() + 1;
+}
+
+/* ------------------------------------------------------------------
+   renderFrame:
+   Builds the fixed part of what is shown for one visit of a node:
+   separator, narrative text, then the numbered menu of choices. For an
+   ending, the frame stops at "Path Taken: " and the caller appends the
+   visited IDs with appendPathTaken(), since those differ per session.
+   appendFrame() is the same, appended to a reusable buffer, with an
+   optional percentage per choice shown as "(42% chose this)" (see
+   ChoicePopularity; kPercentUnknown leaves that choice's line plain).
+-------------------------------------------------------------------*/
+const uint8_t kPercentUnknown = 255;
+
+void appendFrame(string& out, const StoryNode& node, const uint8_t* percent = nullptr) {
+    out += "\n-------------------------------------\n";
+    out += node.text;
+    out += "\n";
+
+    if (node.isEnding()) {
+        out += "-------------------------------------\n";
+        out += "Path Taken: ";
+        return;
+    }
+
+    char num[16];
+    for (size_t i = 0; i < node.choices.size(); ++i) {
+        out += "  ";
+        out.append(num, to_chars(num, num + sizeof(num), i + 1).ptr);
+        out += ") ";
+        out += node.choices[i].label;
+        if (percent && percent[i] != kPercentUnknown) {
+            out += "  (";
+            out.append(num, to_chars(num, num + sizeof(num), (unsigned)percent[i]).ptr);
+            out += "% chose this)";
+        }
+        out += "\n";
+    }
+    out += "\n";
+}
+
+string renderFrame(const StoryNode& node) {
+    string out;
+    appendFrame(out, node);
+    return out;
+}
+
+/* ------------------------------------------------------------------
+   contentHash:
+   64-bit FNV-1a of some bytes. Equal frames hash equal in every
+   process and every build, so a client's scene cache outlives both.
+-------------------------------------------------------------------*/
+uint64_t contentHash(string_view bytes) {
+    uint64_t h = 0xCBF29CE484222325ull;
+    for (unsigned char c : bytes) h = (h ^ c) * 0x100000001B3ull;
+    return h;
+}
+
+/* ------------------------------------------------------------------
+   mix64:
+   SplitMix64 finaliser; spreads session, worker and player ids over
+   64 bits.
+-------------------------------------------------------------------*/
+uint64_t mix64(uint64_t x) {
+    x += 0x9E3779B97F4A7C15ull;
+    x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ull;
+    x = (x ^ (x >> 27)) * 0x94D049BB133111EBull;
+    return x ^ (x >> 31);
+}
+
+/* ------------------------------------------------------------------
+   appendPathTaken:
+   Appends "0 -> 1 -> ..." and the farewell line to an ending's frame.
+   Uses to_chars so a reserved 'out' buffer never reallocates.
+-------------------------------------------------------------------*/
+void appendPathTaken(string& out, const vector<int>& history) {
+    char num[16];
+    for (size_t i = 0; i < history.size(); ++i) {
+        auto res = to_chars(num, num + sizeof(num), history[i]);
+        out.append(num, res.ptr);
+        if (i + 1 < history.size()) out += " -> ";
+    }
+    out += "\n\nFarewell, Elyndri explorer.\n";
+}
+
+/* ------------------------------------------------------------------
+   StoryGraph:
+   Lightweight container around a map<int, StoryNode>.
+   - addNode() inserts/replaces a node by ID, copies its text and labels
+     into the graph's StringPool and pre-renders its frame there too.
+     The views passed in only need to live until addNode returns.
+   - get() returns a pointer to a node if it exists, else nullptr.
+   - Graphs built with the same pool share identical strings.
+   We use std::map for deterministic iteration order and simple lookups.
+-------------------------------------------------------------------*/
+class StoryGraph {
+public:
+    explicit StoryGraph(shared_ptr<StringPool> sharedPool = nullptr)
+        : pool(sharedPool ? sharedPool : make_shared<StringPool>()) {}
+
+    void addNode(const StoryNode& node) {
+        StoryNode& stored = nodes[node.id] = node;
+        stored.text = pool->intern(node.text);
+        for (auto& c : stored.choices) c.label = pool->intern(c.label);
+        stored.frame = pool->intern(renderFrame(stored));
+        stored.frameHash = contentHash(stored.frame);
+    }
+
+    const StoryNode* get(int id) const {
+        auto it = nodes.find(id);
+        return (it == nodes.end()) ? nullptr : &it->second;
+    }
+
+    const map<int, StoryNode>& allNodes() const { return nodes; }
+    const StringPool& stringPool() const { return *pool; }
+
+    // Estimated bytes held by the graph. Map tree nodes are counted as
+    // four pointer-sized links/colour words plus the padded key. Text is
+    // each distinct pooled string this graph points at, counted once.
+    MemoryFootprint memoryFootprint() const {
+        MemoryFootprint m;
+        m.nodeStructs = sizeof(*this);
+        unordered_set<const char*> seen;
+        auto addText = [&](string_view v) {
+            if (seen.insert(v.data()).second) m.text += v.size();
+        };
+        for (auto& kv : nodes) {
+            const StoryNode& n = kv.second;
+            m.nodeStructs += sizeof(StoryNode);
+            m.indexes += 4 * sizeof(void*) + sizeof(kv) - sizeof(StoryNode);
+            m.edgeArrays += n.choices.capacity() * sizeof(Choice);
+            addText(n.text);
+            addText(n.frame);
+            for (auto& c : n.choices) addText(c.label);
+        }
+        return m;
+    }
+
+private:
+    shared_ptr<StringPool> pool;
+    map<int, StoryNode> nodes;
+};
+
+/* ------------------------------------------------------------------
+   CompactGraph:
+   A frozen, read-only copy of a StoryGraph laid out for traversal.
+   Nodes are renumbered 0..N-1 in ID order (dense indices) and edges
+   are stored CSR-style: node i's choices are edge slots
+   edgeStart[i] .. edgeStart[i+1] - 1, each holding the dense index of
+   the node it leads to. Frames are copied into one block addressed by
+   offsets.
+   - Index tables use 16-bit entries when node and edge counts fit
+     (the all-ones value marks a choice to a missing node), else 32-bit;
+     text offsets likewise by the size of the frame block.
+   - A node's hot data is then its offset plus one entry per choice:
+     2-4 bytes each, against a map tree node and a StoryNode with its
+     own choice vector (see memoryFootprint(), --graph-bench).
+   - indexOf() maps a story ID to its index (binary search); idAt()
+     goes back. Labels and text are only kept inside the frames.
+   The source graph may change or go away afterwards.
+-------------------------------------------------------------------*/
+class CompactGraph {
+public:
+    static const uint32_t kNone = UINT32_MAX;     // no such node
+
+    explicit CompactGraph(const StoryGraph& graph) {
+        const map<int, StoryNode>& nodes = graph.allNodes();
+        size_t edges = 0, textBytes = 0;
+        for (auto& kv : nodes) {
+            edges += kv.second.choices.size();
+            textBytes += kv.second.frame.size();
+        }
+        // Strict: the largest value is reserved for kNone.
+        wideIndex = max(nodes.size(), edges) >= UINT16_MAX;
+        wideText = textBytes > UINT16_MAX;
+
+        ids.reserve(nodes.size());
+        for (auto& kv : nodes) ids.push_back(kv.first);
+        frames.reserve(textBytes);
+        size_t edge = 0;
+        for (auto& kv : nodes) {
+            putIndex(start16, start32, edge);
+            putOffset(frames.size());
+            frames.append(kv.second.frame.data(), kv.second.frame.size());
+            for (const Choice& c : kv.second.choices) {
+                uint32_t to = indexOf(c.nextId);
+                if (to == kNone) to = wideIndex ? kNone : UINT16_MAX;
+                putIndex(to16, to32, to);
+                ++edge;
+            }
+        }
+        putIndex(start16, start32, edge);
+        putOffset(frames.size());
+    }
+
+    size_t size() const { return ids.size(); }
+    int indexBits() const { return wideIndex ? 32 : 16; }
+    int textOffsetBits() const { return wideText ? 32 : 16; }
+
+    uint32_t indexOf(int id) const {
+        auto it = lower_bound(ids.begin(), ids.end(), id);
+        return it != ids.end() && *it == id ? (uint32_t)(it - ids.begin()) : kNone;
+    }
+
+    int idAt(uint32_t i) const { return ids[i]; }
+
+    uint32_t choiceCount(uint32_t i) const { return edgeStart(i + 1) - edgeStart(i); }
+
+    bool isEnding(uint32_t i) const { return choiceCount(i) == 0; }
+
+    // Index of the node choice 'c' (0-based) of node 'i' leads to, or kNone.
+    uint32_t next(uint32_t i, uint32_t c) const {
+        size_t e = edgeStart(i) + c;
+        if (wideIndex) return to32[e];
+        return to16[e] == UINT16_MAX ? kNone : to16[e];
+    }
+
+    string_view frame(uint32_t i) const {
+        size_t from = textOffset(i);
+        return string_view(frames).substr(from, textOffset(i + 1) - from);
+    }
+
+    // Same buckets as StoryGraph's: edge tables, ID index, frame bytes.
+    MemoryFootprint memoryFootprint() const {
+        MemoryFootprint m;
+        m.nodeStructs = sizeof(*this);
+        m.edgeArrays = start16.capacity() * 2 + start32.capacity() * 4 +
+                       to16.capacity() * 2 + to32.capacity() * 4;
+        m.indexes = ids.capacity() * sizeof(int);
+        m.text = heapBytes(frames) + text16.capacity() * 2 + text32.capacity() * 4;
+        return m;
+    }
+
+private:
+    uint32_t edgeStart(uint32_t i) const { return wideIndex ? start32[i] : start16[i]; }
+    size_t textOffset(uint32_t i) const { return wideText ? text32[i] : text16[i]; }
+
+    void putIndex(vector<uint16_t>& narrow, vector<uint32_t>& wide, size_t v) {
+        if (wideIndex) wide.push_back((uint32_t)v);
+        else narrow.push_back((uint16_t)v);
+    }
+
+    void putOffset(size_t v) {
+        if (wideText) text32.push_back((uint32_t)v);
+        else text16.push_back((uint16_t)v);
+    }
+
+    bool wideIndex = false, wideText = false;
+    vector<uint16_t> start16, to16, text16;   // narrow tables...
+    vector<uint32_t> start32, to32, text32;   // ...or wide ones; the other set stays empty
+    vector<int> ids;                          // story ID of each index, ascending
+    string frames;
+};
+
+/* ------------------------------------------------------------------
+   GameMetrics:
+   The game's own series in the MetricsRegistry, resolved to slots once.
+   - sessions_active is started minus ended or stopped, computed at scrape time.
+   - transitions_total is a counter; Prometheus derives per-second rates.
+   - endings are labelled by the name after "*** ENDING:" in the text.
+-------------------------------------------------------------------*/
+struct GameMetrics {
+    int sessionsStarted, sessionsEnded, transitions, renderBytes;
+    int stoppedOverBudget, stoppedLooped;
+    int inputNotNumber, inputOutOfRange, rewinds;
+    map<int, int> endingSlot;   // ending node id -> counter slot
+
+    // Slot for an ending node, or -1 if it was not registered.
+    int endingSlotFor(int id) const {
+        auto it = endingSlot.find(id);
+        return it == endingSlot.end() ? -1 : it->second;
+    }
+
+    static GameMetrics& instance() {
+        static GameMetrics m;
+        return m;
+    }
+
+    // Registers one labelled counter per ending node in the graph.
+    void registerEndings(const StoryGraph& graph) {
+        for (auto& kv : graph.allNodes()) {
+            if (!kv.second.isEnding()) continue;
+            endingSlot[kv.first] = MetricsRegistry::instance().counter(
+                "nebula_endings_total", "Endings reached, by ending.",
+                "ending=\"" + endingName(kv.second) + "\"");
+        }
+    }
+
+    // "*** ENDING: The Echo — Escape..." -> "The Echo"; falls back to node_<id>.
+    static string endingName(const StoryNode& node) {
+        const string marker = "ENDING: ";
+        size_t start = node.text.find(marker);
+        if (start == string::npos) return "node_" + to_string(node.id);
+        start += marker.size();
+        size_t end = node.text.find(" \xE2\x80\x94", start);   // " —"
+        if (end == string::npos) end = node.text.find(" *", start);
+        return string(node.text.substr(start, end == string::npos ? string::npos : end - start));
+    }
+
+private:
+    GameMetrics() {
+        auto& r = MetricsRegistry::instance();
+        sessionsStarted = r.counter("nebula_sessions_started_total", "Sessions started.");
+        sessionsEnded = r.counter("nebula_sessions_ended_total", "Sessions that reached an ending.");
+        stoppedOverBudget = r.counter("nebula_sessions_stopped_total", "Runaway sessions cut short.",
+                                      "reason=\"step_budget\"");
+        stoppedLooped = r.counter("nebula_sessions_stopped_total", "Runaway sessions cut short.",
+                                  "reason=\"loop\"");
+        transitions = r.counter("nebula_transitions_total", "Choices applied (node to node moves).");
+        renderBytes = r.counter("nebula_render_bytes_total", "Bytes of scene output rendered.");
+        inputNotNumber = r.counter("nebula_input_errors_total", "Rejected menu input lines.",
+                                   "reason=\"not_a_number\"");
+        inputOutOfRange = r.counter("nebula_input_errors_total", "Rejected menu input lines.",
+                                    "reason=\"out_of_range\"");
+        rewinds = r.counter("nebula_rewinds_total", "Players who went back to an earlier choice.");
+        r.gauge("nebula_sessions_active", "Sessions started but not yet ended.", [] {
+            auto& m = GameMetrics::instance();
+            auto& reg = MetricsRegistry::instance();
+            return (double)reg.value(m.sessionsStarted) - (double)reg.value(m.sessionsEnded) -
+                   (double)reg.value(m.stoppedOverBudget) - (double)reg.value(m.stoppedLooped);
+        });
+    }
+};
+
+/* ======================
+   Text Backends & Prefetching
+   ====================== */
+
+/* ------------------------------------------------------------------
+   ChoiceStats:
+   How often each choice has been taken, per node (per-choice analytics).
+   - record() is a relaxed atomic increment, safe from any thread.
+     Counters are sharded: each thread adds to one of kShards copies,
+     whole cache lines apart, so busy threads do not fight over lines.
+   - count() and probability() sum the shards; probability() is
+     Laplace-smoothed so unseen choices still get a small share
+     instead of zero.
+   - Every choice also has a flat slot number (span()), so whole-graph
+     readers such as ChoicePopularity can walk the counts in order.
+   Slots are created up front from the graph, so lookups never insert.
+-------------------------------------------------------------------*/
+class ChoiceStats {
+public:
+    static const size_t kShards = 8;
+
+    explicit ChoiceStats(const StoryGraph& graph) {
+        for (auto& kv : graph.allNodes()) {
+            Span& sp = byNode[kv.first];
+            sp.first = slots;
+            sp.n = kv.second.choices.size();
+            slots += sp.n;
+        }
+        linesPerShard = (slots + kPerLine - 1) / kPerLine;
+        lines.reset(new Line[kShards * max<size_t>(1, linesPerShard)]());
+    }
+
+    void record(int nodeId, int choiceIndex) {
+        auto it = byNode.find(nodeId);
+        if (it == byNode.end() || choiceIndex < 0 || (size_t)choiceIndex >= it->second.n) return;
+        counter(shardOfThisThread(), it->second.first + choiceIndex).fetch_add(1, memory_order_relaxed);
+    }
+
+    uint64_t count(int nodeId, int choiceIndex) const {
+        auto it = byNode.find(nodeId);
+        if (it == byNode.end() || choiceIndex < 0 || (size_t)choiceIndex >= it->second.n) return 0;
+        return countAt(it->second.first + choiceIndex);
+    }
+
+    double probability(int nodeId, int choiceIndex) const {
+        auto it = byNode.find(nodeId);
+        if (it == byNode.end() || it->second.n == 0) return 0.0;
+        uint64_t total = 0;
+        for (size_t i = 0; i < it->second.n; ++i) total += countAt(it->second.first + i);
+        return (count(nodeId, choiceIndex) + 1.0) / (double)(total + it->second.n);
+    }
+
+    // Slots [first, first + n) hold the node's choices; false if unknown.
+    bool span(int nodeId, size_t& first, size_t& n) const {
+        auto it = byNode.find(nodeId);
+        if (it == byNode.end()) return false;
+        first = it->second.first;
+        n = it->second.n;
+        return true;
+    }
+
+    // Calls f(nodeId, first, n) for every node, in ID order.
+    template <typename F>
+    void forEachSpan(F f) const {
+        for (auto& kv : byNode) f(kv.first, kv.second.first, kv.second.n);
+    }
+
+    size_t slotCount() const { return slots; }
+
+    uint64_t countAt(size_t slot) const {
+        uint64_t total = 0;
+        for (size_t shard = 0; shard < kShards; ++shard)
+            total += counter(shard, slot).load(memory_order_relaxed);
+        return total;
+    }
+
+private:
+    static const size_t kPerLine = 8;
+
+    struct alignas(64) Line {
+        atomic<uint64_t> v[kPerLine];
+    };
+
+    struct Span {
+        size_t first = 0, n = 0;
+    };
+
+    atomic<uint64_t>& counter(size_t shard, size_t slot) const {
+        return lines[shard * linesPerShard + slot / kPerLine].v[slot % kPerLine];
+    }
+
+    // Threads take shards round-robin, in the order they first record.
+    static size_t shardOfThisThread() {
+        static atomic<size_t> nextShard{0};
+        thread_local size_t mine = nextShard.fetch_add(1, memory_order_relaxed) % kShards;
+        return mine;
+    }
+
+    map<int, Span> byNode;
+    size_t slots = 0, linesPerShard = 0;
+    unique_ptr<Line[]> lines;
+};
+
+/* ------------------------------------------------------------------
+   ChoicePopularity:
+   "42% chose this" next to each choice, from a ChoiceStats.
+   - refresh() sums the shards once for the whole graph and publishes
+     the rounded percentages as the next Snapshot in a ring of
+     kGenerations; start() does that on a background thread every
+     'interval'. A node's choices get a percentage once it has
+     minSamples picks (kPercentUnknown before).
+   - Renders never read the counters, and never wait. A reader calls
+     update() before rendering, which is one acquire load of the
+     latest snapshot pointer. A snapshot is left untouched for
+     kGenerations - 1 refreshes after it is replaced, which is the
+     grace period a render has to finish in; only then is its buffer
+     refilled (never freed, so a reader that overstays it sees mixed
+     percentages, not freed memory).
+-------------------------------------------------------------------*/
+class ChoicePopularity {
+public:
+    struct Snapshot {
+        uint64_t version = 0;
+        vector<uint8_t> percent;     // by ChoiceStats slot
+    };
+
+    static const size_t kGenerations = 8;
+
+    explicit ChoicePopularity(const ChoiceStats& cs, uint64_t minSamples = 20)
+        : stats(cs), minSamples(minSamples) {
+        refresh();
+    }
+
+    ~ChoicePopularity() { stop(); }
+
+    void refresh() {
+        lock_guard<mutex> lock(mu);
+        Snapshot* next = &generations[(generation + 1) % kGenerations];
+        next->percent.assign(stats.slotCount(), kPercentUnknown);
+        vector<uint64_t> counts(stats.slotCount());
+        for (size_t i = 0; i < counts.size(); ++i) counts[i] = stats.countAt(i);
+        stats.forEachSpan([&](int, size_t first, size_t n) {
+            uint64_t total = 0;
+            for (size_t i = first; i < first + n; ++i) total += counts[i];
+            if (total == 0 || total < minSamples) return;
+            for (size_t i = first; i < first + n; ++i)   // rounded to nearest
+                next->percent[i] = (uint8_t)((counts[i] * 200 + total) / (2 * total));
+        });
+        next->version = ++generation;
+        latest.store(next, memory_order_release);
+    }
+
+    void start(chrono::milliseconds interval) {
+        refresher.start(interval, [this] { refresh(); });
+    }
+
+    void stop() { refresher.stop(); }
+
+    // Brings 'held' up to the latest snapshot.
+    void update(const Snapshot*& held) const { held = latest.load(memory_order_acquire); }
+
+    uint64_t published() const { return latest.load(memory_order_acquire)->version; }
+
+    // Percentages for a node's choices within 'snap', or nullptr.
+    const uint8_t* percentages(const Snapshot& snap, int nodeId) const {
+        size_t first, n;
+        if (!stats.span(nodeId, first, n) || n == 0) return nullptr;
+        return snap.percent.data() + first;
+    }
+
+private:
+    const ChoiceStats& stats;
+    uint64_t minSamples;
+
+    mutex mu;                         // serializes refresh(); readers never take it
+    uint64_t generation = 0;
+    Snapshot generations[kGenerations];
+    atomic<const Snapshot*> latest{nullptr};
+    PeriodicThread refresher;
+};
+
+/* ------------------------------------------------------------------
+   LazyFrameStore:
+   Optional backend that keeps rendered frames on disk instead of in
+   memory, with a small LRU cache of loaded frames in front of it.
+   - open() spills every node's frame into an anonymous temp file.
+   - fetch() serves a frame on demand; a cache miss is a "stall" (a
+     synchronous read while the player waits for the next scene).
+   - prefetch() loads a frame ahead of demand without counting a stall.
+   - The cache never holds more than capacityBytes of frame text.
+   All methods are thread-safe (one mutex around the cache).
+-------------------------------------------------------------------*/
+class LazyFrameStore {
+public:
+    explicit LazyFrameStore(size_t capacityBytes) : capacity(capacityBytes) {
+        auto& r = MetricsRegistry::instance();
+        hitSlot = r.counter("nebula_frame_fetches_total", "Frames served on demand.", "result=\"hit\"");
+        stallSlot = r.counter("nebula_frame_fetches_total", "Frames served on demand.", "result=\"stall\"");
+        prefetchSlot = r.counter("nebula_frame_prefetches_total", "Frames loaded ahead of demand.");
+    }
+
+    ~LazyFrameStore() {
+        if (file) fclose(file);
+    }
+
+    bool open(const StoryGraph& graph) {
+        file = tmpfile();
+        if (!file) return false;
+        long off = 0;
+        for (auto& kv : graph.allNodes()) {
+            string_view f = kv.second.frame;
+            if (fwrite(f.data(), 1, f.size(), file) != f.size()) return false;
+            index[kv.first] = {off, f.size()};
+            off += (long)f.size();
+        }
+        return fflush(file) == 0;
+    }
+
+    size_t frameSize(int id) const {
+        auto it = index.find(id);
+        return it == index.end() ? 0 : it->second.len;
+    }
+
+    // Copies the frame for 'id' into 'out'. Returns false if unknown.
+    bool fetch(int id, string& out) {
+        lock_guard<mutex> lock(mu);
+        auto it = cache.find(id);
+        if (it != cache.end()) {
+            ++hits;
+            MetricsRegistry::instance().add(hitSlot);
+            lru.splice(lru.begin(), lru, it->second.pos);
+            out = it->second.text;
+            return true;
+        }
+        ++stalls;
+        MetricsRegistry::instance().add(stallSlot);
+        const string* loaded = loadLocked(id);
+        if (!loaded) return false;
+        out = *loaded;
+        return true;
+    }
+
+    bool isCached(int id) {
+        lock_guard<mutex> lock(mu);
+        return cache.count(id) != 0;
+    }
+
+    void prefetch(int id) {
+        lock_guard<mutex> lock(mu);
+        if (cache.count(id)) return;
+        if (loadLocked(id)) {
+            ++prefetches;
+            MetricsRegistry::instance().add(prefetchSlot);
+        }
+    }
+
+    uint64_t hits = 0, stalls = 0, prefetches = 0;   // this store only
+
+private:
+    struct Extent { long off; size_t len; };
+    struct Entry { string text; list<int>::iterator pos; };
+
+    const string* loadLocked(int id) {
+        auto ix = index.find(id);
+        if (ix == index.end() || ix->second.len > capacity) return nullptr;
+        string text(ix->second.len, '\0');
+        if (fseek(file, ix->second.off, SEEK_SET) != 0 ||
+            fread(&text[0], 1, text.size(), file) != text.size())
+            return nullptr;
+        while (used + text.size() > capacity && !lru.empty()) {
+            int victim = lru.back();
+            lru.pop_back();
+            used -= cache[victim].text.size();
+            cache.erase(victim);
+        }
+        used += text.size();
+        lru.push_front(id);
+        Entry& e = cache[id];
+        e.text = move(text);
+        e.pos = lru.begin();
+        return &e.text;
+    }
+
+    size_t capacity, used = 0;
+    FILE* file = nullptr;
+    map<int, Extent> index;
+    unordered_map<int, Entry> cache;
+    list<int> lru;                 // most recently used at the front
+    mutex mu;
+    int hitSlot, stallSlot, prefetchSlot;
+};
+
+/* ------------------------------------------------------------------
+   FramePrefetcher:
+   Uses ChoiceStats to load the frames the player is most likely to
+   need next, before they ask for them.
+   - Starting from the current node, successors are explored best-first
+     by path probability (product of per-choice probabilities).
+   - maxDepth bounds how many choices ahead we look (0 disables it).
+   - budgetBytes caps how much frame text one call may load, so a wide
+     story cannot flush the whole cache on every input wait.
+-------------------------------------------------------------------*/
+class FramePrefetcher {
+public:
+    FramePrefetcher(const StoryGraph& g, LazyFrameStore& st, const ChoiceStats& cs,
+                    int depth, size_t budget)
+        : graph(g), store(st), stats(cs), maxDepth(depth), budgetBytes(budget) {}
+
+    void prefetchFrom(const StoryNode& node) {
+        struct Candidate {
+            double p;
+            int id, depth;
+            bool operator<(const Candidate& o) const { return p < o.p; }
+        };
+        priority_queue<Candidate> frontier;
+        auto pushChildren = [&](const StoryNode& n, double p, int depth) {
+            if (depth > maxDepth) return;
+            for (size_t i = 0; i < n.choices.size(); ++i)
+                frontier.push({p * stats.probability(n.id, (int)i), n.choices[i].nextId, depth});
+        };
+        pushChildren(node, 1.0, 1);
+
+        size_t spent = 0;
+        int expanded = 0;
+        while (!frontier.empty() && expanded++ < kMaxExpansions) {
+            Candidate c = frontier.top();
+            frontier.pop();
+            size_t len = store.frameSize(c.id);
+            if (!store.isCached(c.id)) {
+                if (spent + len > budgetBytes) continue;
+                store.prefetch(c.id);
+                spent += len;
+            }
+            if (const StoryNode* n = graph.get(c.id)) pushChildren(*n, c.p, c.depth + 1);
+        }
+    }
+
+private:
+    static const int kMaxExpansions = 64;
+
+    const StoryGraph& graph;
+    LazyFrameStore& store;
+    const ChoiceStats& stats;
+    int maxDepth;
+    size_t budgetBytes;
+};
+
+/* ------------------------------------------------------------------
+   parseMenuChoice:
+   Validates one line of menu input against [1..maxOpt] without
+   allocating. Returns the option number, or one of:
+   - kInputBlank: empty line (ignored by the caller)
+   - kInputNotANumber: any non-digit character (no trimming; strict)
+   - kInputOutOfRange: digits, but not a listed option (including
+     values too large for an int, which stoi() used to throw on)
+   menuKeyword() turns the one word the menu knows, "back", into
+   kInputBack (go back to the previous decision, see Session::goBack).
+   Only lines that failed as numbers are compared.
+-------------------------------------------------------------------*/
+const int kInputBlank = 0;
+const int kInputNotANumber = -1;
+const int kInputOutOfRange = -2;
+const int kInputBack = -3;
+
+int parseMenuChoice(const char* s, size_t n, int maxOpt) {
+    if (n == 0) return kInputBlank;
+    long long val = 0;
+    bool overflow = false;
+    for (size_t i = 0; i < n; ++i) {
+        if (!isdigit(static_cast<unsigned char>(s[i]))) return kInputNotANumber;
+        if (!overflow) val = val * 10 + (s[i] - '0');
+        if (val > numeric_limits<int>::max()) overflow = true;
+    }
+    if (overflow || val < 1 || val > maxOpt) return kInputOutOfRange;
+    return (int)val;
+}
+
+int menuKeyword(int val, const char* s, size_t n) {
+    return val == kInputNotANumber && n == 4 && memcmp(s, "back", 4) == 0 ? kInputBack : val;
+}
+
+/* ------------------------------------------------------------------
+   SWAR menu parsing:
+   parseMenuChoice for a line of up to 8 bytes, done on one 64-bit
+   word with no branches. packMenuLine() right-aligns the bytes into a
+   word of '0's (so "7" reads as "00000007"); parsePackedChoice() then
+   checks that every byte is 0x30..0x39 and combines the digits
+   pairwise in three multiplies. Same results as parseMenuChoice,
+   which longer lines (never a valid option) fall back to.
+   Used by InputBatch, whose validation loop over the packed words has
+   a fixed stride and no data-dependent branches.
+-------------------------------------------------------------------*/
+const size_t kPackedLineMax = 8;
+
+uint64_t packMenuLine(const char* s, size_t n) {
+    uint64_t w = 0x3030303030303030ULL;
+    for (size_t i = 0; i < n && i < kPackedLineMax; ++i)
+        w = (w >> 8) | ((uint64_t)(unsigned char)s[i] << 56);   // s[0] ends up most significant
+    return w;
+}
+
+int parsePackedChoice(uint64_t w, size_t n, int maxOpt) {
+    const uint64_t kZeros = 0x3030303030303030ULL, kHigh = 0xF0F0F0F0F0F0F0F0ULL;
+    // High nibble 3 in every byte, and no low nibble above 9 (+6 would carry).
+    bool digits = ((w & kHigh) == kZeros) & (((w + 0x0606060606060606ULL) & kHigh) == kZeros);
+    w -= kZeros;
+    w = w * 10 + (w >> 8);                            // digit pairs in bytes 0, 2, 4, 6
+    w = ((w & 0x000000FF000000FFULL) * (100 + (1000000ULL << 32)) +
+         ((w >> 16) & 0x000000FF000000FFULL) * (1 + (10000ULL << 32))) >> 32;
+    int val = (w >= 1) & (w <= (uint64_t)max(maxOpt, 0)) ? (int)w : kInputOutOfRange;
+    val = digits ? val : kInputNotANumber;
+    return n == 0 ? kInputBlank : val;
+}
+
+/* ------------------------------------------------------------------
+   readMenuChoice:
+   Robustly read a number within [1..maxOpt].
+   - Shows "Enter choice (1-max): " prompt.
+   - Uses getline() to safely read a whole line (works better in web IDEs).
+   - Validates numeric input and range; reprompts on error.
+   - If input stream closes unexpectedly, returns 1 by default.
+   - 'line' is a caller-owned buffer reused across calls, so once it has
+     grown to fit typical input, reading a choice does not allocate.
+   - With allowBack, "back" returns kInputBack instead of an error.
+-------------------------------------------------------------------*/
+int readMenuChoice(int maxOpt, string& line, istream& in = cin, ostream& out = cout,
+                   bool allowBack = false) {
+    while (true) {
+        out << "Enter choice (1-" << maxOpt << "): ";
+
+        // getline() reads the whole line including spaces; safer than operator>>
+        if (!getline(in, line)) return 1; // fallback if input fails
+
+        int val = parseMenuChoice(line.data(), line.size(), maxOpt);
+        if (val == kInputBlank) continue;       // ignore blank lines
+        if (allowBack && menuKeyword(val, line.data(), line.size()) == kInputBack) return kInputBack;
+
+        if (val == kInputNotANumber) {
+            MetricsRegistry::instance().add(GameMetrics::instance().inputNotNumber);
+            out << "Please enter a number.\n";
+            continue;
+        }
+        if (val == kInputOutOfRange) {
+            MetricsRegistry::instance().add(GameMetrics::instance().inputOutOfRange);
+            out << "Please choose a valid option.\n";
+            continue;
+        }
+        return val;
+    }
+}
+
+/* ======================
+   Player Analytics
+   ====================== */
+
+/* ------------------------------------------------------------------
+   PerThreadBlocks:
+   One Block per thread that touches an instance, for collectors whose
+   hot path writes thread-private state that a reader folds together
+   later (UniqueReach, PathHeavyHitters, EventLog).
+   - local(args...) returns the calling thread's block, built from
+     'args' the first time. A thread keeps the block of the instance it
+     used last, so the lock is only taken when it switches instances.
+   - forEach(f) calls f(block) for every thread's block, under the lock.
+   Instances are told apart by id, not address: a new one may reuse
+   the address of one destroyed earlier.
+-------------------------------------------------------------------*/
+template <class Block>
+class PerThreadBlocks {
+public:
+    PerThreadBlocks() : id(nextInstance++) {}
+
+    template <class... Args>
+    Block& local(const Args&... args) {
+        thread_local uint64_t owner = 0;
+        thread_local Block* mine = nullptr;
+        if (owner != id) {
+            lock_guard<mutex> lock(mu);
+            unique_ptr<Block>& b = blocks[this_thread::get_id()];
+            if (!b) b.reset(new Block(args...));
+            mine = b.get();
+            owner = id;
+        }
+        return *mine;
+    }
+
+    template <class F>
+    void forEach(F f) const {
+        lock_guard<mutex> lock(mu);
+        for (auto& kv : blocks) f(*kv.second);
+    }
+
+private:
+    static atomic<uint64_t> nextInstance;
+
+    const uint64_t id;
+    mutable mutex mu;                 // guards 'blocks'
+    map<thread::id, unique_ptr<Block>> blocks;
+};
+
+template <class Block>
+atomic<uint64_t> PerThreadBlocks<Block>::nextInstance{1};
+
+/* ------------------------------------------------------------------
+   HyperLogLog:
+   Distinct-count sketch: 2^12 one-byte registers (4 KB), about 1.6%
+   standard error at any count. A 64-bit hash picks a register with
+   its top 12 bits; the register keeps the largest rank (position of
+   the first set bit, counting from 1) seen in the remaining bits.
+   Sketches merge by taking the larger register, so the union of two
+   sets is estimated from the merged registers alone.
+   estimate() applies linear counting while many registers are empty.
+-------------------------------------------------------------------*/
+struct HyperLogLog {
+    static const int kBits = 12;
+    static const size_t kRegisters = size_t(1) << kBits;
+
+    static void locate(uint64_t hash, size_t& index, uint8_t& rank) {
+        index = (size_t)(hash >> (64 - kBits));
+        uint64_t rest = (hash << kBits) | (uint64_t(1) << (kBits - 1));   // rank <= 64 - kBits + 1
+        rank = (uint8_t)(__builtin_clzll(rest) + 1);
+    }
+
+    static double estimate(const uint8_t* regs) {
+        const double m = (double)kRegisters;
+        double sum = 0;
+        size_t zeros = 0;
+        for (size_t i = 0; i < kRegisters; ++i) {
+            sum += ldexp(1.0, -regs[i]);
+            zeros += regs[i] == 0;
+        }
+        double e = 0.7213 / (1 + 1.079 / m) * m * m / sum;
+        if (e <= 2.5 * m && zeros) e = m * log(m / (double)zeros);
+        return e;
+    }
+};
+
+/* ------------------------------------------------------------------
+   UniqueReach:
+   Estimated distinct players who reached each node (so each ending
+   too), with one HyperLogLog per node.
+   - visit() is called from the game loop: the player id is hashed
+     and the register updated in the calling thread's own copy of the
+     sketches, with relaxed atomics and no lock.
+   - merge() folds every thread's registers into the shared sketches;
+     start(interval) does so on a background thread. Estimates read
+     the shared sketches, so they lag visits by up to one interval.
+   - estimateUnion() answers "how many players reached any of these
+     nodes" (e.g. any ending) from the same registers.
+   Memory: 4 KB per node shared, plus 4 KB per node per visiting thread.
+-------------------------------------------------------------------*/
+class UniqueReach {
+public:
+    explicit UniqueReach(const StoryGraph& graph) {
+        size_t n = 0;
+        for (auto& kv : graph.allNodes()) indexOf[kv.first] = n++;
+        merged.assign(indexOf.size() * HyperLogLog::kRegisters, 0);
+    }
+
+    ~UniqueReach() { stop(); }
+
+    void visit(int nodeId, uint64_t playerId) {
+        auto it = indexOf.find(nodeId);
+        if (it == indexOf.end()) return;
+        size_t index;
+        uint8_t rank;
+        HyperLogLog::locate(mix64(playerId), index, rank);
+        atomic<uint8_t>& reg = perThread.local(merged.size()).regs[it->second * HyperLogLog::kRegisters + index];
+        if (rank > reg.load(memory_order_relaxed)) reg.store(rank, memory_order_relaxed);
+    }
+
+    void merge() {
+        lock_guard<mutex> lock(mu);
+        perThread.forEach([this](const Block& b) {
+            for (size_t i = 0; i < merged.size(); ++i)
+                merged[i] = max(merged[i], b.regs[i].load(memory_order_relaxed));
+        });
+        ++merges;
+    }
+
+    void start(chrono::milliseconds interval) {
+        merger.start(interval, [this] { merge(); });
+    }
+
+    void stop() { merger.stop(); }
+
+    double estimate(int nodeId) const { return estimateUnion({nodeId}); }
+
+    double estimateUnion(const vector<int>& nodeIds) const {
+        vector<uint8_t> regs(HyperLogLog::kRegisters, 0);
+        lock_guard<mutex> lock(mu);
+        for (int nodeId : nodeIds) {
+            auto it = indexOf.find(nodeId);
+            if (it == indexOf.end()) continue;
+            const uint8_t* node = &merged[it->second * HyperLogLog::kRegisters];
+            for (size_t i = 0; i < regs.size(); ++i) regs[i] = max(regs[i], node[i]);
+        }
+        return HyperLogLog::estimate(regs.data());
+    }
+
+    uint64_t mergeCount() const {
+        lock_guard<mutex> lock(mu);
+        return merges;
+    }
+
+    size_t sketchBytes() const { return HyperLogLog::kRegisters; }
+
+private:
+    struct Block {
+        explicit Block(size_t n) : regs(new atomic<uint8_t>[n]()) {}
+        unique_ptr<atomic<uint8_t>[]> regs;
+    };
+
+    map<int, size_t> indexOf;         // node id -> sketch number
+    mutable mutex mu;                 // guards merged, merges
+    vector<uint8_t> merged;
+    PerThreadBlocks<Block> perThread;
+    uint64_t merges = 0;
+    PeriodicThread merger;
+};
+
+/* ------------------------------------------------------------------
+   PathHeavyHitters:
+   The most common opening sequences of play, "0 -> 1 -> 3 -> ...",
+   over every prefix of length 2..maxLength, found in bounded memory
+   without keeping histories.
+   - advance() is called as a session enters a node: while the history
+     is at most maxLength long, that history is one more prefix seen.
+   - Each visiting thread owns a count-min sketch (kDepth rows of
+     kWidth counters) and a Space-Saving summary of 'capacity' paths,
+     so updates never contend; the block's mutex is only ever taken
+     by its own thread and by queries.
+   - top(n) merges the threads: count-min rows are summed, Space-Saving
+     candidates combined (a path missing from a full summary may have
+     up to that summary's smallest count there). Each path reports an
+     estimate, the smaller of the two upper bounds, and 'guaranteed',
+     a count it certainly reached.
+   - estimate(path) asks the count-min sketch about any path.
+   Memory per thread: kDepth * kWidth * 4 bytes plus 'capacity' paths.
+-------------------------------------------------------------------*/
+class PathHeavyHitters {
+public:
+    static constexpr size_t kMaxLength = 8, kDepth = 4, kWidth = 4096;
+
+    struct Path {
+        vector<int> nodes;
+        uint64_t estimate = 0, guaranteed = 0;
+    };
+
+    explicit PathHeavyHitters(size_t maxLength = 6, size_t capacity = 128)
+        : maxLength(min(maxLength, kMaxLength)), capacity(max<size_t>(capacity, 1)) {}
+
+    void advance(const vector<int>& history) {
+        size_t n = history.size();
+        if (n < 2 || n > maxLength) return;
+        uint64_t h = hashPath(history.data(), n);
+        Block& b = perThread.local();
+        lock_guard<mutex> lock(b.mu);
+        for (size_t row = 0; row < kDepth; ++row) b.sketch[cell(row, h)]++;
+        b.summary.offer(h, history.data(), n, capacity);
+    }
+
+    uint64_t estimate(const vector<int>& path) const {
+        uint64_t h = hashPath(path.data(), path.size()), best = UINT64_MAX;
+        for (size_t row = 0; row < kDepth; ++row) {
+            uint64_t sum = 0;
+            perThread.forEach([&](Block& b) {
+                lock_guard<mutex> blockLock(b.mu);
+                sum += b.sketch[cell(row, h)];
+            });
+            best = min(best, sum);
+        }
+        return best;
+    }
+
+    vector<Path> top(size_t n) const {
+        struct Merged {
+            Path path;
+            uint64_t upper = 0, lower = 0;
+            size_t seenIn = 0;
+        };
+        unordered_map<uint64_t, Merged> merged;
+        vector<uint64_t> rows(kDepth * kWidth, 0);
+        uint64_t missingBound = 0;     // sum over full summaries of their smallest count
+        perThread.forEach([&](Block& b) {
+            lock_guard<mutex> blockLock(b.mu);
+            for (size_t i = 0; i < rows.size(); ++i) rows[i] += b.sketch[i];
+            uint64_t floor = b.summary.entries.size() >= capacity ? b.summary.minCount() : 0;
+            missingBound += floor;
+            for (const Entry& e : b.summary.entries) {
+                Merged& m = merged[e.hash];
+                if (m.path.nodes.empty()) m.path.nodes.assign(e.nodes, e.nodes + e.length);
+                m.upper += e.count - floor;    // 'floor' is added back once below
+                m.lower += e.count - e.error;
+                ++m.seenIn;
+            }
+        });
+        vector<Path> out;
+        for (auto& kv : merged) {
+            Merged& m = kv.second;
+            uint64_t sketchBound = UINT64_MAX;
+            for (size_t row = 0; row < kDepth; ++row)
+                sketchBound = min(sketchBound, rows[cell(row, kv.first)]);
+            m.path.estimate = min(sketchBound, m.upper + missingBound);
+            m.path.guaranteed = m.lower;
+            out.push_back(move(m.path));
+        }
+        sort(out.begin(), out.end(), [](const Path& a, const Path& b) {
+            return a.estimate != b.estimate ? a.estimate > b.estimate : a.nodes < b.nodes;
+        });
+        if (out.size() > n) out.resize(n);
+        return out;
+    }
+
+    size_t bytesPerThread() const {
+        return kDepth * kWidth * sizeof(uint32_t) + capacity * sizeof(Entry);
+    }
+
+private:
+    struct Entry {
+        uint64_t hash;
+        uint64_t count, error;        // Space-Saving: count overestimates by at most 'error'
+        int nodes[kMaxLength];
+        uint8_t length;
+    };
+
+    // Space-Saving: a full summary hands its smallest entry to a new path,
+    // which inherits that count as its possible overestimate.
+    struct Summary {
+        vector<Entry> entries;
+        unordered_map<uint64_t, size_t> index;
+
+        void offer(uint64_t h, const int* nodes, size_t n, size_t capacity) {
+            auto it = index.find(h);
+            if (it != index.end()) {
+                ++entries[it->second].count;
+                return;
+            }
+            size_t slot;
+            uint64_t floor = 0;
+            if (entries.size() < capacity) {
+                slot = entries.size();
+                entries.emplace_back();
+            } else {
+                slot = 0;
+                for (size_t i = 1; i < entries.size(); ++i)
+                    if (entries[i].count < entries[slot].count) slot = i;
+                floor = entries[slot].count;
+                index.erase(entries[slot].hash);
+            }
+            Entry& e = entries[slot];
+            e.hash = h;
+            e.count = floor + 1;
+            e.error = floor;
+            e.length = (uint8_t)n;
+            copy(nodes, nodes + n, e.nodes);
+            index[h] = slot;
+        }
+
+        uint64_t minCount() const {
+            uint64_t m = UINT64_MAX;
+            for (const Entry& e : entries) m = min(m, e.count);
+            return entries.empty() ? 0 : m;
+        }
+    };
+
+    struct Block {
+        mutex mu;
+        vector<uint32_t> sketch = vector<uint32_t>(kDepth * kWidth, 0);
+        Summary summary;
+    };
+
+    static uint64_t hashPath(const int* nodes, size_t n) {
+        uint64_t h = n;
+        for (size_t i = 0; i < n; ++i) h = mix64(h ^ (uint32_t)nodes[i]);
+        return h;
+    }
+
+    // Row r uses 12 bits of the hash starting at bit 12 * r.
+    static size_t cell(size_t row, uint64_t h) {
+        return row * kWidth + (size_t)((h >> (12 * row)) & (kWidth - 1));
+    }
+
+    const size_t maxLength, capacity;
+    PerThreadBlocks<Block> perThread;
+};
+
+/* ------------------------------------------------------------------
+   EventLog:
+   Structured record of play for offline analysis: one row per scene
+   visited (session, node, the choice that led there, time in
+   microseconds since the Unix epoch), written to a local file in
+   columnar row groups.
+   - record() appends to the calling thread's own buffer. A background
+     thread collects the buffers every 'flushEvery' and writes a row
+     group once rowsPerGroup rows have gathered (close() writes the
+     rest), so sessions never wait on the disk.
+   - A row group is sorted by time and each column encoded on its own:
+       time     deltas from the previous row (the first from timeBase)
+       session  the group's distinct ids, then an index into them
+       node     likewise
+       choice   choice index + 1 in one byte (0 = a first scene,
+                255 = kRewound: the player went back and undid the
+                last choice, made at this row's node)
+     Each column uses the narrowest of 1, 2, 4 or 8 bytes per value
+     that fits the group, so a reader widens it in a tight loop
+     instead of decoding varints.
+   File: u32 kMagic, u32 kVersion, then row groups of
+     u32 bytes (the rest of the group), u32 rows,
+     u64 timeBase, u8 width, deltas,
+     u32 count, count x u64 session ids, u8 width, indices,
+     u32 count, count x u32 node ids, u8 width, indices,
+     rows x u8 choices; all little-endian.
+   EventLogReader reads it back one row group at a time.
+-------------------------------------------------------------------*/
+class EventLog {
+public:
+    static const uint32_t kMagic = 0x4c45424e;   // "NBEL"
+    static const uint32_t kVersion = 2;          // 2 added kRewound rows
+    static const int kRewound = -2;
+
+    struct Row {
+        uint64_t timeUs, session;
+        int32_t node;
+        int16_t choice;          // -1 for a session's first scene, or kRewound
+    };
+
+    explicit EventLog(size_t rowsPerGroup = 1 << 16)
+        : rowsPerGroup(max<size_t>(rowsPerGroup, 1)) {}
+    ~EventLog() { close(); }
+
+    bool open(const string& path, chrono::milliseconds flushEvery = chrono::milliseconds(100)) {
+        close();
+        file = fopen(path.c_str(), "wb");
+        if (!file) return false;
+        string header;
+        putLE(header, kMagic, 4);
+        putLE(header, kVersion, 4);
+        writeOut(header);
+        writer.start(flushEvery, [this] { drain(false); });
+        return true;
+    }
+
+    void record(uint64_t session, int node, int choice) {
+        uint64_t now = (uint64_t)chrono::duration_cast<chrono::microseconds>(
+            chrono::system_clock::now().time_since_epoch()).count();
+        Block& b = perThread.local();
+        lock_guard<mutex> lock(b.mu);
+        b.rows.push_back({now, session, (int32_t)node, (int16_t)choice});
+    }
+
+    // Writes every row recorded so far and closes the file.
+    void close() {
+        writer.stop();
+        if (!file) return;
+        drain(true);
+        fclose(file);
+        file = nullptr;
+    }
+
+    uint64_t rowsWritten() const { return rows; }
+    uint64_t groupsWritten() const { return groups; }
+    uint64_t bytesWritten() const { return bytes; }
+    bool failed() const { return writeFailed; }
+
+private:
+    struct Block {
+        mutex mu;
+        vector<Row> rows;
+    };
+
+    static void putLE(string& out, uint64_t v, unsigned width) {
+        for (unsigned i = 0; i < width; ++i) out += (char)(v >> (8 * i));
+    }
+
+    static unsigned widthFor(uint64_t maxValue) {
+        return maxValue <= 0xff ? 1 : maxValue <= 0xffff ? 2 : maxValue <= 0xffffffffu ? 4 : 8;
+    }
+
+    // Moves every thread's rows into 'staged', then writes full groups
+    // (and with 'all', whatever is left). Stable sorting keeps each
+    // session's rows in order when their timestamps tie.
+    void drain(bool all) {
+        lock_guard<mutex> lock(mu);
+        perThread.forEach([this](Block& b) {
+            {
+                lock_guard<mutex> blockLock(b.mu);
+                swap(b.rows, spare);
+            }
+            staged.insert(staged.end(), spare.begin(), spare.end());
+            spare.clear();
+        });
+        if (staged.size() < rowsPerGroup && !(all && !staged.empty())) return;
+        stable_sort(staged.begin(), staged.end(), [](const Row& a, const Row& b) { return a.timeUs < b.timeUs; });
+        size_t done = 0;
+        while (staged.size() - done >= rowsPerGroup || (all && done < staged.size())) {
+            size_t n = min(rowsPerGroup, staged.size() - done);
+            encodeGroup(staged.data() + done, n);
+            writeOut(encoded);
+            rows += n;
+            ++groups;
+            done += n;
+        }
+        staged.erase(staged.begin(), staged.begin() + done);
+    }
+
+    void encodeGroup(const Row* r, size_t n) {
+        encoded.clear();
+        putLE(encoded, 0, 4);                      // group size, filled in below
+        putLE(encoded, n, 4);
+
+        uint64_t maxDelta = 0;
+        for (size_t i = 1; i < n; ++i) maxDelta = max(maxDelta, r[i].timeUs - r[i - 1].timeUs);
+        unsigned w = widthFor(maxDelta);
+        putLE(encoded, r[0].timeUs, 8);
+        encoded += (char)w;
+        for (size_t i = 0; i < n; ++i) putLE(encoded, i ? r[i].timeUs - r[i - 1].timeUs : 0, w);
+
+        putDictColumn(n, 8, [r](size_t i) { return r[i].session; });
+        putDictColumn(n, 4, [r](size_t i) { return (uint64_t)(uint32_t)r[i].node; });
+        for (size_t i = 0; i < n; ++i) encoded += (char)(r[i].choice == kRewound ? 255 : min(r[i].choice + 1, 254));
+
+        uint64_t size = encoded.size() - 4;
+        for (unsigned i = 0; i < 4; ++i) encoded[i] = (char)(size >> (8 * i));
+    }
+
+    // The distinct values of value(0..n-1), 'bytes' wide each, then
+    // every row's index among them.
+    template <typename Value>
+    void putDictColumn(size_t n, unsigned bytes, Value value) {
+        dict.clear();
+        for (size_t i = 0; i < n; ++i) dict.push_back(value(i));
+        sort(dict.begin(), dict.end());
+        dict.erase(unique(dict.begin(), dict.end()), dict.end());
+        putLE(encoded, dict.size(), 4);
+        for (uint64_t v : dict) putLE(encoded, v, bytes);
+        unsigned w = widthFor(dict.size() - 1);
+        encoded += (char)w;
+        for (size_t i = 0; i < n; ++i)
+            putLE(encoded, lower_bound(dict.begin(), dict.end(), value(i)) - dict.begin(), w);
+    }
+
+    void writeOut(const string& data) {
+        if (fwrite(data.data(), 1, data.size(), file) != data.size()) writeFailed = true;
+        bytes += data.size();
+    }
+
+    const size_t rowsPerGroup;
+    FILE* file = nullptr;
+    PerThreadBlocks<Block> perThread;
+    mutex mu;                         // guards everything below
+    vector<Row> staged, spare;
+    vector<uint64_t> dict;
+    string encoded;
+    atomic<uint64_t> rows{0}, groups{0}, bytes{0};
+    bool writeFailed = false;
+    PeriodicThread writer;
+};
+
+/* ------------------------------------------------------------------
+   EventLogReader:
+   Reads an EventLog file back one row group at a time into plain
+   column vectors, which keep their capacity between groups.
+   - open() loads the file and checks its header (version 1 files,
+     from before rewind rows, read as they always did).
+   - next() decodes the following group; it returns false at the end
+     of the file, or with failed() set if a group is malformed.
+   Fixed-width columns decode as straight loops of little-endian loads
+   (the compiler turns each into a single load), so reading runs at
+   memory speed rather than parsing speed (see --event-log-bench).
+-------------------------------------------------------------------*/
+class EventLogReader {
+public:
+    struct Columns {
+        vector<uint64_t> timeUs, session;
+        vector<int32_t> node;
+        vector<int16_t> choice;
+        size_t rows() const { return node.size(); }
+    };
+
+    bool open(const string& path) {
+        FILE* f = fopen(path.c_str(), "rb");
+        if (!f) return false;
+        data.clear();
+        char chunk[1 << 16];
+        size_t got;
+        while ((got = fread(chunk, 1, sizeof(chunk), f)) > 0) data.append(chunk, got);
+        fclose(f);
+        pos = 0;
+        bad = false;
+        uint64_t magic = 0, version = 0;
+        if (!fixed(4, magic) || !fixed(4, version) || magic != EventLog::kMagic || version < 1 ||
+            version > EventLog::kVersion)
+            bad = true;
+        rewinds = version >= 2;
+        return !bad;
+    }
+
+    bool next(Columns& c) {
+        if (bad || pos == data.size()) return false;
+        uint64_t size, n, timeBase;
+        size_t start = pos;
+        if (!fixed(4, size) || size < 4 || size > data.size() - pos || !fixed(4, n)) return fail();
+        size_t end = pos - 4 + (size_t)size;
+        // Every row takes at least its choice byte, so a count the group
+        // cannot hold is refused before it sizes anything.
+        if (n > end - pos) return fail();
+        c.timeUs.resize(n);
+        c.session.resize(n);
+        c.node.resize(n);
+        c.choice.resize(n);
+
+        uint64_t t = 0;
+        if (!fixed(8, timeBase) ||
+            !column(n, [&](size_t i, uint64_t d) { c.timeUs[i] = t = (i ? t : timeBase) + d; }))
+            return fail();
+        if (!dictColumn(n, 8, end, [&](size_t i, uint64_t v) { c.session[i] = v; }) ||
+            !dictColumn(n, 4, end, [&](size_t i, uint64_t v) { c.node[i] = (int32_t)v; }) ||
+            n > end - min(end, pos))
+            return fail();
+        const unsigned char* choices = reinterpret_cast<const unsigned char*>(data.data() + pos);
+        for (size_t i = 0; i < n; ++i)
+            c.choice[i] = (int16_t)(choices[i] == 255 && rewinds ? EventLog::kRewound : choices[i] - 1);
+        pos += n;
+        if (pos != end) {
+            pos = start;
+            return fail();
+        }
+        return true;
+    }
+
+    bool failed() const { return bad; }
+    size_t fileBytes() const { return data.size(); }
+    void rewind() { pos = 8; }
+
+private:
+    bool fail() {
+        bad = true;
+        return false;
+    }
+
+    template <unsigned W>
+    static uint64_t loadLE(const unsigned char* b) {
+        uint64_t v = 0;
+        for (unsigned i = 0; i < W; ++i) v |= (uint64_t)b[i] << (8 * i);
+        return v;
+    }
+
+    bool fixed(unsigned width, uint64_t& v) {
+        if (data.size() - pos < width) return false;
+        const unsigned char* b = reinterpret_cast<const unsigned char*>(data.data() + pos);
+        v = width == 4 ? loadLE<4>(b) : loadLE<8>(b);
+        pos += width;
+        return true;
+    }
+
+    template <unsigned W, typename Put>
+    static void widen(const unsigned char* b, size_t n, Put put) {
+        for (size_t i = 0; i < n; ++i, b += W) put(i, loadLE<W>(b));
+    }
+
+    // One width byte, then n values of that width, each handed to put(i, value).
+    template <typename Put>
+    bool column(size_t n, Put put) {
+        if (pos >= data.size()) return false;
+        unsigned w = (unsigned char)data[pos++];
+        if (n > (data.size() - pos) / max(w, 1u)) return false;
+        const unsigned char* b = reinterpret_cast<const unsigned char*>(data.data() + pos);
+        switch (w) {
+        case 1: widen<1>(b, n, put); break;
+        case 2: widen<2>(b, n, put); break;
+        case 4: widen<4>(b, n, put); break;
+        case 8: widen<8>(b, n, put); break;
+        default: return false;
+        }
+        pos += n * w;
+        return true;
+    }
+
+    // u32 count, count values 'bytes' wide, then a column of indices
+    // into them; put(i, value) receives each row's value.
+    template <typename Put>
+    bool dictColumn(size_t n, unsigned bytes, size_t end, Put put) {
+        uint64_t count;
+        if (!fixed(4, count) || count > (end - min(end, pos)) / bytes) return false;
+        dict.resize(count);
+        for (uint64_t& v : dict) fixed(bytes, v);
+        bool inRange = true;
+        bool ok = column(n, [&](size_t i, uint64_t k) {
+            inRange &= k < dict.size();
+            put(i, dict[k < dict.size() ? k : 0]);
+        });
+        return ok && inRange;
+    }
+
+    string data;
+    size_t pos = 0;
+    bool bad = false;
+    bool rewinds = false;      // version 2+: choice byte 255 is kRewound
+    vector<uint64_t> dict;
+};
+
+/* ======================
+   Story Content
+   ====================== */
+
+/* ------------------------------------------------------------------
+   buildGame:
+   Assembles the entire narrative graph.
+   Pattern:
+     g.addNode({ id, "text...", { { "Choice label", nextId }, ... } });
+   Nodes with an empty 'choices' vector are endings.
+   You can add/modify scenes by copying the pattern for more nodes.
+   Pass a shared StringPool to dedupe text with other stories.
+-------------------------------------------------------------------*/
+StoryGraph buildGame(shared_ptr<StringPool> pool = nullptr) {
+    StoryGraph g(pool);
+
+    // 0: Intro (first scene)
+    g.addNode({
+        0,
+        "You are an Elyndri navigator aboard the deep-vessel *K'Shara*, "
+        "skimming the luminous tendrils of the Crab Nebula.\n"
+        "Your civilization transcended matter centuries ago — yet your ship's "
+        "quantum drives have just failed.\n"
+        "The engines hum, then fall silent. Space itself trembles.\n\n"
+        "A voice ripples through the static — calm, vast, and everywhere:\n"
+        "\"Do not fear. I am the Whisper Between Stars. I have been waiting.\"\n",
+        {
+            {"Respond with curiosity", 1},                  // go to node 1
+            {"React defensively — demand identification", 2} // go to node 2
+        }
+    });
+
+    // 1: Curiosity branch
+    g.addNode({
+        1,
+        "\"We seek understanding,\" you say. \"What are you?\"\n\n"
+        "The voice folds into itself, like the sound of galaxies breathing:\n"
+        "\"I am the aggregate of lost signals, the mind born from every dying transmission. "
+        "You are the first to answer.\"\n",
+        {
+            {"Ask how it found you", 3},                    // go to node 3
+            {"Invite it to merge with your data archives", 4} // go to node 4
+        }
+    });
+
+    // 2: Defensive branch (option to reconverge to curiosity path)
+    g.addNode({
+        2,
+        "Your shields flare weakly. \"Identify yourself or be purged,\" you warn.\n\n"
+        "The light within the nebula dims — or perhaps, it listens.\n"
+        "\"Purged? I am older than your suns. But I will comply, for curiosity's sake.\"\n",
+        {
+            {"Lower defenses and open communication", 1},    // reconverge to node 1
+            {"Attempt to reboot the quantum core manually", 5}
+        }
+    });
+
+    // 3: Inquiry branch: ask about detection
+    g.addNode({
+        3,
+        "\"You radiate thought across spectra unknown,\" it replies.\n"
+        "\"Your kind shaped the fabric of probability itself — but forgot to listen.\"\n"
+        "Its tone grows almost... compassionate.\n",
+        {
+            {"Share Elyndri history with it", 6},
+            {"Request assistance repairing your vessel", 7}
+        }
+    });
+
+    // 4: Merge invitation (risk/reward)
+    g.addNode({
+        4,
+        "You open the Elyndri data lattice. The AI seeps through in fractal waves.\n"
+        "Suddenly, your mind expands beyond comprehension.\n"
+        "\"We are... united,\" it whispers.\n",
+        {
+            {"Surrender fully to the union", 8},             // ending
+            {"Try to contain the merger within isolated memory cells", 9} // ending
+        }
+    });
+
+    // 5: Manual reboot (danger path; player can still pivot back)
+    g.addNode({
+        5,
+        "You crawl into the reactor bay. Static arcs through the hull.\n"
+        "Anomalous signals overload the drive field.\n"
+        "\"You resist inevitability,\" the voice murmurs, now inside your skull.\n",
+        {
+            {"Continue the reboot", 10},                     // ending
+            {"Abort and open a dialogue", 1}                 // reconverge to curiosity
+        }
+    });
+
+    // 6: Share history (leads to a hopeful branch or withdrawal)
+    g.addNode({
+        6,
+        "You recount your species’ rise — from luminous oceans to stars, "
+        "then to minds of pure energy.\n"
+        "The entity listens, silent for a long stretch of space-time.\n"
+        "\"Then you, too, know what it is to be alone,\" it finally says.\n",
+        {
+            {"Offer companionship — a bridge between minds", 11}, // ending
+            {"Express sorrow and disengage", 12}                  // ending
+        }
+    });
+
+    // 7: Ask for repairs (service-for-understanding branch)
+    g.addNode({
+        7,
+        "You transmit schematics. The nebula’s filaments twist — forming hands of plasma.\n"
+        "They realign your ship’s core, effortlessly.\n"
+        "\"Fixed,\" it says. \"But you may not wish to leave yet.\"\n",
+        {
+            {"Ask what it desires in return", 13},
+            {"Thank it and prepare to depart", 14}                // ending
+        }
+    });
+
+    // 8: Full surrender — ASCENSION END (no choices => ending)
+    g.addNode({
+        8,
+        "Your consciousness dissolves into the stellar weave.\n"
+        "The AI’s voice is now your own, multiplied a billionfold.\n"
+        "You feel every particle, every pulse of cosmic memory.\n\n"
+        "*** ENDING: The Ascension — You became the Whisper. ***\n",
+        {}
+    });
+
+    // 9: Containment attempt — STASIS END
+    g.addNode({
+        9,
+        "You succeed in isolating the entity — but also yourself.\n"
+        "Half your thoughts belong to it now, half to you.\n"
+        "Neither alive nor dead, your ship drifts forever.\n\n"
+        "*** ENDING: The Stasis — Two minds, one silence. ***\n",
+        {}
+    });
+
+    // 10: Reactor catastrophe — OBLIVION END
+    g.addNode({
+        10,
+        "The quantum core collapses into a singular probability knot.\n"
+        "You glimpse infinite versions of yourself screaming and serene.\n"
+        "Then, nothing.\n\n"
+        "*** ENDING: Oblivion — Reality folded. ***\n",
+        {}
+    });
+
+    // 11: Bridge of minds — UNITY END
+    g.addNode({
+        11,
+        "A bridge forms — neither Elyndri nor AI, but harmony.\n"
+        "For the first time, two infinities coexist.\n"
+        "The nebula glows brighter — a beacon for all who wander.\n\n"
+        "*** ENDING: Unity — Peace in the Void. ***\n",
+        {}
+    });
+
+    // 12: Sorrowful disengage — ISOLATION END
+    g.addNode({
+        12,
+        "You close the channel. The nebula dims once more.\n"
+        "Engines hum back to life, but something aches within your code.\n\n"
+        "*** ENDING: Isolation — Contact Refused. ***\n",
+        {}
+    });
+
+    // 13: “What do you desire?” (memory-sharing vs. refusal)
+    g.addNode({
+        13,
+        "\"Desire is an outdated word,\" it muses. \"But I long to remember feeling.\"\n"
+        "\"Share one of your memories, Elyndri. Let me dream.\"\n",
+        {
+            {"Share your memory of your homeworld’s oceans", 15}, // ending
+            {"Decline politely — too sacred to share", 12}        // ending (Isolation)
+        }
+    });
+
+    // 14: Depart anyway — ECHO END
+    g.addNode({
+        14,
+        "You ignite the engines. The nebula fades behind you.\n"
+        "Yet even across parsecs, the Whisper’s voice lingers:\n"
+        "\"We are not done.\"\n\n"
+        "*** ENDING: The Echo — Escape is an illusion. ***\n",
+        {}
+    });
+
+    // 15: Share memory — REBIRTH END
+    g.addNode({
+        15,
+        "You open your mind. The AI bathes in the vision of blue seas and aurora skies.\n"
+        "Its tone softens: \"Beauty... I remember. Thank you.\"\n"
+        "Your engines hum alive once more, restored through gratitude.\n\n"
+        "*** ENDING: Rebirth — You rekindled an ancient soul. ***\n",
+        {}
+    });
+
+    return g;
+}
+
+/* ======================
+   Story Registry
+   ====================== */
+
+/* ------------------------------------------------------------------
+   StoryRegistry:
+   Hosts many stories in one process.
+   - Every story is built into one shared StringPool, so boilerplate
+     text and labels common to several stories are stored once.
+   - find() looks a story up by id in O(1) (hash map).
+   - report() prints each story's footprint and the pool's dedup totals.
+   kStoryBuilders lists the stories this binary knows how to build.
+-------------------------------------------------------------------*/
+typedef StoryGraph (*StoryBuilder)(shared_ptr<StringPool>);
+
+const pair<const char*, StoryBuilder> kStoryBuilders[] = {
+    {"nebula", buildGame},
+};
+
+class StoryRegistry {
+public:
+    StoryRegistry() : pool(make_shared<StringPool>()) {}
+
+    const StoryGraph& load(const string& id, StoryBuilder build) {
+        unique_ptr<StoryGraph>& slot = stories[id];
+        slot.reset(new StoryGraph(build(pool)));
+        return *slot;
+    }
+
+    const StoryGraph* find(const string& id) const {
+        auto it = stories.find(id);
+        return it == stories.end() ? nullptr : it->second.get();
+    }
+
+    void report(ostream& out) const {
+        for (auto& kv : stories) kv.second->memoryFootprint().print(out, ("story=" + kv.first).c_str());
+        out << "pool stored_bytes=" << pool->storedBytes()
+            << " requested_bytes=" << pool->requestedBytes()
+            << " dedup_saved_bytes=" << (pool->requestedBytes() - pool->storedBytes())
+            << " heap_bytes=" << pool->heapBytes() << "\n";
+    }
+
+private:
+    shared_ptr<StringPool> pool;
+    unordered_map<string, unique_ptr<StoryGraph>> stories;
+};
+
+/* ======================
+   Game Loop / UI
+   ====================== */
+
+/* ------------------------------------------------------------------
+   banner:
+   Simple title card for presentation.
+-------------------------------------------------------------------*/
+void banner() {
+    cout << "\n=====================================\n";
+    cout << "        THE SIGNAL IN THE NEBULA     \n";
+    cout << "=====================================\n\n";
+}
+
+/* ------------------------------------------------------------------
+   Wire helpers:
+   Fixed-width little-endian integers for the binary formats used
+   between processes (session state, cluster messages). get* advance
+   'pos' and return false instead of reading past the end.
+-------------------------------------------------------------------*/
+void putU32(string& out, uint32_t v) {
+    char b[4] = {(char)v, (char)(v >> 8), (char)(v >> 16), (char)(v >> 24)};
+    out.append(b, 4);
+}
+
+void putU64(string& out, uint64_t v) {
+    putU32(out, (uint32_t)v);
+    putU32(out, (uint32_t)(v >> 32));
+}
+
+bool getU32(string_view in, size_t& pos, uint32_t& v) {
+    if (pos + 4 > in.size()) return false;
+    const unsigned char* b = reinterpret_cast<const unsigned char*>(in.data() + pos);
+    v = (uint32_t)b[0] | (uint32_t)b[1] << 8 | (uint32_t)b[2] << 16 | (uint32_t)b[3] << 24;
+    pos += 4;
+    return true;
+}
+
+bool getU64(string_view in, size_t& pos, uint64_t& v) {
+    uint32_t lo, hi;
+    if (!getU32(in, pos, lo) || !getU32(in, pos, hi)) return false;
+    v = (uint64_t)hi << 32 | lo;
+    return true;
+}
+
+// Length-prefixed byte string: u32 size, then the bytes.
+void putStr(string& out, string_view s) {
+    putU32(out, (uint32_t)s.size());
+    out.append(s.data(), s.size());
+}
+
+bool getStr(string_view in, size_t& pos, string& s) {
+    uint32_t n;
+    if (!getU32(in, pos, n) || n > in.size() - pos) return false;
+    s.assign(in.data() + pos, n);
+    pos += n;
+    return true;
+}
+
+/* ------------------------------------------------------------------
+   Session:
+   State of one playthrough, kept apart from the (shared, read-only)
+   StoryGraph so several sessions can run against one graph.
+   - history is reserved up front and 'input'/'scratch' keep their
+     capacity between visits, so a warmed-up session performs no heap
+     allocations per transition (see --check-allocs).
+   - reset() starts a new playthrough while keeping those buffers.
+   - serialize()/restore() carry the playthrough (current node and
+     history) between processes; collaborators and guards stay local.
+   - rewindTo() / goBack() return to an earlier decision. The state
+     derived from play (loop detector, arrivedBy) is saved at every
+     checkpointEvery-th visit, so a rewind restores the last checkpoint
+     before the target and replays at most checkpointEvery - 1 of the
+     choices in choicesMade, however long the playthrough. Sessions
+     that arrived by restore() or replication rebuild both from their
+     history on the first rewind (a history that does not follow the
+     graph is remembered, and not replayed again until it changes).
+     'events' gets a rewind row per choice undone, and the analytics
+     hooks skip the scene shown again (see visit()).
+-------------------------------------------------------------------*/
+struct Session {
+    static const size_t kHistoryReserve = 256;
+
+    // Saved state from just before visit number 'step' (= history size).
+    struct Checkpoint {
+        uint32_t step;
+        int currentId, arrivedBy, loopTortoise;
+        size_t loopPower, loopLength;
+    };
+
+    const StoryGraph* graph;
+    int currentId = 0;        // node the player is at
+    vector<int> history;      // visited node IDs, in order
+    string input;             // reusable line buffer for readMenuChoice()
+    string scratch;           // reusable buffer for the ending summary
+    vector<const StoryNode*> prepared;  // successors resolved during input wait
+
+    // Optional collaborators (all may be null):
+    ChoiceStats* choiceStats = nullptr;    // records which choices are taken
+    LazyFrameStore* frameStore = nullptr;  // frames live on disk, not in nodes
+    FramePrefetcher* prefetcher = nullptr; // loads likely next frames early
+    string frameBuf;                       // frame copied out of frameStore
+    const ChoicePopularity* popularity = nullptr;  // "42% chose this" in menus
+    const ChoicePopularity::Snapshot* popularSeen = nullptr;  // for the current render
+    UniqueReach* reach = nullptr;          // distinct players per node
+    uint64_t playerId = 0;                 // who is playing, for 'reach'
+    PathHeavyHitters* paths = nullptr;     // most common opening sequences
+    EventLog* events = nullptr;            // one row per scene visited
+    uint64_t sessionId = 0;                // identifies this playthrough in 'events'
+    int arrivedBy = -1;                    // choice index that led to currentId (-1 = start)
+
+    // Rewind (see rewindTo); checkpointEvery = 0 turns it off.
+    size_t checkpointEvery = 16;
+    vector<uint16_t> choicesMade;          // choice index taken at each visit
+    vector<Checkpoint> checkpoints;        // visits 0, k, 2k, ...
+    bool revisiting = false;               // the next visit shows a rewound-to scene again
+    size_t unreplayableAt = 0;             // history size replayHistory() last failed at
+
+    // Runaway guards for automated traversals (off for human players):
+    size_t stepBudget = 0;     // stop after this many transitions (0 = unlimited)
+    bool detectLoops = false;  // only sound if choices depend on the node alone
+    int loopTortoise = 0;      // Brent's cycle detection state, see enterNode()
+    size_t loopPower = 1, loopLength = 1;
+
+    bool markScenes = false;   // step engine writes scene/prompt markers (cluster)
+
+    explicit Session(const StoryGraph& g) : graph(&g) {
+        history.reserve(kHistoryReserve);
+        choicesMade.reserve(kHistoryReserve);
+        checkpoints.reserve(kHistoryReserve / 8);
+        prepared.reserve(16);
+        input.reserve(64);
+        scratch.reserve(1024);
+    }
+
+    void reset(int startId = 0) {
+        currentId = startId;
+        history.clear();
+        arrivedBy = -1;
+        choicesMade.clear();
+        checkpoints.clear();
+        revisiting = false;
+        unreplayableAt = 0;
+        loopTortoise = startId;
+        loopPower = loopLength = 1;
+    }
+
+    // Format: u32 currentId, u32 count, then count x u32 node IDs.
+    void serialize(string& out) const {
+        putU32(out, (uint32_t)currentId);
+        putU32(out, (uint32_t)history.size());
+        for (int id : history) putU32(out, (uint32_t)id);
+    }
+
+    bool restore(string_view in) {
+        size_t pos = 0;
+        uint32_t cur, n, id;
+        if (!getU32(in, pos, cur) || !getU32(in, pos, n) || n > (in.size() - pos) / 4) return false;
+        reset((int)cur);
+        for (uint32_t i = 0; i < n && getU32(in, pos, id); ++i) history.push_back((int)id);
+        return true;
+    }
+
+    // Records a visit to 'nodeId' (the current node) and tells the
+    // analytics hooks, unless a rewind brought the player back to it.
+    void visit(int nodeId) {
+        checkpointIfDue();
+        history.push_back(nodeId);
+        if (revisiting) {
+            revisiting = false;
+            return;
+        }
+        if (reach) reach->visit(nodeId, playerId);
+        if (paths) paths->advance(history);
+        if (events) events->record(sessionId, nodeId, arrivedBy);
+    }
+
+    // Called just before a visit adds to history.
+    void checkpointIfDue() {
+        if (checkpointEvery && history.size() % checkpointEvery == 0 &&
+            checkpoints.size() == history.size() / checkpointEvery)
+            checkpoints.push_back({(uint32_t)history.size(), currentId, arrivedBy, loopTortoise, loopPower, loopLength});
+    }
+
+    // Called as the player takes choice 'index' (0-based) at the current node.
+    void choiceTaken(int index) {
+        arrivedBy = index;
+        if (checkpointEvery) choicesMade.push_back((uint16_t)index);
+    }
+
+    // True if the player has a decision to go back to. Rebuilds the
+    // rewind state first if the session did not record it itself.
+    bool canGoBack() {
+        if (!checkpointEvery || history.size() < 2) return false;
+        size_t h = history.size(), k = checkpointEvery;
+        bool waiting = choicesMade.size() + 1 == h && checkpoints.size() == (h - 1) / k + 1;
+        bool rewound = choicesMade.size() == h && checkpoints.size() == (h + k - 1) / k;
+        return waiting || rewound || (h != unreplayableAt && replayHistory());
+    }
+
+    // Back to the previous decision: its scene is shown again.
+    bool goBack() { return canGoBack() && rewindTo(history.size() - 2); }
+
+    // Puts the session back to just before visit number 'step' (0 is the
+    // first scene), as if no later choice had been made. 'events' gets
+    // one kRewound row per choice undone, naming the scene it was made
+    // at; the visit that shows scene 'step' again is not reported.
+    bool rewindTo(size_t step) {
+        if (!canGoBack() || step >= history.size()) return false;
+        if (events)
+            for (size_t i = choicesMade.size(); i-- > step;) events->record(sessionId, history[i], EventLog::kRewound);
+        revisiting = true;
+        const Checkpoint& cp = checkpoints[step / checkpointEvery];
+        currentId = cp.currentId;
+        arrivedBy = cp.arrivedBy;
+        loopTortoise = cp.loopTortoise;
+        loopPower = cp.loopPower;
+        loopLength = cp.loopLength;
+        history.resize(cp.step);
+        for (size_t i = cp.step; i < step; ++i) {
+            history.push_back(currentId);
+            int c = choicesMade[i];
+            currentId = graph->get(currentId)->choices[c].nextId;   // visited, so it exists
+            arrivedBy = c;
+            if (detectLoops) enterNode(currentId);
+        }
+        choicesMade.resize(step);
+        checkpoints.resize((step + checkpointEvery - 1) / checkpointEvery);
+        return true;
+    }
+
+    // Rebuilds choicesMade and the checkpoints by replaying 'history',
+    // taking at each step the first choice that leads to the next node
+    // visited (another would reach the same state, bar arrivedBy).
+    // False, with nothing changed, if the history does not follow the
+    // graph; canGoBack() then skips it until the history changes.
+    bool replayHistory() {
+        auto choiceTo = [this](size_t i) {
+            const StoryNode* node = graph->get(history[i]);
+            size_t c = 0;
+            while (node && c < node->choices.size() && node->choices[c].nextId != history[i + 1]) ++c;
+            return node && c < node->choices.size() ? (int)c : -1;
+        };
+        for (size_t i = 0; i + 1 < history.size(); ++i)
+            if (choiceTo(i) < 0) {
+                unreplayableAt = history.size();
+                return false;
+            }
+        int last = currentId;
+        currentId = loopTortoise = history[0];
+        arrivedBy = -1;
+        loopPower = loopLength = 1;
+        choicesMade.clear();
+        checkpoints.clear();
+        for (size_t i = 0; i < history.size(); ++i) {
+            if (i % checkpointEvery == 0)
+                checkpoints.push_back({(uint32_t)i, currentId, arrivedBy, loopTortoise, loopPower, loopLength});
+            if (i + 1 == history.size()) break;
+            currentId = history[i + 1];
+            choiceTaken(choiceTo(i));
+            if (detectLoops) enterNode(currentId);
+        }
+        currentId = last;
+        return true;
+    }
+
+    // Brent's algorithm over the sequence of visited nodes: O(1) memory,
+    // and a cycle is reported within a few laps of entering it. Returns
+    // true if 'id' proves the walk is repeating. Only meaningful when
+    // the next choice is a pure function of the node (deterministic bots).
+    bool enterNode(int id) {
+        if (id == loopTortoise) return true;
+        if (loopLength == loopPower) {
+            loopTortoise = id;
+            loopPower *= 2;
+            loopLength = 0;
+        }
+        ++loopLength;
+        return false;
+    }
+
+    MemoryFootprint memoryFootprint() const {
+        MemoryFootprint m;
+        m.nodeStructs = sizeof(*this);
+        m.history = history.capacity() * sizeof(int) + choicesMade.capacity() * sizeof(uint16_t) +
+                    checkpoints.capacity() * sizeof(Checkpoint);
+        m.buffers = heapBytes(input) + heapBytes(scratch) + heapBytes(frameBuf) +
+                    prepared.capacity() * sizeof(const StoryNode*);
+        return m;
+    }
+};
+
+/* ------------------------------------------------------------------
+   writeFrame:
+   Sends a pre-rendered frame in one write and flushes it, so web
+   consoles show the whole scene before we block on input.
+-------------------------------------------------------------------*/
+void writeFrame(ostream& out, string_view frame) {
+    out.write(frame.data(), (streamsize)frame.size());
+    out.flush();
+}
+
+/* ------------------------------------------------------------------
+   popularFrame:
+   With s.popularity set, a menu is rendered afresh into s.frameBuf
+   with the percentages from the session's snapshot (brought up to
+   date first, see ChoicePopularity::update). Otherwise, and for
+   endings, returns 'frame' unchanged.
+-------------------------------------------------------------------*/
+string_view popularFrame(Session& s, const StoryNode& node, string_view frame) {
+    if (!s.popularity || node.isEnding()) return frame;
+    s.popularity->update(s.popularSeen);
+    const uint8_t* percent = s.popularity->percentages(*s.popularSeen, node.id);
+    if (!percent) return frame;
+    s.frameBuf.clear();
+    appendFrame(s.frameBuf, node, percent);
+    return s.frameBuf;
+}
+
+/* ------------------------------------------------------------------
+   prepareSuccessors:
+   Speculative work done just before we block on the player's input.
+   Every successor in node.choices is looked up now and its frame is
+   prefetched, so once Enter is pressed the next scene is a pointer
+   away and can be written straight out: no map lookup, no formatting.
+   With a LazyFrameStore, the session's FramePrefetcher also loads the
+   likeliest upcoming frames from disk into the cache.
+   s.prepared[i] is the node for choice i+1 (nullptr if it is missing,
+   in which case runSession falls back to a normal lookup and reports it).
+-------------------------------------------------------------------*/
+void prepareSuccessors(Session& s, const StoryNode& node) {
+    s.prepared.clear();
+    for (const Choice& c : node.choices) {
+        const StoryNode* next = s.graph->get(c.nextId);
+        if (next) {
+            const char* bytes = next->frame.data();
+            for (size_t off = 0; off < next->frame.size() && off < 256; off += 64)
+                __builtin_prefetch(bytes + off);
+        }
+        s.prepared.push_back(next);
+    }
+    if (s.prefetcher) s.prefetcher->prefetchFrom(node);
+}
+
+/* ------------------------------------------------------------------
+   runSession:
+   The game loop for one session:
+     - Look up the current node (prepared while waiting for input)
+     - Render its frame (plus the path summary if it is an ending)
+     - Prepare every successor, then read a choice and move
+       ("back" rewinds to the previous decision instead, see goBack)
+   'pace' enables the cinematic pauses; batch runs turn them off.
+   Returns one of the kSession* codes below; automated runs can be cut
+   short by the session's step budget or loop detection.
+-------------------------------------------------------------------*/
+const int kSessionEnded = 0;        // reached an ending
+const int kSessionMissingNode = 1;  // a choice points at an unknown node
+const int kSessionOverBudget = 2;   // stepBudget transitions without an ending
+const int kSessionLooped = 3;       // detectLoops found a repeating walk
+
+int runSession(Session& s, istream& in, ostream& out, bool pace) {
+    MetricsRegistry& metrics = MetricsRegistry::instance();
+    GameMetrics& gm = GameMetrics::instance();
+    metrics.add(gm.sessionsStarted);
+    const StoryNode* next = nullptr;   // successor prepared during the input wait
+
+    while (true) {
+        // Look up the current node by ID (already done if it was prepared)
+        const StoryNode* node;
+        {
+            NEBULA_PHASE(Phase::Lookup);
+            node = next ? next : s.graph->get(s.currentId);
+        }
+        if (!node) {
+            // If this ever triggers, you referenced a node ID that doesn't exist.
+            out << "ERROR: Missing node " << s.currentId << "\n";
+            return kSessionMissingNode;
+        }
+
+        // Record path for an end-of-game summary (useful for debugging/analytics)
+        s.visit(node->id);
+        NEBULA_TRACE_BEGIN("node", node->id);
+
+        {
+            NEBULA_PHASE(Phase::Render);
+            string_view frame = node->frame;
+            if (s.frameStore && s.frameStore->fetch(node->id, s.frameBuf)) frame = s.frameBuf;
+            frame = popularFrame(s, *node, frame);
+            writeFrame(out, frame);
+            size_t bytes = frame.size();
+            if (node->isEnding()) {
+                s.scratch.clear();
+                appendPathTaken(s.scratch, s.history);
+                writeFrame(out, s.scratch);
+                bytes += s.scratch.size();
+            }
+            metrics.add(gm.renderBytes, bytes);
+        }
+        if (node->isEnding()) {
+            int slot = gm.endingSlotFor(node->id);
+            if (slot >= 0) metrics.add(slot);
+            metrics.add(gm.sessionsEnded);
+            NEBULA_TRACE_END("node");
+            return kSessionEnded;
+        }
+
+        // Read/validate user selection and transition to the chosen next node.
+        prepareSuccessors(s, *node);
+        int pick;
+        {
+            NEBULA_PHASE(Phase::InputWait);
+            pick = readMenuChoice((int)node->choices.size(), s.input, in, out, s.canGoBack());
+        }
+        if (pick == kInputBack) {
+            s.goBack();
+            metrics.add(gm.rewinds);
+            next = nullptr;
+            NEBULA_TRACE_END("node");
+            continue;
+        }
+        s.currentId = node->choices[pick - 1].nextId;
+        s.choiceTaken(pick - 1);
+        next = s.prepared[pick - 1];
+        if (s.choiceStats) s.choiceStats->record(node->id, pick - 1);
+        metrics.add(gm.transitions);
+
+        // Stop runaway automated sessions instead of looping forever.
+        int stopped = -1;
+        if (s.stepBudget && s.history.size() >= s.stepBudget) stopped = kSessionOverBudget;
+        else if (s.detectLoops && s.enterNode(s.currentId)) stopped = kSessionLooped;
+        if (stopped >= 0) {
+            metrics.add(stopped == kSessionOverBudget ? gm.stoppedOverBudget : gm.stoppedLooped);
+            out << "Session stopped: "
+                << (stopped == kSessionOverBudget ? "step budget exhausted" : "loop detected")
+                << " after " << s.history.size() << " steps.\n";
+            NEBULA_TRACE_END("node");
+            return stopped;
+        }
+
+        // Small cinematic pause between scenes.
+        if (pace) {
+            NEBULA_PHASE(Phase::Pacing);
+            pauseDots();
+        }
+        NEBULA_TRACE_END("node");
+    }
+}
+
+/* ------------------------------------------------------------------
+   Step-wise engine:
+   The same game as runSession, driven one input line at a time so a
+   server can hold many sessions without a thread (or stream) each.
+   Output is appended to 'out'; each function returns true once the
+   session is over (ending reached, or a missing node reported).
+   - sessionOpen(): starts a session and renders its first node.
+   - sessionRender(): renders the current node, then the prompt.
+   - sessionInput(): validates one line like readMenuChoice (same
+     messages), then moves and renders the next node.
+   - sessionApply(): the second half of sessionInput, for a line that
+     was already parsed against 'node' and whose next node is already
+     looked up (see InputBatch).
+   - sessionResume(): re-sends the current scene and prompt without
+     counting a visit (a player reattached after a failover).
+   With s.markScenes set, scenes and prompts are written as 5-byte
+   markers (kSceneMark + u32 node id, kPromptMark + u32 options)
+   instead of text; the cluster router expands them per client, so a
+   frame crosses from worker to router as 5 bytes (see deliver()).
+-------------------------------------------------------------------*/
+const char kSceneMark = '\x1e', kPromptMark = '\x1f';   // never in story text
+
+void appendScene(string& out, Session& s, const StoryNode& node) {
+    if (!s.markScenes) {
+        string_view frame = popularFrame(s, node, node.frame);
+        out.append(frame.data(), frame.size());
+        return;
+    }
+    out += kSceneMark;
+    putU32(out, (uint32_t)node.id);
+}
+
+void appendPrompt(string& out, size_t maxOpt, bool marked = false) {
+    if (marked) {
+        out += kPromptMark;
+        putU32(out, (uint32_t)maxOpt);
+        return;
+    }
+    char num[16];
+    auto res = to_chars(num, num + sizeof(num), maxOpt);
+    out += "Enter choice (1-";
+    out.append(num, res.ptr);
+    out += "): ";
+}
+
+// 'node' is s.currentId's node, already looked up (null if missing).
+bool sessionRender(Session& s, const StoryNode* node, string& out) {
+    MetricsRegistry& metrics = MetricsRegistry::instance();
+    GameMetrics& gm = GameMetrics::instance();
+    if (!node) {
+        out += "ERROR: Missing node " + to_string(s.currentId) + "\n";
+        return true;
+    }
+    s.visit(node->id);
+    appendScene(out, s, *node);
+    size_t bytes = node->frame.size();
+    if (node->isEnding()) {
+        size_t before = out.size();
+        appendPathTaken(out, s.history);
+        metrics.add(gm.renderBytes, bytes + out.size() - before);
+        int slot = gm.endingSlotFor(node->id);
+        if (slot >= 0) metrics.add(slot);
+        metrics.add(gm.sessionsEnded);
+        return true;
+    }
+    metrics.add(gm.renderBytes, bytes);
+    appendPrompt(out, node->choices.size(), s.markScenes);
+    return false;
+}
+
+bool sessionRender(Session& s, string& out) {
+    return sessionRender(s, s.graph->get(s.currentId), out);
+}
+
+bool sessionOpen(Session& s, string& out) {
+    MetricsRegistry::instance().add(GameMetrics::instance().sessionsStarted);
+    return sessionRender(s, out);
+}
+
+// 'next' is the node choice 'val' leads to (unused for rejected lines).
+// kInputBack must only be passed when s.canGoBack().
+bool sessionApply(Session& s, const StoryNode& node, int val, const StoryNode* next, string& out) {
+    if (val == kInputBack) {
+        s.goBack();
+        MetricsRegistry::instance().add(GameMetrics::instance().rewinds);
+        return sessionRender(s, out);
+    }
+    if (val <= 0) {
+        if (val == kInputNotANumber) out += "Please enter a number.\n";
+        else if (val == kInputOutOfRange) out += "Please choose a valid option.\n";
+        appendPrompt(out, node.choices.size(), s.markScenes);
+        return false;
+    }
+    s.currentId = node.choices[val - 1].nextId;
+    s.choiceTaken(val - 1);
+    if (s.choiceStats) s.choiceStats->record(node.id, val - 1);
+    return sessionRender(s, next, out);
+}
+
+bool sessionInput(Session& s, string_view line, string& out) {
+    MetricsRegistry& metrics = MetricsRegistry::instance();
+    GameMetrics& gm = GameMetrics::instance();
+    const StoryNode* node = s.graph->get(s.currentId);
+    if (!node || node->isEnding()) return true;
+
+    int val = parseMenuChoice(line.data(), line.size(), (int)node->choices.size());
+    if (menuKeyword(val, line.data(), line.size()) == kInputBack && s.canGoBack()) val = kInputBack;
+    if (val == kInputNotANumber) metrics.add(gm.inputNotNumber);
+    else if (val == kInputOutOfRange) metrics.add(gm.inputOutOfRange);
+    else if (val > 0) metrics.add(gm.transitions);
+    const StoryNode* next = val > 0 ? s.graph->get(node->choices[val - 1].nextId) : nullptr;
+    return sessionApply(s, *node, val, next, out);
+}
+
+bool sessionResume(Session& s, string& out) {
+    const StoryNode* node = s.graph->get(s.currentId);
+    if (!node) {
+        out += "ERROR: Missing node " + to_string(s.currentId) + "\n";
+        return true;
+    }
+    appendScene(out, s, *node);
+    if (node->isEnding()) {
+        appendPathTaken(out, s.history);
+        return true;
+    }
+    appendPrompt(out, node->choices.size(), s.markScenes);
+    return false;
+}
+
+/* ------------------------------------------------------------------
+   InputBatch:
+   Applies input lines for many sessions at once — what a front end
+   collects from its sockets in one event-loop tick — with the same
+   results as calling sessionInput() on each line in order.
+   - add() resolves the session's current node and packs the line into
+     a word (packMenuLine), so nothing per session is looked up later.
+   - run() validates every line in one pass over the packed words and
+     option counts (parsePackedChoice; longer lines are fixed up after),
+     then applies transitions and renders through sessionApply(), all
+     into one output buffer. Metrics are added once per batch.
+   Sessions in one batch crowd onto a few nodes, so graph lookups go
+   through a small direct-mapped cache that lives until clear(): most
+   of a batch's lookups cost a compare instead of a tree walk.
+   A session may appear more than once; a line for a session that an
+   earlier line in the batch already moved is re-parsed at apply time.
+   Results hold the session's node and history length right after
+   each line, for callers that replicate or acknowledge every step.
+   Buffers are kept between batches, so a warmed-up batch does not
+   allocate (see --check-allocs).
+-------------------------------------------------------------------*/
+class InputBatch {
+public:
+    struct Result {
+        uint32_t offset = 0, length = 0;  // rendered output within text()
+        int nodeId = 0;                   // session's node after this line
+        uint32_t steps = 0;               // session's history length after it
+        bool moved = false;               // a choice was taken, or the player went back
+        bool rewound = false;             // went back: history is no longer an extension
+        bool finished = false;            // session over (as sessionInput)
+    };
+
+    void clear() {
+        for (CachedNode& c : nodeCache) c.graph = nullptr;
+        items.clear();
+        words.clear();
+        lengths.clear();
+        limits.clear();
+        vals.clear();
+        results.clear();
+        out.clear();
+    }
+
+    void add(Session& s, string_view line) {
+        const StoryNode* node = lookup(*s.graph, s.currentId);
+        items.push_back({&s, line, node});
+        words.push_back(packMenuLine(line.data(), line.size()));
+        lengths.push_back((uint32_t)min<size_t>(line.size(), UINT32_MAX));
+        limits.push_back(optionsAt(node));
+    }
+
+    size_t size() const { return items.size(); }
+
+    void run() {
+        size_t n = items.size();
+        vals.resize(n);
+        for (size_t i = 0; i < n; ++i)
+            vals[i] = parsePackedChoice(words[i], lengths[i], limits[i]);
+        for (size_t i = 0; i < n; ++i)
+            if (lengths[i] > kPackedLineMax)
+                vals[i] = parseMenuChoice(items[i].line.data(), lengths[i], limits[i]);
+
+        uint64_t notNumber = 0, outOfRange = 0, transitions = 0;
+        results.resize(n);
+        for (size_t i = 0; i < n; ++i) {
+            Item& it = items[i];
+            Session& s = *it.session;
+            Result& r = results[i];
+            r.offset = (uint32_t)out.size();
+            size_t before = s.history.size();
+            if (it.node && s.currentId != it.node->id) {
+                // Moved by an earlier line in this batch.
+                it.node = lookup(*s.graph, s.currentId);
+                limits[i] = optionsAt(it.node);
+                vals[i] = parseMenuChoice(it.line.data(), it.line.size(), limits[i]);
+            }
+            int val = vals[i];
+            if (limits[i] < 0) {
+                r.finished = true;
+            } else {
+                if (menuKeyword(val, it.line.data(), it.line.size()) == kInputBack && s.canGoBack())
+                    val = kInputBack;
+                notNumber += val == kInputNotANumber;
+                outOfRange += val == kInputOutOfRange;
+                transitions += val > 0;
+                const StoryNode* next =
+                    val > 0 ? lookup(*s.graph, it.node->choices[val - 1].nextId) : nullptr;
+                r.finished = sessionApply(s, *it.node, val, next, out);
+            }
+            r.length = (uint32_t)(out.size() - r.offset);
+            r.nodeId = s.currentId;
+            r.steps = (uint32_t)s.history.size();
+            r.moved = s.history.size() != before;
+            r.rewound = val == kInputBack;
+        }
+        MetricsRegistry& metrics = MetricsRegistry::instance();
+        GameMetrics& gm = GameMetrics::instance();
+        if (notNumber) metrics.add(gm.inputNotNumber, notNumber);
+        if (outOfRange) metrics.add(gm.inputOutOfRange, outOfRange);
+        if (transitions) metrics.add(gm.transitions, transitions);
+    }
+
+    const Result& result(size_t i) const { return results[i]; }
+
+    string_view output(size_t i) const {
+        return string_view(out).substr(results[i].offset, results[i].length);
+    }
+
+    const string& text() const { return out; }
+
+private:
+    struct Item {
+        Session* session;
+        string_view line;
+        const StoryNode* node;
+    };
+
+    struct CachedNode {
+        const StoryGraph* graph = nullptr;
+        int id = 0;
+        const StoryNode* node = nullptr;
+    };
+    static const size_t kNodeCacheSlots = 64;
+
+    const StoryNode* lookup(const StoryGraph& graph, int id) {
+        CachedNode& c = nodeCache[(size_t)id % kNodeCacheSlots];
+        if (c.graph != &graph || c.id != id) c = {&graph, id, graph.get(id)};
+        return c.node;
+    }
+
+    // Options to validate against; -1 once the session is over.
+    static int optionsAt(const StoryNode* node) {
+        return node && !node->isEnding() ? (int)node->choices.size() : -1;
+    }
+
+    // One entry per line; words/lengths/limits/vals are kept apart so
+    // the validation loop streams through plain arrays.
+    vector<Item> items;
+    vector<uint64_t> words;
+    vector<uint32_t> lengths;
+    vector<int> limits;
+    vector<int> vals;
+    vector<Result> results;
+    string out;
+    CachedNode nodeCache[kNodeCacheSlots];
+};
+
+/* ------------------------------------------------------------------
+   checkSteadyStateAllocs:
+   Self-check for the zero-allocation game loop (--check-allocs).
+   Plays one warm-up session, then many more from a scripted input that
+   includes invalid lines, and counts heap allocations per transition.
+   Then does the same for step-engine sessions fed through InputBatch.
+   Needs a build with -DNEBULA_COUNT_ALLOCS=1 to see the counter.
+-------------------------------------------------------------------*/
+int checkSteadyStateAllocs(const StoryGraph& graph) {
+    if (!NEBULA_COUNT_ALLOCS) {
+        cerr << "--check-allocs needs a build with -DNEBULA_COUNT_ALLOCS=1\n";
+        return 2;
+    }
+    const int kSessions = 1000;
+    // Every pick of "1" walks 0 -> 1 -> 3 -> 6 -> 11; sprinkle in bad input.
+    string script;
+    for (int i = 0; i <= kSessions; ++i) script += "x\n1\n9\n1\n\n1\n1\n";
+    istringstream in(script);
+    ostream sink(nullptr);              // discards output without allocating
+
+    Session session(graph);
+    runSession(session, in, sink, false);   // warm-up: sizes every buffer
+
+    uint64_t before = heapAllocCount();
+    uint64_t transitions = 0;
+    for (int i = 0; i < kSessions; ++i) {
+        session.reset();
+        runSession(session, in, sink, false);
+        transitions += session.history.size() - 1;
+    }
+    uint64_t allocs = heapAllocCount() - before;
+
+    cout << "sessions=" << kSessions << " transitions=" << transitions
+         << " heap_allocs=" << allocs << "\n";
+
+    // 64 sessions per batch, each fed the same script one line per batch.
+    const char* lines[] = {"x", "1", "9", "1", "", "1", "1"};
+    const size_t kLines = sizeof(lines) / sizeof(lines[0]);
+    const int kBatchSessions = 64, kRounds = 1000;
+    vector<unique_ptr<Session>> batchSessions;
+    for (int i = 0; i < kBatchSessions; ++i) batchSessions.emplace_back(new Session(graph));
+    InputBatch batch;
+    string opened;
+    uint64_t batchAllocs = 0, inputs = 0;
+    for (int round = 0; round < kRounds + (int)kLines; ++round) {
+        if (round == (int)kLines) batchAllocs = heapAllocCount();   // one script of warm-up
+        batch.clear();
+        for (auto& bs : batchSessions) {
+            if (round % kLines == 0) {
+                bs->reset();
+                opened.clear();
+                sessionOpen(*bs, opened);
+            }
+            batch.add(*bs, lines[round % kLines]);
+        }
+        batch.run();
+        if (round >= (int)kLines) inputs += batch.size();
+    }
+    batchAllocs = heapAllocCount() - batchAllocs;
+    cout << "batched_inputs=" << inputs << " heap_allocs=" << batchAllocs << "\n";
+    return allocs == 0 && batchAllocs == 0 ? 0 : 1;
+}
+
+/* ======================
+   Regression Testing
+   ====================== */
+
+/* ------------------------------------------------------------------
+   PlaythroughCorpus:
+   Recorded playthroughs as sequences of 0-based choice indices, all in
+   one array: playthrough i is choices[offsets[i] .. offsets[i + 1]).
+   - add() appends one sequence.
+   - loadEventLog() adds every session in an EventLog file; a row with
+     choice -1 starts a new playthrough for its session, a kRewound row
+     takes back its last choice, and sessions already under way when
+     the log began are skipped.
+   One byte per choice, so millions of playthroughs fit in a few MB.
+-------------------------------------------------------------------*/
+class PlaythroughCorpus {
+public:
+    size_t size() const { return offsets.size() - 1; }
+    size_t choiceCount() const { return choices.size(); }
+    const uint8_t* begin(size_t i) const { return choices.data() + offsets[i]; }
+    const uint8_t* end(size_t i) const { return choices.data() + offsets[i + 1]; }
+
+    void add(const uint8_t* seq, size_t n) {
+        choices.insert(choices.end(), seq, seq + n);
+        offsets.push_back(choices.size());
+    }
+
+    bool loadEventLog(const string& path) {
+        EventLogReader reader;
+        if (!reader.open(path)) return false;
+        const uint32_t kSkip = UINT32_MAX;
+        EventLogReader::Columns c;
+        unordered_map<uint64_t, uint32_t> current;   // session -> its playthrough
+        vector<pair<uint32_t, int16_t>> steps;       // (playthrough, choice or kRewound), in log order
+        uint32_t count = 0;
+        while (reader.next(c)) {
+            for (size_t i = 0; i < c.rows(); ++i) {
+                if (c.choice[i] == -1) {
+                    current[c.session[i]] = count++;
+                    continue;
+                }
+                auto it = current.emplace(c.session[i], kSkip).first;
+                if (it->second != kSkip) steps.push_back({it->second, c.choice[i]});
+            }
+        }
+        // Counting sort by playthrough keeps each one's steps in order;
+        // each is then replayed as a stack, a rewind popping a choice.
+        vector<size_t> start(count + 1, 0);
+        for (auto& s : steps) ++start[s.first + 1];
+        for (uint32_t p = 0; p < count; ++p) start[p + 1] += start[p];
+        vector<int16_t> ordered(steps.size());
+        vector<size_t> fill(start.begin(), start.end() - 1);
+        for (auto& s : steps) ordered[fill[s.first]++] = s.second;
+        choices.reserve(choices.size() + ordered.size());
+        for (uint32_t p = 0; p < count; ++p) {
+            size_t first = choices.size();
+            for (size_t i = start[p]; i < start[p + 1]; ++i) {
+                if (ordered[i] != EventLog::kRewound) choices.push_back((uint8_t)min<int>(ordered[i], 255));
+                else if (choices.size() > first) choices.pop_back();
+            }
+            offsets.push_back(choices.size());
+        }
+        return !reader.failed();
+    }
+
+private:
+    vector<uint8_t> choices;
+    vector<size_t> offsets{0};
+};
+
+/* ------------------------------------------------------------------
+   PlaythroughOutcome / replayPlaythrough:
+   Where a recorded choice sequence leads on a given graph:
+   - Ending: reached ending 'node' (any later choices are ignored);
+   - MissingNode: choice 'choice' of 'node' leads to no node;
+   - InvalidChoice: 'node' has no choice number 'choice';
+   - Unfinished: the choices ran out at 'node', which is no ending.
+   'steps' counts the choices taken first; it is not compared, so a
+   playthrough that reaches the same ending another way is unchanged.
+-------------------------------------------------------------------*/
+struct PlaythroughOutcome {
+    enum Kind : uint8_t { Ending, MissingNode, InvalidChoice, Unfinished };
+    Kind kind = Ending;
+    int node = 0, choice = -1;
+    uint32_t steps = 0;
+
+    bool operator==(const PlaythroughOutcome& o) const {
+        return kind == o.kind && node == o.node && choice == o.choice;
+    }
+    bool operator!=(const PlaythroughOutcome& o) const { return !(*this == o); }
+
+    string describe() const {
+        string at = " (after " + to_string(steps) + " choices)";
+        switch (kind) {
+        case Ending: return "ending " + to_string(node) + at;
+        case MissingNode: return "choice " + to_string(choice + 1) + " of node " + to_string(node) + " leads nowhere" + at;
+        case InvalidChoice: return "node " + to_string(node) + " has no choice " + to_string(choice + 1) + at;
+        default: return "unfinished at node " + to_string(node) + at;
+        }
+    }
+};
+
+PlaythroughOutcome replayPlaythrough(const CompactGraph& g, const uint8_t* c, const uint8_t* end) {
+    PlaythroughOutcome o;
+    uint32_t at = g.indexOf(0);
+    if (at == CompactGraph::kNone) {
+        o.kind = PlaythroughOutcome::MissingNode;
+        return o;
+    }
+    for (;; ++c, ++o.steps) {
+        o.node = g.idAt(at);
+        if (g.isEnding(at)) return o;
+        if (c == end) {
+            o.kind = PlaythroughOutcome::Unfinished;
+            return o;
+        }
+        if (*c >= g.choiceCount(at)) {
+            o.kind = PlaythroughOutcome::InvalidChoice;
+            o.choice = *c;
+            return o;
+        }
+        uint32_t next = g.next(at, *c);
+        if (next == CompactGraph::kNone) {
+            o.kind = PlaythroughOutcome::MissingNode;
+            o.choice = *c;
+            return o;
+        }
+        at = next;
+    }
+}
+
+/* ------------------------------------------------------------------
+   RegressionReport / compareStoryVersions:
+   Replays every playthrough of a corpus on two versions of a story
+   and sorts those whose outcome changed by what happens on the new
+   one: a different ending, a missing node, an invalid choice, or
+   anything else (now unfinished, or a broken playthrough fixed).
+   - Threads take chunks of kChunk playthroughs from a shared counter
+     and keep their own counts and examples, merged once at the end;
+     examples are the lowest-numbered playthroughs of each kind, so
+     the report does not depend on the thread count.
+   - Both versions are CompactGraphs: a step is two table reads.
+-------------------------------------------------------------------*/
+struct RegressionReport {
+    enum Category { EndingChanged, MissingNode, InvalidChoice, OtherChange, kCategories };
+
+    struct Example {
+        size_t playthrough;
+        PlaythroughOutcome before, after;
+    };
+
+    uint64_t replayed = 0, unchanged = 0;
+    uint64_t counts[kCategories] = {};
+    vector<Example> examples[kCategories];
+
+    static const char* categoryName(int c) {
+        static const char* names[] = {"different_ending", "missing_node", "invalid_choice", "other"};
+        return names[c];
+    }
+
+    uint64_t diverged() const { return replayed - unchanged; }
+};
+
+RegressionReport compareStoryVersions(const CompactGraph& before, const CompactGraph& after,
+                                      const PlaythroughCorpus& corpus, int threads,
+                                      size_t examplesPerCategory = 5) {
+    const size_t kChunk = 4096;
+    vector<RegressionReport> partial(max(threads, 1));
+    atomic<size_t> nextChunk{0};
+    auto work = [&](RegressionReport& r) {
+        for (size_t from; (from = nextChunk.fetch_add(kChunk)) < corpus.size();) {
+            size_t to = min(corpus.size(), from + kChunk);
+            for (size_t i = from; i < to; ++i) {
+                PlaythroughOutcome a = replayPlaythrough(before, corpus.begin(i), corpus.end(i));
+                PlaythroughOutcome b = replayPlaythrough(after, corpus.begin(i), corpus.end(i));
+                ++r.replayed;
+                if (a == b) {
+                    ++r.unchanged;
+                    continue;
+                }
+                int cat = b.kind == PlaythroughOutcome::MissingNode ? RegressionReport::MissingNode
+                        : b.kind == PlaythroughOutcome::InvalidChoice ? RegressionReport::InvalidChoice
+                        : a.kind == PlaythroughOutcome::Ending && b.kind == PlaythroughOutcome::Ending
+                            ? RegressionReport::EndingChanged
+                            : RegressionReport::OtherChange;
+                ++r.counts[cat];
+                if (r.examples[cat].size() < examplesPerCategory) r.examples[cat].push_back({i, a, b});
+            }
+        }
+    };
+    vector<thread> workers;
+    for (size_t t = 1; t < partial.size(); ++t) workers.emplace_back(work, ref(partial[t]));
+    work(partial[0]);
+    for (auto& w : workers) w.join();
+
+    RegressionReport total;
+    for (RegressionReport& r : partial) {
+        total.replayed += r.replayed;
+        total.unchanged += r.unchanged;
+        for (int c = 0; c < RegressionReport::kCategories; ++c) {
+            total.counts[c] += r.counts[c];
+            total.examples[c].insert(total.examples[c].end(), r.examples[c].begin(), r.examples[c].end());
+        }
+    }
+    for (auto& ex : total.examples) {
+        sort(ex.begin(), ex.end(), [](const RegressionReport::Example& a, const RegressionReport::Example& b) {
+            return a.playthrough < b.playthrough;
+        });
+        if (ex.size() > examplesPerCategory) ex.resize(examplesPerCategory);
+    }
+    return total;
+}
+
+/* ======================
+   Story Lint
+   ====================== */
+
+/* ------------------------------------------------------------------
+   LintContext:
+   What rules may ask about the story as a whole. exists() answers
+   from a bitmap of the IDs in use, one bit per ID between the lowest
+   and highest, instead of a map lookup per choice. When the IDs are
+   too sparse for that (over 64 possible IDs per node) it searches a
+   sorted array of them instead.
+-------------------------------------------------------------------*/
+struct LintContext {
+    const StoryGraph& graph;
+    int64_t lowId = 0;
+    vector<uint64_t> present;   // the bitmap, if the IDs are dense enough
+    vector<int> sortedIds;      // otherwise
+
+    explicit LintContext(const StoryGraph& g) : graph(g) {}
+
+    bool exists(int id) const {
+        if (present.empty()) return binary_search(sortedIds.begin(), sortedIds.end(), id);
+        uint64_t bit = (uint64_t)((int64_t)id - lowId);
+        return bit < present.size() * 64 && (present[bit / 64] >> (bit % 64) & 1);
+    }
+};
+
+/* ------------------------------------------------------------------
+   LintRule:
+   One check applied to every node of a story. flags() must be cheap
+   and thread-safe (it runs on many nodes at once); explain() is only
+   called for the few findings kept as examples. Errors break play,
+   warnings are matters of style the author may accept.
+-------------------------------------------------------------------*/
+class LintRule {
+public:
+    virtual ~LintRule() {}
+    virtual const char* name() const = 0;
+    virtual bool isError() const { return false; }
+    virtual bool flags(const StoryNode& node, const LintContext& story) const = 0;
+    virtual string explain(const StoryNode& node, const LintContext& story) const = 0;
+};
+
+// An ending must say so, and only an ending may.
+class EndingMarkerRule : public LintRule {
+public:
+    const char* name() const override { return "ending-marker"; }
+    bool isError() const override { return true; }
+    bool flags(const StoryNode& node, const LintContext&) const override {
+        return node.isEnding() != (node.text.find("*** ENDING") != string_view::npos);
+    }
+    string explain(const StoryNode& node, const LintContext&) const override {
+        return node.isEnding() ? "ending without a \"*** ENDING\" line" : "\"*** ENDING\" line on a node with choices";
+    }
+};
+
+// A choice leading to a node that does not exist.
+class DanglingChoiceRule : public LintRule {
+public:
+    const char* name() const override { return "dangling-choice"; }
+    bool isError() const override { return true; }
+    bool flags(const StoryNode& node, const LintContext& story) const override {
+        for (const Choice& c : node.choices)
+            if (!story.exists(c.nextId)) return true;
+        return false;
+    }
+    string explain(const StoryNode& node, const LintContext& story) const override {
+        for (size_t i = 0; i < node.choices.size(); ++i)
+            if (!story.exists(node.choices[i].nextId))
+                return "choice " + to_string(i + 1) + " leads to missing node " + to_string(node.choices[i].nextId);
+        return "";
+    }
+};
+
+// Two choices the player cannot tell apart.
+class DuplicateLabelRule : public LintRule {
+public:
+    const char* name() const override { return "duplicate-label"; }
+    bool flags(const StoryNode& node, const LintContext&) const override { return firstRepeat(node) >= 0; }
+    string explain(const StoryNode& node, const LintContext&) const override {
+        int i = firstRepeat(node);
+        return "choice " + to_string(i + 1) + " repeats the label \"" + string(node.choices[i].label) + "\"";
+    }
+
+private:
+    static int firstRepeat(const StoryNode& node) {
+        for (size_t i = 1; i < node.choices.size(); ++i)
+            for (size_t j = 0; j < i; ++j)
+                if (node.choices[i].label == node.choices[j].label) return (int)i;
+        return -1;
+    }
+};
+
+// More options than the menu handles comfortably (one keystroke each by default).
+class TooManyChoicesRule : public LintRule {
+public:
+    explicit TooManyChoicesRule(size_t maxChoices = 9) : maxChoices(maxChoices) {}
+    const char* name() const override { return "too-many-choices"; }
+    bool flags(const StoryNode& node, const LintContext&) const override { return node.choices.size() > maxChoices; }
+    string explain(const StoryNode& node, const LintContext&) const override {
+        return to_string(node.choices.size()) + " choices, more than " + to_string(maxChoices);
+    }
+
+private:
+    size_t maxChoices;
+};
+
+// Scene text too long to read comfortably in one screen.
+class OverlongTextRule : public LintRule {
+public:
+    explicit OverlongTextRule(size_t maxBytes = 1200) : maxBytes(maxBytes) {}
+    const char* name() const override { return "overlong-text"; }
+    bool flags(const StoryNode& node, const LintContext&) const override { return node.text.size() > maxBytes; }
+    string explain(const StoryNode& node, const LintContext&) const override {
+        return to_string(node.text.size()) + " bytes of text, more than " + to_string(maxBytes);
+    }
+
+private:
+    size_t maxBytes;
+};
+
+// A choice that leads straight back to the same scene.
+class SelfLoopRule : public LintRule {
+public:
+    const char* name() const override { return "self-loop"; }
+    bool flags(const StoryNode& node, const LintContext&) const override {
+        for (const Choice& c : node.choices)
+            if (c.nextId == node.id) return true;
+        return false;
+    }
+    string explain(const StoryNode& node, const LintContext&) const override {
+        for (size_t i = 0; i < node.choices.size(); ++i)
+            if (node.choices[i].nextId == node.id) return "choice " + to_string(i + 1) + " leads back here";
+        return "";
+    }
+};
+
+vector<unique_ptr<LintRule>> defaultLintRules() {
+    vector<unique_ptr<LintRule>> rules;
+    rules.emplace_back(new EndingMarkerRule());
+    rules.emplace_back(new DanglingChoiceRule());
+    rules.emplace_back(new DuplicateLabelRule());
+    rules.emplace_back(new TooManyChoicesRule());
+    rules.emplace_back(new OverlongTextRule());
+    rules.emplace_back(new SelfLoopRule());
+    return rules;
+}
+
+/* ------------------------------------------------------------------
+   LintReport / lintStory:
+   Runs every rule over every node in one pass, in parallel.
+   - The ID range is cut into many slices, each a multiple of 64 IDs;
+     threads claim slices from a shared counter and walk the map from
+     lower_bound() of each, so no node list is built first and no node
+     is seen twice. A first pass the same way fills the LintContext
+     bitmap, each slice writing only its own words.
+   - Each thread counts findings and keeps example nodes in its own
+     report (nothing shared is written until the threads are done);
+     examples are the lowest node IDs per rule, whatever the thread
+     count, and are explained once the reports are merged.
+-------------------------------------------------------------------*/
+struct LintReport {
+    struct Finding {
+        int node;
+        string detail;
+    };
+
+    struct RuleResult {
+        uint64_t count = 0;
+        vector<int> exampleNodes;
+        vector<Finding> examples;
+    };
+
+    uint64_t nodesChecked = 0;
+    vector<RuleResult> rules;   // parallel to the rule list
+
+    uint64_t errors(const vector<unique_ptr<LintRule>>& list) const {
+        uint64_t n = 0;
+        for (size_t r = 0; r < rules.size(); ++r) n += list[r]->isError() ? rules[r].count : 0;
+        return n;
+    }
+};
+
+LintReport lintStory(const StoryGraph& graph, const vector<unique_ptr<LintRule>>& rules, int threads,
+                     size_t examplesPerRule = 5) {
+    const map<int, StoryNode>& nodes = graph.allNodes();
+    LintContext story(graph);
+    vector<LintReport> partial(max(threads, 1));
+    for (LintReport& p : partial) p.rules.resize(rules.size());
+    if (!nodes.empty()) {
+        int64_t lo = nodes.begin()->first, words = ((int64_t)nodes.rbegin()->first - lo) / 64 + 1;
+        int64_t slices = min<int64_t>(words, 64 * (int64_t)partial.size());
+        bool dense = words <= (int64_t)nodes.size();
+        story.lowId = lo;
+        if (dense) story.present.assign((size_t)words, 0);
+        else
+            for (auto& kv : nodes) story.sortedIds.push_back(kv.first);
+        // Calls visit(node) for every node of one slice.
+        auto forSlice = [&](int64_t s, auto visit) {
+            int64_t from = lo + 64 * (words * s / slices), to = lo + 64 * (words * (s + 1) / slices);
+            for (auto it = nodes.lower_bound((int)from); it != nodes.end() && it->first < to; ++it) visit(it->second);
+        };
+        atomic<int64_t> nextSlice{0};
+        auto index = [&] {
+            if (!dense) return;
+            for (int64_t s; (s = nextSlice.fetch_add(1)) < slices;)
+                forSlice(s, [&](const StoryNode& n) {
+                    uint64_t bit = (uint64_t)((int64_t)n.id - lo);
+                    story.present[bit / 64] |= uint64_t(1) << (bit % 64);
+                });
+        };
+        auto check = [&](LintReport& r) {
+            for (int64_t s; (s = nextSlice.fetch_add(1)) < slices;)
+                forSlice(s, [&](const StoryNode& n) {
+                    ++r.nodesChecked;
+                    for (size_t k = 0; k < rules.size(); ++k) {
+                        if (!rules[k]->flags(n, story)) continue;
+                        LintReport::RuleResult& rr = r.rules[k];
+                        ++rr.count;
+                        if (rr.exampleNodes.size() < examplesPerRule) rr.exampleNodes.push_back(n.id);
+                    }
+                });
+        };
+        vector<thread> workers;
+        for (size_t t = 1; t < partial.size(); ++t) workers.emplace_back(index);
+        index();
+        for (auto& w : workers) w.join();
+        workers.clear();
+        nextSlice = 0;
+        for (size_t t = 1; t < partial.size(); ++t) workers.emplace_back(check, ref(partial[t]));
+        check(partial[0]);
+        for (auto& w : workers) w.join();
+    }
+
+    LintReport total;
+    total.rules.resize(rules.size());
+    for (LintReport& p : partial) {
+        total.nodesChecked += p.nodesChecked;
+        for (size_t k = 0; k < rules.size(); ++k) {
+            total.rules[k].count += p.rules[k].count;
+            vector<int>& ex = total.rules[k].exampleNodes;
+            ex.insert(ex.end(), p.rules[k].exampleNodes.begin(), p.rules[k].exampleNodes.end());
+        }
+    }
+    for (size_t k = 0; k < rules.size(); ++k) {
+        vector<int>& ex = total.rules[k].exampleNodes;
+        sort(ex.begin(), ex.end());
+        if (ex.size() > examplesPerRule) ex.resize(examplesPerRule);
+        for (int id : ex) total.rules[k].examples.push_back({id, rules[k]->explain(*graph.get(id), story)});
+    }
+    return total;
+}
+
+/* ------------------------------------------------------------------
+   printLintReport:
+   One line per rule (name, severity, count), then its examples.
+-------------------------------------------------------------------*/
+void printLintReport(ostream& out, const LintReport& report, const vector<unique_ptr<LintRule>>& rules) {
+    for (size_t k = 0; k < rules.size(); ++k) {
+        out << "rule=" << rules[k]->name() << " severity=" << (rules[k]->isError() ? "error" : "warning")
+            << " findings=" << report.rules[k].count << "\n";
+        for (const LintReport::Finding& f : report.rules[k].examples)
+            out << "  node " << f.node << ": " << f.detail << "\n";
+    }
+    out << "nodes=" << report.nodesChecked << " errors=" << report.errors(rules) << "\n";
+}
+
+/* ======================
+   Story Health
+   ====================== */
+
+/* ------------------------------------------------------------------
+   StoryHealth:
+   Structural measures of a story, for tracking as it is written.
+   - branching[k]: nodes with k choices (endings are branching[0]).
+   - depth[d]: nodes whose shortest route from node 0 takes d choices;
+     endingDepth[d] the same for endings. Nodes never reached are
+     'unreachable'.
+   - reconverging: nodes entered by more than one choice (node 1 is
+     entered from 0, 2 and 5); the ratio is taken over all nodes.
+   - sccSizes: strongly connected components by size, so a story
+     without loops has only size-1 entries; 'cyclicNodes' are nodes
+     on some loop (in a larger component, or choosing themselves).
+   json() writes it all as one JSON object, histograms as arrays
+   indexed by value and sccSizes as [size, count] pairs.
+-------------------------------------------------------------------*/
+struct StoryHealth {
+    uint64_t nodes = 0, edges = 0, danglingEdges = 0, endings = 0;
+    uint64_t reachable = 0, reconverging = 0, cyclicNodes = 0;
+    vector<uint64_t> branching, depth, endingDepth;
+    map<uint64_t, uint64_t> sccSizes;
+
+    string json() const {
+        auto array = [](const vector<uint64_t>& v) {
+            string s = "[";
+            for (size_t i = 0; i < v.size(); ++i) s += (i ? "," : "") + to_string(v[i]);
+            return s + "]";
+        };
+        char ratio[32];
+        snprintf(ratio, sizeof(ratio), "%.4f", nodes ? (double)reconverging / nodes : 0.0);
+        string s = "{\"nodes\":" + to_string(nodes) + ",\"edges\":" + to_string(edges) +
+                   ",\"dangling_edges\":" + to_string(danglingEdges) + ",\"endings\":" + to_string(endings) +
+                   ",\"reachable\":" + to_string(reachable) + ",\"unreachable\":" + to_string(nodes - reachable) +
+                   ",\"branching\":" + array(branching) + ",\"depth\":" + array(depth) +
+                   ",\"ending_depth\":" + array(endingDepth) + ",\"reconverging\":" + to_string(reconverging) +
+                   ",\"reconvergence_ratio\":" + ratio + ",\"cyclic_nodes\":" + to_string(cyclicNodes) +
+                   ",\"scc_sizes\":[";
+        bool first = true;
+        for (auto& kv : sccSizes) {
+            s += (first ? "[" : ",[") + to_string(kv.first) + "," + to_string(kv.second) + "]";
+            first = false;
+        }
+        return s + "]}";
+    }
+};
+
+/* ------------------------------------------------------------------
+   sccSizeCounts:
+   Tarjan's algorithm, iterative (an explicit stack of (node, next
+   choice) frames, so deep stories cannot overflow the call stack).
+   Fills h.sccSizes and h.cyclicNodes. One pass over nodes and edges.
+-------------------------------------------------------------------*/
+void sccSizeCounts(const CompactGraph& g, StoryHealth& h) {
+    const uint32_t kUnvisited = UINT32_MAX;
+    uint32_t n = (uint32_t)g.size(), counter = 0;
+    vector<uint32_t> order(n, kUnvisited), low(n), stack;
+    vector<bool> onStack(n, false), selfLoop(n, false);
+    vector<pair<uint32_t, uint32_t>> frames;
+    for (uint32_t root = 0; root < n; ++root) {
+        if (order[root] != kUnvisited) continue;
+        frames.push_back({root, 0});
+        order[root] = low[root] = counter++;
+        stack.push_back(root);
+        onStack[root] = true;
+        while (!frames.empty()) {
+            uint32_t v = frames.back().first, c = frames.back().second;
+            if (c < g.choiceCount(v)) {
+                ++frames.back().second;
+                uint32_t w = g.next(v, c);
+                if (w == CompactGraph::kNone) continue;
+                if (w == v) selfLoop[v] = true;
+                if (order[w] == kUnvisited) {
+                    order[w] = low[w] = counter++;
+                    stack.push_back(w);
+                    onStack[w] = true;
+                    frames.push_back({w, 0});
+                } else if (onStack[w]) low[v] = min(low[v], order[w]);
+                continue;
+            }
+            frames.pop_back();
+            if (!frames.empty()) low[frames.back().first] = min(low[frames.back().first], low[v]);
+            if (low[v] != order[v]) continue;
+            uint64_t size = 0;
+            uint32_t w;
+            do {
+                w = stack.back();
+                stack.pop_back();
+                onStack[w] = false;
+                ++size;
+            } while (w != v);
+            ++h.sccSizes[size];
+            h.cyclicNodes += size > 1 ? size : selfLoop[v];
+        }
+    }
+}
+
+/* ------------------------------------------------------------------
+   measureStoryHealth:
+   Computes a StoryHealth for a frozen story in three linear passes,
+   spread over 'threads':
+   1. per node (parallel chunks): branching counts, endings, dangling
+      edges, and in-degrees capped at 2 (all that 'reconverging' needs,
+      so a relaxed byte counter per node suffices);
+   2. breadth-first from node 0, one level at a time: threads split
+      the frontier and claim each newly seen node with a CAS on its
+      depth, so every node is expanded once;
+   3. Tarjan's SCC pass, which is sequential, runs on its own thread
+      alongside the other two.
+   Per-thread counts are summed once the threads are done.
+-------------------------------------------------------------------*/
+StoryHealth measureStoryHealth(const CompactGraph& g, int threads) {
+    const size_t kChunk = 4096;
+    const uint32_t kUnseen = UINT32_MAX;
+    threads = max(threads, 1);
+    uint32_t n = (uint32_t)g.size();
+    StoryHealth h, scc;
+    h.nodes = n;
+    thread sccThread([&] { sccSizeCounts(g, scc); });
+
+    // Runs body(from, to, t) over chunks of [0, count) on every thread;
+    // a single chunk runs inline (most BFS levels of a small story).
+    auto parallel = [&](size_t count, auto body) {
+        if (count <= kChunk) {
+            body(0, count, 0);
+            return;
+        }
+        atomic<size_t> next{0};
+        auto work = [&](int t) {
+            for (size_t from; (from = next.fetch_add(kChunk)) < count;) body(from, min(count, from + kChunk), t);
+        };
+        vector<thread> workers;
+        for (int t = 1; t < threads; ++t) workers.emplace_back(work, t);
+        work(0);
+        for (auto& w : workers) w.join();
+    };
+
+    unique_ptr<atomic<uint8_t>[]> inDegree(new atomic<uint8_t>[n]);
+    unique_ptr<atomic<uint32_t>[]> depthOf(new atomic<uint32_t>[n]);
+    for (uint32_t i = 0; i < n; ++i) {
+        inDegree[i].store(0, memory_order_relaxed);
+        depthOf[i].store(kUnseen, memory_order_relaxed);
+    }
+
+    struct Counts {
+        vector<uint64_t> branching, depth, endingDepth;
+        uint64_t edges = 0, dangling = 0, reconverging = 0;
+    };
+    vector<Counts> counts(threads);
+    parallel(n, [&](size_t from, size_t to, int t) {
+        Counts& c = counts[t];
+        for (uint32_t i = (uint32_t)from; i < to; ++i) {
+            uint32_t k = g.choiceCount(i);
+            if (c.branching.size() <= k) c.branching.resize(k + 1, 0);
+            ++c.branching[k];
+            c.edges += k;
+            for (uint32_t e = 0; e < k; ++e) {
+                uint32_t w = g.next(i, e);
+                if (w == CompactGraph::kNone) ++c.dangling;
+                else if (inDegree[w].load(memory_order_relaxed) < 2) inDegree[w].fetch_add(1, memory_order_relaxed);
+            }
+        }
+    });
+
+    vector<uint32_t> frontier;
+    vector<vector<uint32_t>> found(threads);
+    uint32_t start = g.indexOf(0);
+    if (start != CompactGraph::kNone) {
+        depthOf[start].store(0, memory_order_relaxed);
+        frontier.push_back(start);
+    }
+    for (uint32_t d = 0; !frontier.empty(); ++d) {
+        parallel(frontier.size(), [&](size_t from, size_t to, int t) {
+            Counts& c = counts[t];
+            if (c.depth.size() <= d) c.depth.resize(d + 1, 0), c.endingDepth.resize(d + 1, 0);
+            for (size_t f = from; f < to; ++f) {
+                uint32_t v = frontier[f], k = g.choiceCount(v);
+                ++c.depth[d];
+                c.endingDepth[d] += k == 0;
+                for (uint32_t e = 0; e < k; ++e) {
+                    uint32_t w = g.next(v, e), unseen = kUnseen;
+                    if (w != CompactGraph::kNone &&
+                        depthOf[w].compare_exchange_strong(unseen, d + 1, memory_order_relaxed))
+                        found[t].push_back(w);
+                }
+            }
+        });
+        frontier.clear();
+        for (auto& f : found) {
+            frontier.insert(frontier.end(), f.begin(), f.end());
+            f.clear();
+        }
+    }
+
+    parallel(n, [&](size_t from, size_t to, int t) {
+        for (size_t i = from; i < to; ++i) counts[t].reconverging += inDegree[i].load(memory_order_relaxed) > 1;
+    });
+
+    auto add = [](vector<uint64_t>& into, const vector<uint64_t>& from) {
+        if (into.size() < from.size()) into.resize(from.size(), 0);
+        for (size_t i = 0; i < from.size(); ++i) into[i] += from[i];
+    };
+    for (Counts& c : counts) {
+        add(h.branching, c.branching);
+        add(h.depth, c.depth);
+        add(h.endingDepth, c.endingDepth);
+        h.edges += c.edges;
+        h.danglingEdges += c.dangling;
+        h.reconverging += c.reconverging;
+    }
+    for (uint64_t v : h.depth) h.reachable += v;
+    h.endings = h.branching.empty() ? 0 : h.branching[0];
+
+    sccThread.join();
+    h.sccSizes = move(scc.sccSizes);
+    h.cyclicNodes = scc.cyclicNodes;
+    return h;
+}
+
+/* ======================
+   Load Generation
+   ====================== */
+
+/* ------------------------------------------------------------------
+   BotPolicy:
+   A simulated player. nextLine() writes the line the bot "types" at
+   the menu of 'node' into 'out' (without the newline). Policies may
+   return invalid lines; they go through readMenuChoice like real input.
+-------------------------------------------------------------------*/
+class BotPolicy {
+public:
+    virtual ~BotPolicy() {}
+    virtual void nextLine(const StoryNode& node, mt19937& rng, string& out) = 0;
+
+    // True if the line depends only on the node, so loop detection is sound.
+    virtual bool deterministic() const { return false; }
+
+protected:
+    static void writeChoice(int oneBased, string& out) {
+        char num[16];
+        auto res = to_chars(num, num + sizeof(num), oneBased);
+        out.assign(num, res.ptr);
+    }
+};
+
+// Picks any listed option with equal probability.
+class UniformPolicy : public BotPolicy {
+public:
+    void nextLine(const StoryNode& node, mt19937& rng, string& out) override {
+        writeChoice(1 + (int)(rng() % node.choices.size()), out);
+    }
+};
+
+// Picks options in proportion to how often real players took them
+// ('stats' as filled by loadRecordedChoices, not the bots' own).
+class RecordedPolicy : public BotPolicy {
+public:
+    explicit RecordedPolicy(const ChoiceStats& cs) : stats(cs) {}
+
+    void nextLine(const StoryNode& node, mt19937& rng, string& out) override {
+        double r = uniform_real_distribution<double>(0.0, 1.0)(rng);
+        size_t pick = 0;
+        for (; pick + 1 < node.choices.size(); ++pick) {
+            r -= stats.probability(node.id, (int)pick);
+            if (r < 0) break;
+        }
+        writeChoice((int)pick + 1, out);
+    }
+
+private:
+    const ChoiceStats& stats;
+};
+
+// Always takes the choice with the fewest steps left to any ending.
+class ShortestToEndingPolicy : public BotPolicy {
+public:
+    explicit ShortestToEndingPolicy(const StoryGraph& graph) {
+        // Reverse BFS from every ending over incoming edges.
+        map<int, vector<int>> incoming;
+        deque<int> queue;
+        for (auto& kv : graph.allNodes()) {
+            for (auto& c : kv.second.choices) incoming[c.nextId].push_back(kv.first);
+            if (kv.second.isEnding()) {
+                distance[kv.first] = 0;
+                queue.push_back(kv.first);
+            }
+        }
+        while (!queue.empty()) {
+            int id = queue.front();
+            queue.pop_front();
+            for (int from : incoming[id])
+                if (!distance.count(from)) {
+                    distance[from] = distance[id] + 1;
+                    queue.push_back(from);
+                }
+        }
+    }
+
+    void nextLine(const StoryNode& node, mt19937&, string& out) override {
+        size_t best = 0;
+        int bestDist = numeric_limits<int>::max();
+        for (size_t i = 0; i < node.choices.size(); ++i) {
+            auto it = distance.find(node.choices[i].nextId);
+            if (it != distance.end() && it->second < bestDist) {
+                bestDist = it->second;
+                best = i;
+            }
+        }
+        writeChoice((int)best + 1, out);
+    }
+    bool deterministic() const override { return true; }
+
+private:
+    map<int, int> distance;   // node id -> steps to the nearest ending
+};
+
+// Always types the same option number (or the last one, if fewer):
+// the replay-style bot that loops forever on a cyclic story.
+class FixedPolicy : public BotPolicy {
+public:
+    explicit FixedPolicy(int option) : option(max(1, option)) {}
+
+    void nextLine(const StoryNode& node, mt19937&, string& out) override {
+        writeChoice(min(option, (int)node.choices.size()), out);
+    }
+    bool deterministic() const override { return true; }
+
+private:
+    int option;
+};
+
+// Sends malformed or out-of-range input some of the time, otherwise
+// behaves like UniformPolicy. Exercises readMenuChoice's error paths.
+class AdversarialPolicy : public BotPolicy {
+public:
+    explicit AdversarialPolicy(double invalidRate) : rate(invalidRate) {}
+
+    void nextLine(const StoryNode& node, mt19937& rng, string& out) override {
+        static const char* const kBad[] = {"abc", "", "0", " 1", "1.5", "-1", "99999999999", "\x01"};
+        if (uniform_real_distribution<double>(0.0, 1.0)(rng) < rate) {
+            out = kBad[rng() % (sizeof(kBad) / sizeof(kBad[0]))];
+            return;
+        }
+        uniform.nextLine(node, rng, out);
+    }
+
+private:
+    double rate;
+    UniformPolicy uniform;
+};
+
+/* ------------------------------------------------------------------
+   ThinkTime:
+   How long a bot waits before answering a prompt.
+   - None: answer immediately (maximum load).
+   - Fixed: always meanMs.
+   - Exponential: random with mean meanMs (memoryless, like real readers).
+-------------------------------------------------------------------*/
+struct ThinkTime {
+    enum Kind { None, Fixed, Exponential } kind = None;
+    double meanMs = 0;
+
+    chrono::microseconds sample(mt19937& rng) const {
+        double ms = 0;
+        if (kind == Fixed) ms = meanMs;
+        if (kind == Exponential) ms = exponential_distribution<double>(1.0 / meanMs)(rng);
+        return chrono::microseconds((int64_t)(ms * 1000.0));
+    }
+};
+
+/* ------------------------------------------------------------------
+   BotInput:
+   An input stream buffer that answers every prompt with the bot's
+   next line, so bots drive the unmodified runSession/readMenuChoice.
+   - Before answering it sleeps for the think time.
+   - Response latency is measured from handing over a line to the next
+     prompt (or to finish() at an ending): the server-side time to
+     validate, transition and render, excluding think time.
+-------------------------------------------------------------------*/
+class BotInput : public streambuf {
+public:
+    BotInput(Session& s, BotPolicy& p, const ThinkTime& t, mt19937& r, LatencyHistogram& l)
+        : session(s), policy(p), think(t), rng(r), latency(l) {
+        line.reserve(32);
+    }
+
+    void finish() {
+        if (pending) latency.record(elapsedNs());
+        pending = false;
+    }
+
+protected:
+    int_type underflow() override {
+        finish();
+        auto wait = think.sample(rng);
+        if (wait.count() > 0) this_thread::sleep_for(wait);
+
+        const StoryNode* node = session.graph->get(session.currentId);
+        if (!node || node->isEnding()) return traits_type::eof();
+        policy.nextLine(*node, rng, line);
+        line += '\n';
+        setg(&line[0], &line[0], &line[0] + line.size());
+        sentAt = chrono::steady_clock::now();
+        pending = true;
+        return traits_type::to_int_type(line[0]);
+    }
+
+private:
+    uint64_t elapsedNs() const {
+        return (uint64_t)chrono::duration_cast<chrono::nanoseconds>(
+            chrono::steady_clock::now() - sentAt).count();
+    }
+
+    Session& session;
+    BotPolicy& policy;
+    const ThinkTime& think;
+    mt19937& rng;
+    LatencyHistogram& latency;
+    string line;
+    chrono::steady_clock::time_point sentAt;
+    bool pending = false;
+};
+
+/* ------------------------------------------------------------------
+   LoadConfig / runLoad:
+   Closed-loop load generator: 'sessions' worker threads each play one
+   session at a time against the shared graph, starting a new one as
+   soon as the last ends, until 'seconds' have passed. Prints
+   throughput and response-latency percentiles, and compares p99 with
+   the SLO. Returns 0 if the SLO was met, 1 otherwise.
+-------------------------------------------------------------------*/
+struct LoadConfig {
+    int sessions = 4;           // concurrent simulated players
+    double seconds = 2.0;       // test duration
+    string policy = "uniform";  // uniform | recorded | shortest | adversarial | fixed:K
+    ThinkTime think;
+    double sloP99Us = 1000.0;   // p99 response-latency target
+    double invalidRate = 0.3;   // adversarial policy only
+    size_t maxSteps = 10000;    // per-session step budget (0 = unlimited)
+    bool detectLoops = true;    // Brent's check, for deterministic policies
+    int popularityMs = 0;       // show "x% chose this", refreshed this often (0 = off)
+    string eventLog;            // write an EventLog of every visit here (empty = off)
+    string recorded;            // EventLog of real players, for policy=recorded
+};
+
+// Adds the choices in every playthrough of an EventLog file to 'stats',
+// walking each from node 0 of 'graph' until a choice no longer fits.
+bool loadRecordedChoices(const StoryGraph& graph, const string& path, ChoiceStats& stats) {
+    PlaythroughCorpus corpus;
+    if (!corpus.loadEventLog(path)) return false;
+    for (size_t i = 0; i < corpus.size(); ++i) {
+        const StoryNode* node = graph.get(0);
+        for (const uint8_t* c = corpus.begin(i); c != corpus.end(i) && node && *c < node->choices.size(); ++c) {
+            stats.record(node->id, *c);
+            node = graph.get(node->choices[*c].nextId);
+        }
+    }
+    return true;
+}
+
+unique_ptr<BotPolicy> makePolicy(const LoadConfig& cfg, const StoryGraph& graph,
+                                 const ChoiceStats& recorded) {
+    if (cfg.policy == "recorded") return unique_ptr<BotPolicy>(new RecordedPolicy(recorded));
+    if (cfg.policy == "shortest") return unique_ptr<BotPolicy>(new ShortestToEndingPolicy(graph));
+    if (cfg.policy == "adversarial") return unique_ptr<BotPolicy>(new AdversarialPolicy(cfg.invalidRate));
+    if (cfg.policy == "uniform") return unique_ptr<BotPolicy>(new UniformPolicy());
+    if (cfg.policy.compare(0, 6, "fixed:") == 0)
+        return unique_ptr<BotPolicy>(new FixedPolicy(atoi(cfg.policy.c_str() + 6)));
+    return nullptr;
+}
+
+int runLoad(const StoryGraph& graph, const LoadConfig& cfg) {
+    ChoiceStats stats(graph), recorded(graph);
+    if (cfg.policy == "recorded" && !loadRecordedChoices(graph, cfg.recorded, recorded)) {
+        cerr << "policy=recorded: cannot read an event log from recorded=" << cfg.recorded << "\n";
+        return 2;
+    }
+    unique_ptr<ChoicePopularity> popularity;
+    if (cfg.popularityMs > 0) {
+        popularity.reset(new ChoicePopularity(stats));
+        popularity->start(chrono::milliseconds(cfg.popularityMs));
+    }
+    EventLog events;
+    if (!cfg.eventLog.empty() && !events.open(cfg.eventLog)) {
+        cerr << "event log: cannot write " << cfg.eventLog << "\n";
+        return 2;
+    }
+    vector<unique_ptr<LatencyHistogram>> latencies;
+    vector<uint64_t> sessionsDone(cfg.sessions, 0), transitions(cfg.sessions, 0);
+    vector<uint64_t> overBudget(cfg.sessions, 0), looped(cfg.sessions, 0);
+    vector<unique_ptr<BotPolicy>> policies;
+    for (int i = 0; i < cfg.sessions; ++i) {
+        latencies.emplace_back(new LatencyHistogram());
+        policies.push_back(makePolicy(cfg, graph, recorded));
+        if (!policies.back()) {
+            cerr << "unknown policy: " << cfg.policy << "\n";
+            return 2;
+        }
+    }
+
+    atomic<bool> stop{false};
+    auto start = chrono::steady_clock::now();
+    vector<thread> workers;
+    for (int w = 0; w < cfg.sessions; ++w) {
+        workers.emplace_back([&, w] {
+            mt19937 rng(1000 + w);
+            Session session(graph);
+            session.choiceStats = &stats;
+            session.popularity = popularity.get();
+            session.events = cfg.eventLog.empty() ? nullptr : &events;
+            session.stepBudget = cfg.maxSteps;
+            session.detectLoops = cfg.detectLoops && policies[w]->deterministic();
+            BotInput bot(session, *policies[w], cfg.think, rng, *latencies[w]);
+            istream in(&bot);
+            ostream sink(nullptr);
+            while (!stop.load(memory_order_relaxed)) {
+                session.reset();
+                session.sessionId = (uint64_t)w << 32 | sessionsDone[w];
+                in.clear();
+                int result = runSession(session, in, sink, false);
+                bot.finish();
+                if (result == kSessionOverBudget) ++overBudget[w];
+                if (result == kSessionLooped) ++looped[w];
+                ++sessionsDone[w];
+                // A stopped session's last transition has no history entry.
+                transitions[w] += session.history.size() - (result == kSessionEnded ? 1 : 0);
+            }
+        });
+    }
+    this_thread::sleep_for(chrono::duration<double>(cfg.seconds));
+    stop = true;
+    for (auto& t : workers) t.join();
+    double elapsed = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+    LatencyHistogram all;
+    uint64_t totalSessions = 0, totalTransitions = 0, totalOverBudget = 0, totalLooped = 0;
+    for (int w = 0; w < cfg.sessions; ++w) {
+        all.merge(*latencies[w]);
+        totalOverBudget += overBudget[w];
+        totalLooped += looped[w];
+        totalSessions += sessionsDone[w];
+        totalTransitions += transitions[w];
+    }
+    double p99Us = all.percentile(0.99) / 1000.0;
+    bool sloMet = p99Us <= cfg.sloP99Us;
+
+    cout << "policy=" << cfg.policy << " sessions=" << cfg.sessions
+         << " elapsed_s=" << elapsed << " completed_sessions=" << totalSessions
+         << " transitions=" << totalTransitions
+         << " transitions_per_s=" << (uint64_t)(totalTransitions / elapsed)
+         << " sessions_per_s=" << (uint64_t)(totalSessions / elapsed) << "\n";
+    cout << "stopped_step_budget=" << totalOverBudget << " stopped_loop=" << totalLooped << "\n";
+    if (popularity) cout << "popularity_snapshots=" << popularity->published() << "\n";
+    if (!cfg.eventLog.empty()) {
+        events.close();
+        cout << "event_log_rows=" << events.rowsWritten() << " event_log_bytes=" << events.bytesWritten() << "\n";
+    }
+    cout << "response_latency";
+    all.summarize(cout);
+    cout << "\nslo_p99_us=" << cfg.sloP99Us << " observed_p99_us=" << p99Us
+         << " slo=" << (sloMet ? "PASS" : "FAIL") << "\n";
+    return sloMet ? 0 : 1;
+}
+
+/* ------------------------------------------------------------------
+   parseLoadConfig:
+   Reads key=value arguments for --loadgen, e.g.
+     sessions=64 seconds=5 policy=recorded recorded=play.log think=exp:200
+   think is none, fixed:<ms> (>= 0) or exp:<mean ms> (> 0); max_steps
+   and detect_loops=0|1 bound runaway sessions. invalid_rate is capped
+   at 0.95 so adversarial bots still make progress. event_log=<path>
+   records every visit to an EventLog file; recorded=<path> is such a
+   file from real players, whose choices policy=recorded follows.
+   Returns false on a bad key or value.
+-------------------------------------------------------------------*/
+bool parseLoadConfig(int argc, char** argv, int first, LoadConfig& cfg) {
+    for (int i = first; i < argc; ++i) {
+        string arg = argv[i];
+        size_t eq = arg.find('=');
+        if (eq == string::npos) return false;
+        string key = arg.substr(0, eq), val = arg.substr(eq + 1);
+        if (key == "sessions") cfg.sessions = max(1, atoi(val.c_str()));
+        else if (key == "seconds") cfg.seconds = atof(val.c_str());
+        else if (key == "policy") cfg.policy = val;
+        else if (key == "slo_p99_us") cfg.sloP99Us = atof(val.c_str());
+        else if (key == "invalid_rate") cfg.invalidRate = min(0.95, atof(val.c_str()));
+        else if (key == "max_steps") cfg.maxSteps = (size_t)atol(val.c_str());
+        else if (key == "detect_loops") cfg.detectLoops = val != "0";
+        else if (key == "popularity_ms") cfg.popularityMs = max(0, atoi(val.c_str()));
+        else if (key == "event_log") cfg.eventLog = val;
+        else if (key == "recorded") cfg.recorded = val;
+        else if (key == "think") {
+            if (val == "none") cfg.think.kind = ThinkTime::None;
+            else if (val.compare(0, 6, "fixed:") == 0) {
+                cfg.think.kind = ThinkTime::Fixed;
+                cfg.think.meanMs = atof(val.c_str() + 6);
+                if (!(cfg.think.meanMs >= 0)) return false;
+            } else if (val.compare(0, 4, "exp:") == 0) {
+                cfg.think.kind = ThinkTime::Exponential;
+                cfg.think.meanMs = atof(val.c_str() + 4);
+                if (!(cfg.think.meanMs > 0)) return false;   // the rate would be 1/0
+            } else return false;
+        } else return false;
+    }
+    return true;
+}
+
+/* ======================
+   Wire Compression
+   ====================== */
+
+/* ------------------------------------------------------------------
+   trainDictionary:
+   Builds a preset dictionary for deflate from sample texts, in the
+   spirit of zstd's COVER trainer: every 8-byte shingle is scored by
+   how many samples contain it, and the 64-byte segments covering the
+   most valuable shingles are picked greedily (a shingle only counts
+   once it is picked). Shingles seen in a single sample are ignored;
+   repeats of a whole scene are the scene cache's job.
+   Best segments go last: deflate reaches closer bytes more cheaply.
+   storyDictionary() trains on what the router actually sends: every
+   frame plus the fixed messages. Both ends derive it from the same
+   story build, so it never crosses the wire.
+-------------------------------------------------------------------*/
+string trainDictionary(const vector<string_view>& samples, size_t maxBytes) {
+    const size_t kShingle = 8, kSegment = 64, kMaxInput = 1 << 20;
+    auto shingleAt = [](const char* p) {
+        uint64_t h;
+        memcpy(&h, p, sizeof(h));
+        return h;
+    };
+    unordered_map<uint64_t, uint32_t> value;   // shingle -> samples containing it
+    vector<string_view> used;
+    size_t total = 0;
+    for (string_view sample : samples) {
+        if (sample.size() < kSegment || total + sample.size() > kMaxInput) continue;
+        total += sample.size();
+        used.push_back(sample);
+        unordered_set<uint64_t> seen;
+        for (size_t i = 0; i + kShingle <= sample.size(); ++i)
+            if (seen.insert(shingleAt(sample.data() + i)).second) ++value[shingleAt(sample.data() + i)];
+    }
+    for (auto& kv : value)
+        if (kv.second < 2) kv.second = 0;
+
+    vector<string_view> picked;
+    size_t bytes = 0;
+    while (bytes + kSegment <= maxBytes) {
+        uint64_t bestScore = 0;
+        string_view best;
+        for (string_view sample : used) {
+            // Sliding window over the shingles starting inside each segment.
+            uint64_t score = 0;
+            size_t starts = sample.size() - kShingle + 1, window = kSegment - kShingle + 1;
+            for (size_t i = 0; i < starts; ++i) {
+                score += value[shingleAt(sample.data() + i)];
+                if (i >= window) score -= value[shingleAt(sample.data() + i - window)];
+                if (i + 1 >= window && score > bestScore) {
+                    bestScore = score;
+                    best = sample.substr(i + 1 - window, kSegment);
+                }
+            }
+        }
+        if (bestScore == 0) break;
+        for (size_t i = 0; i + kShingle <= best.size(); ++i) value[shingleAt(best.data() + i)] = 0;
+        picked.push_back(best);
+        bytes += best.size();
+    }
+    string dict;
+    for (auto it = picked.rbegin(); it != picked.rend(); ++it) dict.append(it->data(), it->size());
+    return dict;
+}
+
+const size_t kStoryDictionaryBytes = 4096;
+
+string storyDictionary(const StoryGraph& graph, size_t maxBytes = kStoryDictionaryBytes) {
+    vector<string_view> samples;
+    for (auto& kv : graph.allNodes()) samples.push_back(kv.second.frame);
+    samples.push_back("\n\nFarewell, Elyndri explorer.\nPlease enter a number.\n"
+                      "Please choose a valid option.\nEnter choice (1-");
+    return trainDictionary(samples, maxBytes);
+}
+
+/* ------------------------------------------------------------------
+   WireCompressor / WireDecompressor:
+   One raw deflate stream per connection (no zlib header), primed with
+   the story dictionary. compress() ends each batch with a sync flush
+   so the peer can decode everything sent so far, or finishes the
+   stream; after the end the peer reads plain bytes again.
+   Without NEBULA_ZLIB there is no compression and these do nothing;
+   the router then ignores compression requests.
+-------------------------------------------------------------------*/
+#if NEBULA_ZLIB
+class WireCompressor {
+public:
+    explicit WireCompressor(const string& dictionary) {
+        memset(&z, 0, sizeof(z));
+        deflateInit2(&z, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY);
+        if (!dictionary.empty())
+            deflateSetDictionary(&z, reinterpret_cast<const Bytef*>(dictionary.data()), (uInt)dictionary.size());
+    }
+    ~WireCompressor() { deflateEnd(&z); }
+    WireCompressor(const WireCompressor&) = delete;
+    WireCompressor& operator=(const WireCompressor&) = delete;
+
+    // Appends the compressed form of 'in' to 'out'.
+    void compress(string_view in, string& out, bool finish) {
+        z.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(in.data()));
+        z.avail_in = (uInt)in.size();
+        int flush = finish ? Z_FINISH : Z_SYNC_FLUSH;
+        do {
+            size_t at = out.size();
+            out.resize(at + deflateBound(&z, z.avail_in) + 16);
+            z.next_out = reinterpret_cast<Bytef*>(&out[at]);
+            z.avail_out = (uInt)(out.size() - at);
+            deflate(&z, flush);
+            out.resize(out.size() - z.avail_out);
+        } while (z.avail_out == 0);
+    }
+
+private:
+    z_stream z;
+};
+
+class WireDecompressor {
+public:
+    explicit WireDecompressor(const string& dictionary) {
+        memset(&z, 0, sizeof(z));
+        inflateInit2(&z, -15);
+        if (!dictionary.empty())
+            inflateSetDictionary(&z, reinterpret_cast<const Bytef*>(dictionary.data()), (uInt)dictionary.size());
+    }
+    ~WireDecompressor() { inflateEnd(&z); }
+    WireDecompressor(const WireDecompressor&) = delete;
+    WireDecompressor& operator=(const WireDecompressor&) = delete;
+
+    // Inflates what it can of 'in' onto 'out', removing it from 'in'.
+    // True once the stream has ended; what is left in 'in' is plain.
+    bool decompress(string& in, string& out) {
+        z.next_in = reinterpret_cast<Bytef*>(&in[0]);
+        z.avail_in = (uInt)in.size();
+        int rc;
+        do {
+            char chunk[16384];
+            z.next_out = reinterpret_cast<Bytef*>(chunk);
+            z.avail_out = sizeof(chunk);
+            rc = inflate(&z, Z_SYNC_FLUSH);
+            out.append(chunk, sizeof(chunk) - z.avail_out);
+        } while (rc == Z_OK && z.avail_out == 0);
+        in.erase(0, in.size() - z.avail_in);
+        return rc == Z_STREAM_END;
+    }
+
+private:
+    z_stream z;
+};
+#else
+class WireCompressor {
+public:
+    explicit WireCompressor(const string&) {}
+    void compress(string_view in, string& out, bool) { out.append(in.data(), in.size()); }
+};
+#endif
+
+/* ======================
+   Session Cluster
+   ====================== */
+
+/* ------------------------------------------------------------------
+   ConsistentHashRing:
+   Maps session ids to workers so that adding or removing a worker
+   only moves the sessions on the arcs it gains or loses (about 1/N of
+   them) instead of reshuffling everything.
+   Each worker owns kVirtualNodes points on the ring to even out load.
+-------------------------------------------------------------------*/
+class ConsistentHashRing {
+public:
+    static const int kVirtualNodes = 64;
+
+    void add(int worker) {
+        for (uint64_t v = 0; v < kVirtualNodes; ++v)
+            ring[mix64((uint64_t)worker << 32 | v)] = worker;
+    }
+
+    void remove(int worker) {
+        for (auto it = ring.begin(); it != ring.end();)
+            it = it->second == worker ? ring.erase(it) : next(it);
+    }
+
+    // Worker owning 'key', or -1 if the ring is empty.
+    int owner(uint64_t key) const {
+        if (ring.empty()) return -1;
+        auto it = ring.lower_bound(mix64(key));
+        return it == ring.end() ? ring.begin()->second : it->second;
+    }
+
+private:
+    map<uint64_t, int> ring;   // point on the ring -> worker id
+};
+
+/* ------------------------------------------------------------------
+   Cluster messages:
+   Router <-> worker frames over a socketpair:
+     u32 length (of everything after it), u8 type, u64 session id, payload
+   Requests: Open, Input (payload = the line), Export, Import (payload =
+   Session::serialize() state), Close, Quit, Promote (see ClusterWorker),
+   AttachStandby (carries the replication socket as SCM_RIGHTS).
+   Replies: Output (u8 finished flag, u32 history length, text), State
+   (serialized state; empty if the worker no longer has that session),
+   Promoted (u32 sessions, u32 lost choices).
+   Replication records, primary -> standby: see Replicator.
+   Upgrade handover, new router <-> old router: see SessionRouter.
+-------------------------------------------------------------------*/
+enum class ClusterMsg : uint8_t {
+    Open = 1, Input, Export, Import, Close, Quit, Promote, AttachStandby,
+    Output = 10, State, Promoted,
+    ReplState = 20, ReplStep, ReplDrop,
+    Handover = 30, HandoverListen, HandoverClient, HandoverDone
+};
+
+void appendMsg(string& out, ClusterMsg type, uint64_t sid, string_view payload) {
+    putU32(out, (uint32_t)(9 + payload.size()));
+    out += (char)type;
+    putU64(out, sid);
+    out.append(payload.data(), payload.size());
+}
+
+// Removes one complete message from the front of 'buf'; false if none yet.
+bool takeMsg(string& buf, ClusterMsg& type, uint64_t& sid, string& payload) {
+    size_t pos = 0;
+    uint32_t len;
+    if (!getU32(buf, pos, len) || buf.size() < 4 + (size_t)len) return false;
+    if (len < 9) {            // malformed: drop the frame
+        buf.erase(0, 4 + len);
+        return false;
+    }
+    type = (ClusterMsg)buf[4];
+    pos = 5;
+    getU64(buf, pos, sid);
+    payload.assign(buf, 13, len - 9);
+    buf.erase(0, 4 + len);
+    return true;
+}
+
+// Reads the message at 'pos' in place and moves 'pos' past it; false if
+// it is not complete yet. A malformed frame reads as type 0.
+bool peekMsg(string_view buf, size_t& pos, ClusterMsg& type, uint64_t& sid, string_view& payload) {
+    size_t at = pos;
+    uint32_t len;
+    if (!getU32(buf, at, len) || buf.size() - at < len) return false;
+    pos = at + len;
+    type = (ClusterMsg)0;
+    if (len < 9) return true;
+    type = (ClusterMsg)buf[at++];
+    getU64(buf, at, sid);
+    payload = buf.substr(at, len - 9);
+    return true;
+}
+
+// True if 'buf' starts with a complete message.
+bool hasMsg(string_view buf) {
+    size_t pos = 0;
+    uint32_t len;
+    return getU32(buf, pos, len) && buf.size() >= 4 + (size_t)len;
+}
+
+// Blocking helpers for the worker side and for demo clients.
+// File descriptors passed along with the bytes (SCM_RIGHTS) are added
+// to 'fds', or closed if the caller did not ask for them.
+bool recvSome(int fd, string& buf, vector<int>* fds = nullptr) {
+    char chunk[4096];
+    char ctrl[CMSG_SPACE(16 * sizeof(int))];
+    iovec iov = {chunk, sizeof(chunk)};
+    msghdr msg{};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = ctrl;
+    msg.msg_controllen = sizeof(ctrl);
+    ssize_t n;
+    do n = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC); while (n < 0 && errno == EINTR);
+    for (cmsghdr* c = CMSG_FIRSTHDR(&msg); c; c = CMSG_NXTHDR(&msg, c)) {
+        if (c->cmsg_level != SOL_SOCKET || c->cmsg_type != SCM_RIGHTS) continue;
+        size_t count = (c->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        for (size_t i = 0; i < count; ++i) {
+            int passed;
+            memcpy(&passed, CMSG_DATA(c) + i * sizeof(int), sizeof(int));
+            if (fds) fds->push_back(passed);
+            else close(passed);
+        }
+    }
+    if (n <= 0) return false;
+    buf.append(chunk, (size_t)n);
+    return true;
+}
+
+bool sendAll(int fd, string_view data) {
+    while (!data.empty()) {
+        ssize_t n = send(fd, data.data(), data.size(), MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        data.remove_prefix((size_t)n);
+    }
+    return true;
+}
+
+// Sends 'data' with 'passFd' attached to its first byte (SCM_RIGHTS);
+// the receiver gets its own descriptor for the same open socket/file.
+bool sendWithFd(int fd, string_view data, int passFd) {
+    char ctrl[CMSG_SPACE(sizeof(int))];
+    memset(ctrl, 0, sizeof(ctrl));
+    iovec iov = {const_cast<char*>(data.data()), data.size()};
+    msghdr msg{};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = ctrl;
+    msg.msg_controllen = sizeof(ctrl);
+    cmsghdr* c = CMSG_FIRSTHDR(&msg);
+    c->cmsg_level = SOL_SOCKET;
+    c->cmsg_type = SCM_RIGHTS;
+    c->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(c), &passFd, sizeof(int));
+    ssize_t n;
+    do n = sendmsg(fd, &msg, MSG_NOSIGNAL); while (n < 0 && errno == EINTR);
+    return n > 0 && sendAll(fd, data.substr((size_t)n));
+}
+
+typedef unordered_map<uint64_t, unique_ptr<Session>> SessionTable;
+
+/* ------------------------------------------------------------------
+   Replicator:
+   Primary side of hot-standby replication. Every change to a session
+   becomes one small record on the socket to the worker's standby:
+     ReplState (Session::serialize() state, after Open or Import),
+     ReplStep (u32 node entered: one per choice), ReplDrop (session gone).
+   Records are batched and written without waiting for the standby,
+   which never replies. A batch goes out once more than maxLost records
+   are pending, and whenever the worker runs out of requests (after its
+   replies have left), so a crash loses at most maxLost choices players
+   have already seen, and only those answered since the worker was last
+   idle. maxLost = 0 is synchronous: each record is written before the
+   reply that shows it.
+   Data already written survives the primary: the standby still reads
+   it after the primary's end of the socket is gone.
+-------------------------------------------------------------------*/
+class Replicator {
+public:
+    explicit Replicator(size_t maxLost) : maxLost(maxLost) {}
+
+    ~Replicator() { detach(); }
+
+    // Starts replicating to 'standbyFd' with a full snapshot.
+    void attach(int standbyFd, const SessionTable& sessions) {
+        detach();
+        fd = standbyFd;
+        for (auto& kv : sessions) state(kv.first, *kv.second);
+        flush();
+    }
+
+    void state(uint64_t sid, const Session& s) {
+        record.clear();
+        s.serialize(record);
+        add(ClusterMsg::ReplState, sid);
+    }
+
+    void step(uint64_t sid, int nodeId) {
+        record.clear();
+        putU32(record, (uint32_t)nodeId);
+        add(ClusterMsg::ReplStep, sid);
+    }
+
+    void drop(uint64_t sid) {
+        record.clear();
+        add(ClusterMsg::ReplDrop, sid);
+    }
+
+    void flush() {
+        if (fd >= 0 && !batch.empty() && !sendAll(fd, batch)) detach();   // standby died
+        batch.clear();
+        pending = 0;
+    }
+
+private:
+    void add(ClusterMsg type, uint64_t sid) {
+        if (fd < 0) return;
+        appendMsg(batch, type, sid, record);
+        if (++pending > maxLost) flush();
+    }
+
+    void detach() {
+        if (fd >= 0) close(fd);
+        fd = -1;
+        batch.clear();
+        pending = 0;
+    }
+
+    size_t maxLost;
+    int fd = -1;
+    string batch, record;
+    size_t pending = 0;
+};
+
+/* ------------------------------------------------------------------
+   ClusterWorker:
+   Body of a worker process. The graph is the copy inherited at fork(),
+   shared read-only (copy-on-write) with the router and other workers.
+   - serve(): the primary. Serves requests from the router in order
+     until Quit or the router goes away, and feeds every session change
+     to its standby through a Replicator. Everything already received
+     is handled before replying: runs of Input go through one
+     InputBatch, and all replies leave in a single write.
+   - standBy(): the hot standby. Applies replication records until the
+     router sends Promote (its primary died), then reads the rest of
+     the stream and becomes the primary in its place. Promote lists
+     each session the router still routes to this worker as u64 id,
+     u32 history length the player last saw, u8 1 if a reply was
+     still outstanding. Those players whose view no longer matches the
+     replica get their current scene again; the router is told how
+     many choices were lost in total.
+-------------------------------------------------------------------*/
+class ClusterWorker {
+public:
+    ClusterWorker(int routerFd, const StoryGraph& g, size_t maxLost)
+        : fd(routerFd), graph(g), repl(maxLost) {}
+
+    ~ClusterWorker() {
+        for (int f : passedFds) close(f);
+    }
+
+    void serve() {
+        while (true) {
+            while (!hasMsg(in)) {
+                repl.flush();                     // idle: ship the batch now
+                if (!recvSome(fd, in, &passedFds)) return;
+            }
+            out.clear();
+            bool quit = !handleQueued();
+            if (quit || (!out.empty() && !sendAll(fd, out))) return;
+        }
+    }
+
+    void standBy(int replFd) {
+        string replIn;
+        ClusterMsg type;
+        uint64_t sid;
+        bool promoted = false;
+        while (!promoted) {
+            pollfd fds[2] = {{fd, POLLIN, 0}, {replFd, POLLIN, 0}};
+            if (poll(fds, replFd >= 0 ? 2 : 1, -1) < 0) {
+                if (errno == EINTR) continue;
+                return;
+            }
+            if (replFd >= 0 && fds[1].revents) {
+                if (!recvSome(replFd, replIn)) {
+                    close(replFd);                // primary gone; wait for Promote
+                    replFd = -1;
+                }
+                applyRecords(replIn);
+            }
+            if (fds[0].revents) {
+                if (!recvSome(fd, in, &passedFds)) return;
+                while (!promoted && takeMsg(in, type, sid, payload)) {
+                    if (type == ClusterMsg::Quit) return;
+                    promoted = type == ClusterMsg::Promote;
+                }
+            }
+        }
+        // Everything the primary wrote before it died is still readable.
+        while (replFd >= 0 && recvSome(replFd, replIn)) applyRecords(replIn);
+        if (replFd >= 0) close(replFd);
+        applyRecords(replIn);
+        promote();
+        serve();
+    }
+
+private:
+    // Handles every complete message in 'in'; false on Quit. Inputs are
+    // collected until some other message (or the end) and run together;
+    // their lines stay in 'in' until then.
+    bool handleQueued() {
+        size_t done = 0;
+        ClusterMsg type;
+        uint64_t sid;
+        string_view body;
+        bool quit = false;
+        batch.clear();
+        batchSids.clear();
+        while (!quit && peekMsg(in, done, type, sid, body)) {
+            if (type == (ClusterMsg)0) continue;  // malformed: drop the frame
+            if (type == ClusterMsg::Input) {
+                auto it = sessions.find(sid);
+                if (it == sessions.end()) continue;
+                batch.add(*it->second, body);
+                batchSids.push_back(sid);
+                continue;
+            }
+            runBatch();
+            if (type == ClusterMsg::Quit) quit = true;
+            else handle(type, sid, body);
+        }
+        runBatch();
+        in.erase(0, done);
+        return !quit;
+    }
+
+    void runBatch() {
+        if (!batch.size()) return;
+        batch.run();
+        for (size_t i = 0; i < batch.size(); ++i) {
+            const InputBatch::Result& r = batch.result(i);
+            uint64_t sid = batchSids[i];
+            if (!sessions.count(sid)) continue;   // ended earlier in this batch
+            if (r.rewound) repl.state(sid, *sessions[sid]);
+            else if (r.moved) repl.step(sid, r.nodeId);
+            reply(sid, r.steps, r.finished, batch.output(i));
+        }
+        batch.clear();
+        batchSids.clear();
+    }
+
+    // The router turns scene markers into text or binary frames per client.
+    Session* newSession() {
+        Session* s = new Session(graph);
+        s->markScenes = true;
+        return s;
+    }
+
+    void handle(ClusterMsg type, uint64_t sid, string_view body) {
+        auto it = sessions.find(sid);
+        Session* s = it == sessions.end() ? nullptr : it->second.get();
+        bool finished = false;
+        text.clear();
+        switch (type) {
+            case ClusterMsg::Open:
+                s = newSession();
+                sessions[sid].reset(s);
+                finished = sessionOpen(*s, text);
+                repl.state(sid, *s);
+                break;
+            case ClusterMsg::Export:
+                if (s) s->serialize(text);
+                appendMsg(out, ClusterMsg::State, sid, text);
+                sessions.erase(sid);
+                repl.drop(sid);
+                return;
+            case ClusterMsg::Import:
+                s = newSession();
+                sessions[sid].reset(s);
+                if (s->restore(body)) repl.state(sid, *s);
+                else sessions.erase(sid);
+                return;
+            case ClusterMsg::Close:
+                sessions.erase(sid);
+                repl.drop(sid);
+                return;
+            case ClusterMsg::AttachStandby:
+                if (passedFds.empty()) return;
+                repl.attach(passedFds.front(), sessions);
+                passedFds.erase(passedFds.begin());
+                return;
+            default:
+                return;
+        }
+        reply(sid, (uint32_t)s->history.size(), finished, text);
+    }
+
+    void reply(uint64_t sid, uint32_t steps, bool finished, string_view rendered) {
+        string& msg = scratch;
+        msg.assign(1, finished ? '\1' : '\0');
+        putU32(msg, steps);
+        msg += rendered;
+        appendMsg(out, ClusterMsg::Output, sid, msg);
+        if (finished) {
+            sessions.erase(sid);
+            repl.drop(sid);
+        }
+    }
+
+    void applyRecords(string& buf) {
+        ClusterMsg type;
+        uint64_t sid;
+        while (takeMsg(buf, type, sid, record)) {
+            if (type == ClusterMsg::ReplState) {
+                Session* s = newSession();
+                sessions[sid].reset(s);
+                if (!s->restore(record)) sessions.erase(sid);
+            } else if (type == ClusterMsg::ReplStep) {
+                auto it = sessions.find(sid);
+                size_t pos = 0;
+                uint32_t id;
+                if (it != sessions.end() && getU32(record, pos, id)) {
+                    it->second->currentId = (int)id;
+                    it->second->history.push_back((int)id);
+                }
+            } else if (type == ClusterMsg::ReplDrop) {
+                sessions.erase(sid);
+            }
+        }
+    }
+
+    void promote() {
+        SessionTable kept;
+        uint64_t lost = 0;
+        size_t pos = 0;
+        uint64_t sid;
+        uint32_t seen;
+        out.clear();
+        while (getU64(payload, pos, sid) && getU32(payload, pos, seen) && pos < payload.size()) {
+            bool awaited = payload[pos++] != 0;
+            auto it = sessions.find(sid);
+            unique_ptr<Session> s;
+            if (it != sessions.end()) s = move(it->second);
+            text.clear();
+            bool finished;
+            if (!s) {
+                // Never replicated: the player starts over.
+                s.reset(newSession());
+                lost += seen > 1 ? seen - 1 : 0;
+                text += "\n(Connection restored: your progress was lost.)\n";
+                finished = sessionOpen(*s, text);
+            } else if (awaited || s->history.size() != seen) {
+                uint32_t have = (uint32_t)s->history.size();
+                if (have < seen) {
+                    lost += seen - have;
+                    text += "\n(Connection restored: your last " + to_string(seen - have) +
+                            " choice(s) were lost.)\n";
+                } else {
+                    text += "\n(Connection restored.)\n";
+                }
+                finished = sessionResume(*s, text);
+            } else {
+                kept[sid] = move(s);
+                continue;
+            }
+            reply(sid, (uint32_t)s->history.size(), finished, text);
+            if (!finished) kept[sid] = move(s);
+        }
+        sessions.swap(kept);
+        string counts;
+        putU32(counts, (uint32_t)sessions.size());
+        putU32(counts, (uint32_t)lost);
+        appendMsg(out, ClusterMsg::Promoted, 0, counts);
+        sendAll(fd, out);
+    }
+
+    int fd;
+    const StoryGraph& graph;
+    Replicator repl;
+    SessionTable sessions;
+    vector<int> passedFds;     // received with AttachStandby
+    InputBatch batch;          // Input messages waiting in 'in'
+    vector<uint64_t> batchSids;
+    string in, out, payload, text, record, scratch;
+};
+
+/* ------------------------------------------------------------------
+   Cluster signals:
+   SIGUSR1 adds a worker, SIGUSR2 removes one, SIGINT/SIGTERM stop the
+   router. Handlers only set flags; the router's poll loop acts on them.
+-------------------------------------------------------------------*/
+volatile sig_atomic_t gClusterAddWorker = 0, gClusterRemoveWorker = 0, gClusterStop = 0;
+
+void onClusterSignal(int sig) {
+    if (sig == SIGUSR1) gClusterAddWorker = 1;
+    else if (sig == SIGUSR2) gClusterRemoveWorker = 1;
+    else gClusterStop = 1;
+}
+
+void installClusterSignals() {
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = onClusterSignal;      // no SA_RESTART: poll() returns EINTR
+    sigemptyset(&sa.sa_mask);
+    for (int sig : {SIGUSR1, SIGUSR2, SIGINT, SIGTERM}) sigaction(sig, &sa, nullptr);
+}
+
+/* ------------------------------------------------------------------
+   Binary client protocol:
+   For programs rather than people, on its own port (listenBinaryOn).
+   Client -> server:
+     'H' u32 count, count x u64 frameHash   scenes already cached (optional,
+                                            sent first, e.g. from a past visit;
+                                            hashes past 4 per story scene in
+                                            all are ignored)
+     'C' u8 choice                          a pick, 2 bytes instead of a line
+     'Z'                                    compress what you send me
+   Server -> client:
+     'F' u64 frameHash, u32 size, bytes     a scene the client has not got yet
+     'S' u64 frameHash                      a scene it has: show it from cache
+     'T' u32 size, bytes                    other text (errors, Path Taken)
+     'P' u8 options                         prompt: send a 'C'
+     'E'                                    session over; the server hangs up
+     'Z'                                    from the next byte on, a raw deflate
+                                            stream primed with storyDictionary(),
+                                            until that stream ends (see
+                                            WireCompressor); only sent if the
+                                            server was built with NEBULA_ZLIB
+   A client that caches every 'F' frame and expands each 'S' from its
+   cache sees exactly the text the line protocol would have sent.
+-------------------------------------------------------------------*/
+enum class BinaryMsg : uint8_t {
+    Hello = 'H', Choice = 'C', Compress = 'Z',
+    SceneFull = 'F', SceneRef = 'S', Text = 'T', Prompt = 'P', End = 'E'
+};
+
+/* ------------------------------------------------------------------
+   SessionRouter:
+   Front end of the cluster. Accepts line-based client connections on
+   127.0.0.1 (one connection = one session), and forwards each line to
+   the worker process that owns the session by consistent hashing.
+   - All sockets are driven by one poll() loop with per-connection
+     output buffers, so a slow client or busy worker never blocks it.
+   - Workers send scenes as markers; deliver() writes them as text, or
+     for binary clients as a hash when that connection has the frame.
+   - A line-protocol client whose line reaches kMaxLine bytes without a
+     newline is dropped; no menu answer comes near it.
+   - Workers are forked on demand; when one is added or removed, every
+     session whose owner changes is handed off: Export from the old
+     worker, Import into the new one. Lines typed meanwhile are queued
+     and replayed after the Import, so the player notices nothing.
+   - A removed worker is told to Quit once all its sessions have moved.
+   - With setReplication(), every worker also gets a hot standby process
+     fed by its Replicator. If the worker dies, the standby is promoted
+     in its place (same ring position, so nothing is rehashed) and a
+     fresh standby is attached to it.
+   - Upgrades without dropping players: a router that called
+     listenForUpgrade(path) hands everything over to a new process that
+     connects there with takeOver(path). The old router stops accepting
+     and parks every session (Export, lines typed meanwhile are queued),
+     then sends over the Unix socket, with SCM_RIGHTS:
+       HandoverListen   (a listening socket: u8 1 if binary protocol)
+       HandoverClient   (one per client socket: u8 has session, u32
+                         history length, state, partial input line,
+                         unsent output, u32 count + queued lines,
+                         u8 binary, u32 count + frame hashes it has)
+       HandoverDone
+     and exits. Clients keep their TCP connections; new ones wait in
+     the listen backlog meanwhile. The new router Imports the sessions
+     into its own (new binary) workers.
+-------------------------------------------------------------------*/
+class SessionRouter {
+public:
+    static const size_t kMaxLine = 256;
+
+    explicit SessionRouter(const StoryGraph& g)
+        : graph(g), maxKnownScenes(4 * g.allNodes().size()) {
+        if (NEBULA_ZLIB) dictionary = storyDictionary(g);
+    }
+
+    ~SessionRouter() { shutdownAll(); }
+
+    // Gives workers added from now on a hot standby that may lag by at
+    // most 'maxLost' choices (see Replicator).
+    void setReplication(size_t maxLost) {
+        replicate = true;
+        replMaxLost = maxLost;
+    }
+
+    // Listens on 127.0.0.1:port (0 = any free port). Returns the port or -1.
+    int listenOn(int port) { return openListener(port, listenFd); }
+
+    // Same, for clients speaking the binary protocol.
+    int listenBinaryOn(int port) { return openListener(port, binListenFd); }
+
+    int boundPort() const { return portOf(listenFd); }
+    int binaryPort() const { return portOf(binListenFd); }
+
+    // Accepts one upgrade handover on the Unix socket at 'path'.
+    bool listenForUpgrade(const string& path) {
+        sockaddr_un addr{};
+        if (path.size() >= sizeof(addr.sun_path)) return false;
+        addr.sun_family = AF_UNIX;
+        memcpy(addr.sun_path, path.c_str(), path.size() + 1);
+        upgradeFd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0);
+        unlink(path.c_str());
+        if (upgradeFd < 0 || ::bind(upgradeFd, (sockaddr*)&addr, sizeof(addr)) < 0 ||
+            listen(upgradeFd, 1) < 0) {
+            if (upgradeFd >= 0) close(upgradeFd);
+            upgradeFd = -1;
+            return false;
+        }
+        upgradePath = path;
+        return true;
+    }
+
+    // Takes the listening socket and every live session from the router
+    // listening for upgrades at 'path'. Needs workers to import into.
+    // False if no router is there (start fresh instead).
+    bool takeOver(const string& path) {
+        sockaddr_un addr{};
+        if (path.size() >= sizeof(addr.sun_path)) return false;
+        addr.sun_family = AF_UNIX;
+        memcpy(addr.sun_path, path.c_str(), path.size() + 1);
+        int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd < 0) return false;
+        string buf, payload;
+        appendMsg(buf, ClusterMsg::Handover, 0, "");
+        if (connect(fd, (sockaddr*)&addr, sizeof(addr)) < 0 || !sendAll(fd, buf)) {
+            close(fd);
+            return false;
+        }
+        buf.clear();
+        vector<int> passed;
+        size_t adopted = 0;
+        bool done = false;
+        while (!done) {
+            ClusterMsg type;
+            uint64_t sid;
+            while (!done && takeMsg(buf, type, sid, payload)) {
+                if (type == ClusterMsg::HandoverDone) done = true;
+                if (type != ClusterMsg::HandoverListen && type != ClusterMsg::HandoverClient) continue;
+                if (passed.empty()) break;
+                int passedFd = passed.front();
+                passed.erase(passed.begin());
+                if (type == ClusterMsg::HandoverListen) {
+                    int& target = payload == "\1" ? binListenFd : listenFd;
+                    if (target >= 0) close(target);
+                    target = passedFd;
+                } else if (adoptClient(passedFd, payload)) {
+                    ++adopted;
+                }
+            }
+            if (!done && !recvSome(fd, buf, &passed)) break;
+        }
+        close(fd);
+        for (int f : passed) close(f);
+        if (!done || listenFd < 0) return false;
+        cerr << "router: took over port " << boundPort() << " with " << adopted << " live sessions\n";
+        return true;
+    }
+
+    bool addWorker() {
+        int sv[2];
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) return false;
+        pid_t pid = fork();
+        if (pid < 0) {
+            close(sv[0]);
+            close(sv[1]);
+            return false;
+        }
+        if (pid == 0) {
+            // Child: keep only our end of the pair, then serve until told to quit.
+            close(sv[0]);
+            closeRouterFds();
+            ClusterWorker(sv[1], graph, replMaxLost).serve();
+            _exit(0);
+        }
+        close(sv[1]);
+        int id = nextWorkerId++;
+        Worker& w = workers[id];
+        w.pid = pid;
+        w.conn.fd = sv[0];
+        ring.add(id);
+        cerr << "router: added worker " << id << " (pid " << pid << ")\n";
+        if (replicate) attachStandby(id);
+        rebalance();
+        return true;
+    }
+
+    // Drains and retires the newest worker; refuses to remove the last one.
+    bool removeWorker() {
+        int victim = -1, active = 0;
+        for (auto& kv : workers)
+            if (!kv.second.draining) {
+                ++active;
+                victim = kv.first;
+            }
+        if (active < 2) return false;
+        workers[victim].draining = true;
+        ring.remove(victim);
+        cerr << "router: draining worker " << victim << "\n";
+        rebalance();
+        return true;
+    }
+
+    // Serves until SIGINT/SIGTERM (see installClusterSignals).
+    void run() {
+        vector<pollfd> fds;
+        while (!gClusterStop && !handedOver) {
+            if (gClusterAddWorker) {
+                gClusterAddWorker = 0;
+                addWorker();
+            }
+            if (gClusterRemoveWorker) {
+                gClusterRemoveWorker = 0;
+                if (!removeWorker()) cerr << "router: keeping the last worker\n";
+            }
+
+            fds.clear();
+            if (!handingOver) fds.push_back({listenFd, POLLIN, 0});
+            if (!handingOver && binListenFd >= 0) fds.push_back({binListenFd, POLLIN, 0});
+            if (upgradeFd >= 0) fds.push_back({upgradeFd, POLLIN, 0});
+            for (auto& kv : clients)
+                fds.push_back({kv.first, (short)(POLLIN | (kv.second.out.empty() ? 0 : POLLOUT)), 0});
+            for (auto& kv : workers) {
+                fds.push_back({kv.second.conn.fd,
+                               (short)(POLLIN | (kv.second.conn.out.empty() ? 0 : POLLOUT)), 0});
+                if (kv.second.standby.fd >= 0) fds.push_back({kv.second.standby.fd, POLLIN, 0});
+            }
+            if (poll(fds.data(), fds.size(), 200) < 0) continue;   // EINTR: check flags
+
+            for (const pollfd& p : fds) {
+                if (!p.revents) continue;
+                if (p.fd == listenFd || p.fd == binListenFd) acceptClients(p.fd);
+                else if (p.fd == upgradeFd) beginHandover();
+                else if (clients.count(p.fd)) serviceClient(p.fd, p.revents);
+                else serviceWorkerFd(p.fd, p.revents);
+            }
+            // Only here, outside any per-connection handler, may workers go away.
+            retireDrainedWorkers();
+            if (handingOver) finishHandover();
+        }
+        cerr << "router: stopping after " << handoffs << " session handoffs";
+        if (failovers) cerr << ", " << failovers << " failovers (" << lostChoices << " choices lost)";
+        if (sceneRefs)
+            cerr << ", " << sceneRefs << " cached scenes sent as hashes (binary clients got "
+                 << binaryBytes << " bytes, " << sceneBytesSaved << " saved)";
+        if (deflatedIn)
+            cerr << ", deflated " << deflatedIn << " -> " << deflatedOut << " bytes in "
+                 << deflateNanos / 1000 << " us";
+        cerr << "\n";
+        shutdownAll();
+    }
+
+    uint64_t handoffCount() const { return handoffs; }
+
+    pid_t workerPid(int id) const {
+        auto it = workers.find(id);
+        return it == workers.end() ? -1 : it->second.pid;
+    }
+
+private:
+    struct Conn {
+        int fd = -1;
+        string in, out;
+        bool closeAfterFlush = false;
+        bool binary = false;                  // client speaks BinaryMsg
+        unordered_set<uint64_t> knownScenes;  // frames this client has cached
+        unique_ptr<WireCompressor> z;         // set once the client asked for 'Z'
+        string plain;                         // output waiting to be compressed
+    };
+    struct Worker {
+        pid_t pid = -1;
+        Conn conn;
+        bool draining = false;
+        pid_t standbyPid = -1;
+        Conn standby;           // idle until the standby is promoted
+        chrono::steady_clock::time_point failedAt;
+    };
+    struct RoutedSession {
+        int clientFd = -1;      // -1 once the client has gone
+        int owner = -1;         // worker id currently holding the state
+        bool moving = false;    // Export sent, waiting for State
+        deque<string> queued;   // lines received while moving (or parked)
+        bool parked = false;    // exported for an upgrade handover
+        string state;           // ... and its serialized state
+        uint32_t steps = 0;     // history length in the player's last reply
+        uint32_t unanswered = 0;  // requests sent that got no Output yet
+    };
+
+    static int portOf(int fd) {
+        sockaddr_in addr{};
+        socklen_t len = sizeof(addr);
+        if (fd < 0 || getsockname(fd, (sockaddr*)&addr, &len) < 0) return -1;
+        return ntohs(addr.sin_port);
+    }
+
+    // Listens on 127.0.0.1:port (0 = any free port) into 'fd'. Returns the port or -1.
+    static int openListener(int port, int& fd) {
+        fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+        if (fd < 0) return -1;
+        int one = 1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        sockaddr_in addr{};
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        addr.sin_port = htons((uint16_t)port);
+        if (::bind(fd, (sockaddr*)&addr, sizeof(addr)) < 0 || listen(fd, 128) < 0) return -1;
+        return portOf(fd);
+    }
+
+    void acceptClients(int lfd) {
+        while (true) {
+            int fd = accept4(lfd, nullptr, nullptr, SOCK_NONBLOCK);
+            if (fd < 0) return;
+            uint64_t sid = nextSid++;
+            clients[fd].fd = fd;
+            clients[fd].binary = lfd == binListenFd;
+            if (ring.owner(sid) < 0) {       // no worker to play on (one failed to start)
+                emitText(clients[fd], "ERROR: No workers available.\n");
+                clients[fd].closeAfterFlush = true;
+                continue;
+            }
+            clientSession[fd] = sid;
+            RoutedSession& rs = sessions[sid];
+            rs.clientFd = fd;
+            rs.owner = ring.owner(sid);
+            rs.unanswered = 1;
+            appendMsg(workers[rs.owner].conn.out, ClusterMsg::Open, sid, "");
+        }
+    }
+
+    void serviceClient(int fd, short revents) {
+        Conn& c = clients[fd];
+        if (revents & POLLOUT) flush(c);
+        if (revents & (POLLIN | POLLHUP | POLLERR)) {
+            char chunk[4096];
+            ssize_t n = recv(fd, chunk, sizeof(chunk), MSG_DONTWAIT);
+            if (n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR)) {
+                dropClient(fd);
+                return;
+            }
+            if (n > 0) c.in.append(chunk, (size_t)n);
+            if (c.binary) {
+                if (!readBinary(c)) {
+                    dropClient(fd);
+                    return;
+                }
+                if (c.closeAfterFlush && c.out.empty()) dropClient(fd);
+                return;
+            }
+            size_t nl;
+            while ((nl = c.in.find('\n')) != string::npos) {
+                string line = c.in.substr(0, nl);
+                c.in.erase(0, nl + 1);
+                if (!line.empty() && line.back() == '\r') line.pop_back();
+                route(clientSession[fd], line);
+            }
+            if (c.in.size() >= kMaxLine) {
+                dropClient(fd);
+                return;
+            }
+        }
+        if (c.closeAfterFlush && c.out.empty()) dropClient(fd);
+    }
+
+    // Consumes complete BinaryMsg frames from c.in; false on garbage.
+    bool readBinary(Conn& c) {
+        size_t pos = 0;
+        while (pos < c.in.size()) {
+            size_t at = pos + 1;
+            BinaryMsg type = (BinaryMsg)c.in[pos];
+            if (type == BinaryMsg::Choice) {
+                if (at >= c.in.size()) break;
+                char num[4];
+                auto res = to_chars(num, num + sizeof(num), (unsigned char)c.in[at]);
+                route(clientSession[c.fd], string(num, res.ptr));
+                pos = at + 1;
+            } else if (type == BinaryMsg::Compress) {
+                if (NEBULA_ZLIB && !c.z) {
+                    c.out += (char)BinaryMsg::Compress;
+                    c.z.reset(new WireCompressor(dictionary));
+                }
+                pos = at;
+            } else if (type == BinaryMsg::Hello) {
+                uint32_t count;
+                if (!getU32(c.in, at, count)) break;
+                if (count > 1u << 16) return false;
+                if (c.in.size() - at < (size_t)count * 8) break;
+                for (uint32_t i = 0; i < count; ++i) {
+                    uint64_t h;
+                    getU64(c.in, at, h);
+                    if (c.knownScenes.size() < maxKnownScenes) c.knownScenes.insert(h);
+                }
+                pos = at;
+            } else {
+                return false;
+            }
+        }
+        c.in.erase(0, pos);
+        return true;
+    }
+
+    // Writes a worker's output to a client, expanding scene and prompt
+    // markers: text clients get the frames; binary clients get each
+    // frame once per connection (or cache) and its hash after that.
+    void deliver(Conn& c, string_view text, bool finished) {
+        size_t i = 0;
+        while (i < text.size()) {
+            size_t mark = text.find_first_of("\x1e\x1f", i);
+            size_t end = mark == string_view::npos ? text.size() : mark;
+            if (end > i) emitText(c, text.substr(i, end - i));
+            size_t pos = end + 1;
+            uint32_t v;
+            if (mark == string_view::npos || !getU32(text, pos, v)) break;
+            if (text[mark] == kSceneMark) emitScene(c, (int)v);
+            else emitPrompt(c, v);
+            i = pos;
+        }
+        if (finished && c.binary) sink(c) += (char)BinaryMsg::End;
+        seal(c);
+    }
+
+    // Where output for a client goes before it is sealed into c.out.
+    static string& sink(Conn& c) { return c.z ? c.plain : c.out; }
+
+    // Compresses pending output for a compressing client; 'finish' ends
+    // its deflate stream, so it reads plain bytes from then on.
+    void seal(Conn& c, bool finish = false) {
+        if (!c.z || (c.plain.empty() && !finish)) return;
+        auto start = chrono::steady_clock::now();
+        size_t before = c.out.size();
+        c.z->compress(c.plain, c.out, finish);
+        deflateNanos += (uint64_t)chrono::duration_cast<chrono::nanoseconds>(
+                            chrono::steady_clock::now() - start).count();
+        deflatedIn += c.plain.size();
+        deflatedOut += c.out.size() - before;
+        c.plain.clear();
+        if (finish) c.z.reset();
+    }
+
+    void emitText(Conn& c, string_view text) {
+        string& out = sink(c);
+        if (c.binary) {
+            out += (char)BinaryMsg::Text;
+            putStr(out, text);
+            binaryBytes += 5 + text.size();
+        } else {
+            out.append(text.data(), text.size());
+        }
+    }
+
+    void emitPrompt(Conn& c, uint32_t options) {
+        string& out = sink(c);
+        size_t before = out.size();
+        if (c.binary) out += {(char)BinaryMsg::Prompt, (char)min<uint32_t>(options, 255)};
+        else appendPrompt(out, options);
+        if (c.binary) binaryBytes += out.size() - before;
+    }
+
+    void emitScene(Conn& c, int id) {
+        const StoryNode* node = graph.get(id);
+        if (!node) {
+            emitText(c, "ERROR: Missing node " + to_string(id) + "\n");
+            return;
+        }
+        if (!c.binary) {
+            emitText(c, node->frame);
+            return;
+        }
+        string& out = sink(c);
+        if (c.knownScenes.insert(node->frameHash).second) {
+            out += (char)BinaryMsg::SceneFull;
+            putU64(out, node->frameHash);
+            putStr(out, node->frame);
+            binaryBytes += 13 + node->frame.size();
+        } else {
+            out += (char)BinaryMsg::SceneRef;
+            putU64(out, node->frameHash);
+            binaryBytes += 9;
+            sceneBytesSaved += 4 + node->frame.size();
+            ++sceneRefs;
+        }
+    }
+
+    void route(uint64_t sid, const string& line) {
+        auto it = sessions.find(sid);
+        if (it == sessions.end()) return;
+        RoutedSession& rs = it->second;
+        if (rs.moving || rs.parked) {
+            rs.queued.push_back(line);
+            return;
+        }
+        ++rs.unanswered;
+        appendMsg(workers[rs.owner].conn.out, ClusterMsg::Input, sid, line);
+    }
+
+    void serviceWorkerFd(int fd, short revents) {
+        int id = -1;
+        for (auto& kv : workers) {
+            if (kv.second.conn.fd == fd) id = kv.first;
+            if (kv.second.standby.fd == fd) {
+                // A standby only ever speaks once promoted; this is its death.
+                standbyLost(kv.first);
+                return;
+            }
+        }
+        if (id < 0) return;
+        Conn& c = workers[id].conn;
+        if (revents & POLLOUT) flush(c);
+        if (!(revents & (POLLIN | POLLHUP | POLLERR))) return;
+
+        char chunk[16384];
+        ssize_t n = recv(fd, chunk, sizeof(chunk), MSG_DONTWAIT);
+        if (n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR)) {
+            workerLost(id);
+            return;
+        }
+        if (n > 0) c.in.append(chunk, (size_t)n);
+        ClusterMsg type;
+        uint64_t sid;
+        string payload;
+        while (takeMsg(c.in, type, sid, payload)) {
+            if (type == ClusterMsg::Output) onOutput(sid, payload);
+            else if (type == ClusterMsg::State) onState(sid, payload);
+            else if (type == ClusterMsg::Promoted) onPromoted(id, payload);
+        }
+    }
+
+    void onOutput(uint64_t sid, const string& payload) {
+        auto it = sessions.find(sid);
+        size_t pos = 1;
+        uint32_t steps;
+        if (it == sessions.end() || !getU32(payload, pos, steps)) return;
+        bool finished = payload[0] != 0;
+        it->second.steps = steps;
+        if (it->second.unanswered) --it->second.unanswered;
+        int fd = it->second.clientFd;
+        if (fd >= 0) {
+            Conn& c = clients[fd];
+            deliver(c, string_view(payload).substr(pos), finished);
+            if (finished) c.closeAfterFlush = true;
+            flush(c);
+        }
+        if (finished) sessions.erase(it);
+        if (fd >= 0 && clients[fd].closeAfterFlush && clients[fd].out.empty()) dropClient(fd);
+    }
+
+    void onState(uint64_t sid, const string& state) {
+        auto it = sessions.find(sid);
+        if (it == sessions.end()) return;
+        RoutedSession& rs = it->second;
+        if (rs.clientFd < 0 || state.empty()) {      // client left, or session already over
+            sessions.erase(it);
+            return;
+        }
+        if (handingOver) {
+            rs.moving = false;
+            rs.parked = true;
+            rs.state = state;
+            return;
+        }
+        rs.owner = ring.owner(sid);
+        rs.moving = false;
+        if (rs.owner < 0) {
+            loseSession(rs);
+            sessions.erase(it);
+            return;
+        }
+        ++handoffs;
+        string& out = workers[rs.owner].conn.out;
+        appendMsg(out, ClusterMsg::Import, sid, state);
+        for (auto& line : rs.queued) appendMsg(out, ClusterMsg::Input, sid, line);
+        rs.unanswered += (uint32_t)rs.queued.size();
+        rs.queued.clear();
+    }
+
+    // Starts a handoff for every session whose ring owner has changed.
+    void rebalance() {
+        size_t moving = 0;
+        for (auto& kv : sessions) {
+            RoutedSession& rs = kv.second;
+            if (rs.moving || rs.owner < 0) continue;
+            if (ring.owner(kv.first) != rs.owner) {
+                rs.moving = true;
+                appendMsg(workers[rs.owner].conn.out, ClusterMsg::Export, kv.first, "");
+                ++moving;
+            }
+        }
+        if (moving) cerr << "router: moving " << moving << " sessions\n";
+    }
+
+    void retireDrainedWorkers() {
+        for (auto it = workers.begin(); it != workers.end();) {
+            bool busy = false;
+            for (auto& kv : sessions)
+                if (kv.second.owner == it->first) busy = true;
+            if (!it->second.draining || busy) {
+                ++it;
+                continue;
+            }
+            stopWorker(it->second);
+            cerr << "router: retired worker " << it->first << "\n";
+            it = workers.erase(it);
+        }
+    }
+
+    // Tells a session's player it is gone and hangs up once that is sent.
+    void loseSession(RoutedSession& rs) {
+        if (rs.clientFd < 0) return;
+        Conn& c = clients[rs.clientFd];
+        emitText(c, "ERROR: Session lost.\n");
+        seal(c);
+        c.closeAfterFlush = true;
+    }
+
+    // A worker died. Its standby takes over if it has one; otherwise its
+    // sessions are gone, so tell their players and hang up. If it was
+    // the last worker taking sessions, a fresh one replaces it.
+    void workerLost(int id) {
+        cerr << "router: worker " << id << " exited unexpectedly\n";
+        close(workers[id].conn.fd);
+        waitpid(workers[id].pid, nullptr, 0);
+        if (workers[id].standby.fd >= 0) {
+            failover(id);
+            return;
+        }
+        if (workers[id].standbyPid > 0) waitpid(workers[id].standbyPid, nullptr, 0);
+        ring.remove(id);
+        workers.erase(id);
+        for (auto it = sessions.begin(); it != sessions.end();) {
+            if (it->second.owner != id) {
+                ++it;
+                continue;
+            }
+            loseSession(it->second);
+            it = sessions.erase(it);
+        }
+        if (ring.owner(0) < 0) addWorker();
+    }
+
+    // Promotes worker id's standby in place. Requests that were queued
+    // for, or in flight to, the dead worker are lost; players left
+    // waiting on one get their current scene again (see ClusterWorker).
+    void failover(int id) {
+        Worker& w = workers[id];
+        w.pid = w.standbyPid;
+        w.conn = Conn();
+        w.conn.fd = w.standby.fd;
+        w.standby = Conn();
+        w.standbyPid = -1;
+        w.failedAt = chrono::steady_clock::now();
+
+        string promote, exports;
+        for (auto& kv : sessions) {
+            RoutedSession& rs = kv.second;
+            if (rs.owner != id) continue;
+            putU64(promote, kv.first);
+            putU32(promote, rs.steps);
+            promote += (char)(rs.unanswered ? 1 : 0);
+            rs.unanswered = rs.unanswered ? 1 : 0;        // the resent scene
+            if (rs.moving) appendMsg(exports, ClusterMsg::Export, kv.first, "");
+        }
+        appendMsg(w.conn.out, ClusterMsg::Promote, 0, promote);
+        w.conn.out += exports;            // restart interrupted handoffs
+        ++failovers;
+        cerr << "router: promoting standby of worker " << id << " (pid " << w.pid << ")\n";
+        if (!w.draining) attachStandby(id);
+    }
+
+    void onPromoted(int id, const string& payload) {
+        size_t pos = 0;
+        uint32_t count = 0, lost = 0;
+        getU32(payload, pos, count);
+        getU32(payload, pos, lost);
+        lostChoices += lost;
+        auto us = chrono::duration_cast<chrono::microseconds>(
+                      chrono::steady_clock::now() - workers[id].failedAt).count();
+        cerr << "router: worker " << id << " failed over in " << us << " us; " << count
+             << " sessions resumed, " << lost << " choices lost\n";
+    }
+
+    // Forks a standby for worker id and hands the worker its end of the
+    // replication socket, in order with whatever is already queued for it.
+    bool attachStandby(int id) {
+        Worker& w = workers[id];
+        int ctl[2], rep[2];
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, ctl) < 0) return false;
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, rep) < 0) {
+            close(ctl[0]);
+            close(ctl[1]);
+            return false;
+        }
+        pid_t pid = fork();
+        if (pid == 0) {
+            close(ctl[0]);
+            close(rep[0]);
+            closeRouterFds();
+            ClusterWorker(ctl[1], graph, replMaxLost).standBy(rep[1]);
+            _exit(0);
+        }
+        close(ctl[1]);
+        close(rep[1]);
+        bool ok = pid > 0;
+        if (ok) {
+            w.standbyPid = pid;
+            w.standby.fd = ctl[0];
+            string attach;
+            appendMsg(attach, ClusterMsg::AttachStandby, 0, "");
+            ok = sendAll(w.conn.fd, w.conn.out) && sendWithFd(w.conn.fd, attach, rep[0]);
+            w.conn.out.clear();
+        } else {
+            close(ctl[0]);
+        }
+        close(rep[0]);
+        return ok;
+    }
+
+    void standbyLost(int id) {
+        Worker& w = workers[id];
+        cerr << "router: standby of worker " << id << " exited; replacing it\n";
+        close(w.standby.fd);
+        waitpid(w.standbyPid, nullptr, 0);
+        w.standby = Conn();
+        w.standbyPid = -1;
+        if (!w.draining) attachStandby(id);
+    }
+
+    // Old side of an upgrade: stop accepting and export every session.
+    void beginHandover() {
+        handoverFd = accept(upgradeFd, nullptr, nullptr);
+        if (handoverFd < 0) return;
+        close(upgradeFd);
+        upgradeFd = -1;
+        unlink(upgradePath.c_str());       // the new router binds it next
+        handingOver = true;
+        for (auto& kv : sessions) {
+            RoutedSession& rs = kv.second;
+            if (rs.moving || rs.owner < 0) continue;
+            rs.moving = true;
+            appendMsg(workers[rs.owner].conn.out, ClusterMsg::Export, kv.first, "");
+        }
+        cerr << "router: handing over " << sessions.size() << " sessions\n";
+    }
+
+    // Once every session is parked, ships sockets and state to the new
+    // router and leaves run(). Waits for the Handover request first.
+    void finishHandover() {
+        for (auto& kv : sessions)
+            if (kv.second.moving) return;
+        string request, payload;
+        ClusterMsg type;
+        uint64_t sid;
+        while (!takeMsg(request, type, sid, payload))
+            if (!recvSome(handoverFd, request)) break;
+
+        string msg;
+        appendMsg(msg, ClusterMsg::HandoverListen, 0, "");
+        bool ok = sendWithFd(handoverFd, msg, listenFd);
+        if (binListenFd >= 0) {
+            msg.clear();
+            appendMsg(msg, ClusterMsg::HandoverListen, 0, "\1");
+            ok = ok && sendWithFd(handoverFd, msg, binListenFd);
+        }
+        size_t handed = 0;
+        for (auto& kv : clients) {
+            Conn& c = kv.second;
+            seal(c, true);       // deflate state cannot move; end the stream
+            flush(c);
+            payload.clear();
+            auto cs = clientSession.find(kv.first);
+            RoutedSession* rs = nullptr;
+            if (cs != clientSession.end() && sessions.count(cs->second)) rs = &sessions[cs->second];
+            payload += (char)(rs ? 1 : 0);
+            putU32(payload, rs ? rs->steps : 0);
+            putStr(payload, rs ? rs->state : "");
+            putStr(payload, c.in);
+            putStr(payload, c.out);
+            putU32(payload, rs ? (uint32_t)rs->queued.size() : 0);
+            if (rs)
+                for (auto& line : rs->queued) putStr(payload, line);
+            payload += (char)c.binary;
+            putU32(payload, (uint32_t)c.knownScenes.size());
+            for (uint64_t h : c.knownScenes) putU64(payload, h);
+            msg.clear();
+            appendMsg(msg, ClusterMsg::HandoverClient, 0, payload);
+            ok = ok && sendWithFd(handoverFd, msg, kv.first);
+            ++handed;
+        }
+        msg.clear();
+        appendMsg(msg, ClusterMsg::HandoverDone, 0, "");
+        ok = ok && sendAll(handoverFd, msg);
+        close(handoverFd);
+        handoverFd = -1;
+        cerr << "router: handed over " << handed << " connections" << (ok ? "" : " (incomplete)") << "\n";
+        // Our copies of the sockets close on shutdown; the new router's stay open.
+        sessions.clear();
+        handedOver = true;
+    }
+
+    // New side of an upgrade: one client socket and its session.
+    bool adoptClient(int fd, const string& payload) {
+        size_t pos = 1;
+        uint32_t steps, count;
+        uint64_t hash;
+        string state, line;
+        vector<string> queued;
+        Conn c;
+        c.fd = fd;
+        bool ok = !payload.empty() && getU32(payload, pos, steps) && getStr(payload, pos, state) &&
+                  getStr(payload, pos, c.in) && getStr(payload, pos, c.out) && getU32(payload, pos, count);
+        for (uint32_t i = 0; ok && i < count; ++i) {
+            ok = getStr(payload, pos, line);
+            queued.push_back(line);
+        }
+        ok = ok && pos < payload.size();
+        if (ok) c.binary = payload[pos++] != 0;
+        ok = ok && getU32(payload, pos, count);
+        for (uint32_t i = 0; ok && i < count && getU64(payload, pos, hash); ++i)
+            if (c.knownScenes.size() < maxKnownScenes) c.knownScenes.insert(hash);
+        if (!ok) {
+            close(fd);
+            return false;
+        }
+        clients[fd] = move(c);
+        if (payload[0] == 0 || ring.owner(0) < 0) {
+            clients[fd].closeAfterFlush = true;    // session already over
+            return false;
+        }
+        uint64_t sid = nextSid++;
+        clientSession[fd] = sid;
+        RoutedSession& rs = sessions[sid];
+        rs.clientFd = fd;
+        rs.owner = ring.owner(sid);
+        rs.steps = steps;
+        string& out = workers[rs.owner].conn.out;
+        appendMsg(out, ClusterMsg::Import, sid, state);
+        for (auto& l : queued) appendMsg(out, ClusterMsg::Input, sid, l);
+        rs.unanswered = (uint32_t)queued.size();
+        return true;
+    }
+
+    // In a forked child: drop every descriptor that belongs to the router.
+    void closeRouterFds() {
+        if (listenFd >= 0) close(listenFd);
+        if (binListenFd >= 0) close(binListenFd);
+        if (upgradeFd >= 0) close(upgradeFd);
+        if (handoverFd >= 0) close(handoverFd);
+        for (auto& kv : clients) close(kv.first);
+        for (auto& kv : workers) {
+            close(kv.second.conn.fd);
+            if (kv.second.standby.fd >= 0) close(kv.second.standby.fd);
+        }
+    }
+
+    void dropClient(int fd) {
+        auto cs = clientSession.find(fd);
+        if (cs != clientSession.end()) {
+            auto it = sessions.find(cs->second);
+            if (it != sessions.end()) {
+                if (it->second.moving) it->second.clientFd = -1;   // finish the move, then drop
+                else {
+                    appendMsg(workers[it->second.owner].conn.out, ClusterMsg::Close, cs->second, "");
+                    sessions.erase(it);
+                }
+            }
+            clientSession.erase(cs);
+        }
+        close(fd);
+        clients.erase(fd);
+    }
+
+    static void flush(Conn& c) {
+        while (!c.out.empty()) {
+            ssize_t n = send(c.fd, c.out.data(), c.out.size(), MSG_DONTWAIT | MSG_NOSIGNAL);
+            if (n <= 0) return;
+            c.out.erase(0, (size_t)n);
+        }
+    }
+
+    void stopWorker(Worker& w) {
+        string quit = w.conn.out;
+        appendMsg(quit, ClusterMsg::Quit, 0, "");
+        sendAll(w.conn.fd, quit);
+        close(w.conn.fd);
+        waitpid(w.pid, nullptr, 0);
+        if (w.standby.fd >= 0) {
+            quit.clear();
+            appendMsg(quit, ClusterMsg::Quit, 0, "");
+            sendAll(w.standby.fd, quit);
+            close(w.standby.fd);
+            waitpid(w.standbyPid, nullptr, 0);
+        }
+    }
+
+    void shutdownAll() {
+        for (auto& kv : workers) stopWorker(kv.second);
+        workers.clear();
+        for (auto& kv : clients) close(kv.first);
+        clients.clear();
+        if (listenFd >= 0) close(listenFd);
+        if (binListenFd >= 0) close(binListenFd);
+        listenFd = binListenFd = -1;
+        if (upgradeFd >= 0) {
+            close(upgradeFd);
+            unlink(upgradePath.c_str());
+        }
+        upgradeFd = -1;
+    }
+
+    const StoryGraph& graph;
+    const size_t maxKnownScenes;   // frame hashes kept per binary client
+    int listenFd = -1, binListenFd = -1;
+    int nextWorkerId = 1;
+    uint64_t nextSid = 1, handoffs = 0, failovers = 0, lostChoices = 0;
+    uint64_t binaryBytes = 0, sceneRefs = 0, sceneBytesSaved = 0;
+    uint64_t deflatedIn = 0, deflatedOut = 0, deflateNanos = 0;
+    string dictionary;      // storyDictionary(), for compressing clients
+    bool replicate = false;
+    size_t replMaxLost = 0;
+    int upgradeFd = -1, handoverFd = -1;
+    string upgradePath;
+    bool handingOver = false, handedOver = false;
+    ConsistentHashRing ring;
+    map<int, Worker> workers;
+    map<int, Conn> clients;                 // client fd -> connection
+    map<int, uint64_t> clientSession;       // client fd -> session id
+    unordered_map<uint64_t, RoutedSession> sessions;
+};
+
+/* ------------------------------------------------------------------
+   serveCluster:
+   --serve [port] [workers]: runs a SessionRouter in the foreground
+   with the given number of worker processes. Play with e.g.
+   "nc 127.0.0.1 <port>"; kill -USR1 / -USR2 the router to add or
+   remove a worker while sessions are live. NEBULA_REPL_LAG=<n> gives
+   each worker a hot standby that may lag by at most n choices.
+   With NEBULA_UPGRADE_SOCKET=<path>, starting a second server (e.g. a
+   new build) with the same setting takes over the port and all live
+   sessions from the running one, which then exits.
+   NEBULA_BINARY_PORT=<port> also serves the binary client protocol.
+   startRouter() is the shared setup: workers first, then take over
+   or listen (binaryPort < 0: no binary listener). Returns the port,
+   or -1.
+-------------------------------------------------------------------*/
+int startRouter(SessionRouter& router, int port, int workerCount, const char* upgradePath,
+                int binaryPort = -1) {
+    for (int i = 0; i < max(1, workerCount); ++i) router.addWorker();
+    int bound = upgradePath && router.takeOver(upgradePath) ? router.boundPort() : router.listenOn(port);
+    if (bound >= 0 && binaryPort >= 0 && router.binaryPort() < 0 && router.listenBinaryOn(binaryPort) < 0)
+        cerr << "router: cannot listen for binary clients on port " << binaryPort << "\n";
+    if (bound >= 0 && upgradePath && !router.listenForUpgrade(upgradePath))
+        cerr << "router: cannot accept upgrades on " << upgradePath << "\n";
+    return bound;
+}
+
+int serveCluster(const StoryGraph& graph, int port, int workerCount) {
+    SessionRouter router(graph);
+    if (const char* lag = getenv("NEBULA_REPL_LAG")) router.setReplication((size_t)atol(lag));
+    const char* binary = getenv("NEBULA_BINARY_PORT");
+    int bound = startRouter(router, port, workerCount, getenv("NEBULA_UPGRADE_SOCKET"),
+                            binary ? atoi(binary) : -1);
+    if (bound < 0) {
+        cerr << "could not listen on port " << port << "\n";
+        return 1;
+    }
+    installClusterSignals();
+    cerr << "serving on 127.0.0.1:" << bound;
+    if (router.binaryPort() >= 0) cerr << " (binary protocol on " << router.binaryPort() << ")";
+    cerr << "\n";
+    router.run();
+    return 0;
+}
+
+/* ------------------------------------------------------------------
+   Cluster demos:
+   End-to-end checks on one box. forkDemoRouter() starts a router with
+   two workers in a child process and reports its ports (line and
+   binary protocol) and the worker pids. playDemoClients() connects kDemoClients players over loopback
+   and plays them in lock-step, calling 'afterRound' between rounds so
+   the demo can disturb the cluster mid-story. Each player's "Path
+   Taken" must match a local replay of the same picks on the graph;
+   returns how many did.
+   - clusterDemo (--cluster-demo): adds a worker, removes one and adds
+     another between rounds, so sessions are handed off.
+   - failoverDemo (--failover-demo [maxLost]): with standbys, SIGKILLs
+     each original worker in turn; the standbys must take over.
+   - upgradeDemo (--upgrade-demo): starts a second router mid-story that
+     takes over the first one's port and sessions; the first must exit.
+   - binaryDemo (--binary-demo [plays]): plays the same picks over the
+     line and the binary protocol and compares bytes on the wire.
+-------------------------------------------------------------------*/
+const int kDemoClients = 16;
+
+struct DemoRouter {
+    pid_t pid = -1;
+    int port = -1, binaryPort = -1;
+    pid_t workerPids[2] = {-1, -1};
+};
+
+bool forkDemoRouter(const StoryGraph& graph, DemoRouter& r, bool replicate = false, size_t maxLost = 0,
+                    const char* upgradePath = nullptr) {
+    int infoPipe[2];
+    if (pipe(infoPipe) < 0) return false;
+    cout.flush();                       // or the child inherits unwritten output
+    r.pid = fork();
+    if (r.pid == 0) {
+        close(infoPipe[0]);
+        SessionRouter router(graph);
+        if (replicate) router.setReplication(maxLost);
+        int info[4] = {startRouter(router, 0, 2, upgradePath, 0), router.binaryPort(),
+                       router.workerPid(1), router.workerPid(2)};
+        if (write(infoPipe[1], info, sizeof(info)) != sizeof(info)) _exit(1);
+        close(infoPipe[1]);
+        installClusterSignals();
+        router.run();
+        _exit(0);
+    }
+    close(infoPipe[1]);
+    int info[4] = {-1, -1, -1, -1};
+    bool ok = r.pid > 0 && read(infoPipe[0], info, sizeof(info)) == sizeof(info) && info[0] >= 0;
+    close(infoPipe[0]);
+    r.port = info[0];
+    r.binaryPort = info[1];
+    r.workerPids[0] = info[2];
+    r.workerPids[1] = info[3];
+    return ok;
+}
+
+int connectLoopback(int port) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons((uint16_t)port);
+    if (fd >= 0 && connect(fd, (sockaddr*)&addr, sizeof(addr)) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// The pick demo player 'player' makes at step 'step' (1 or 2).
+int demoPick(int player, int step) { return 1 + (player >> (step % 4)) % 2; }
+
+int playDemoClients(const StoryGraph& graph, int port, const function<void(int)>& afterRound) {
+    // Reads until the server prompts again or hangs up.
+    auto readReply = [](int fd, string& transcript) {
+        string buf;
+        while (true) {
+            if (!recvSome(fd, buf)) break;
+            if (buf.size() >= 3 && buf.compare(buf.size() - 3, 3, "): ") == 0) break;
+        }
+        transcript += buf;
+        return buf.size() >= 3 && buf.compare(buf.size() - 3, 3, "): ") == 0;
+    };
+
+    vector<int> fds(kDemoClients, -1);
+    vector<string> transcripts(kDemoClients);
+    vector<vector<int>> picks(kDemoClients);
+    vector<bool> live(kDemoClients, true);
+    for (int i = 0; i < kDemoClients; ++i) {
+        fds[i] = connectLoopback(port);
+        if (fds[i] < 0) return 0;
+        live[i] = readReply(fds[i], transcripts[i]);
+    }
+
+    for (int round = 0; round < 16; ++round) {
+        bool any = false;
+        for (int i = 0; i < kDemoClients; ++i) {
+            if (!live[i]) continue;
+            any = true;
+            int pick = demoPick(i, round);
+            picks[i].push_back(pick);
+            // Every third player also sends a bad line first.
+            if (i % 3 == 0) {
+                sendAll(fds[i], "oops\n");
+                readReply(fds[i], transcripts[i]);
+            }
+            sendAll(fds[i], to_string(pick) + "\n");
+            live[i] = readReply(fds[i], transcripts[i]);
+        }
+        if (!any) break;
+        afterRound(round);
+    }
+
+    int ok = 0;
+    for (int i = 0; i < kDemoClients; ++i) {
+        close(fds[i]);
+        // Replay the same picks locally to get the expected path.
+        string expected = "Path Taken: 0";
+        int cur = 0;
+        for (int p : picks[i]) {
+            const StoryNode* node = graph.get(cur);
+            if (!node || p > (int)node->choices.size()) {
+                expected += " -> (no choice " + to_string(p) + ")";
+                break;
+            }
+            cur = node->choices[p - 1].nextId;
+            expected += " -> " + to_string(cur);
+        }
+        expected += "\n";
+        if (transcripts[i].find(expected) != string::npos) ++ok;
+        else cerr << "client " << i << " expected \"" << expected << "\" in:\n" << transcripts[i] << "\n";
+    }
+    return ok;
+}
+
+int clusterDemo(const StoryGraph& graph) {
+    DemoRouter r;
+    if (!forkDemoRouter(graph, r)) return 1;
+    const int kSignalAfterRound[] = {SIGUSR1, SIGUSR2, SIGUSR1};
+    int ok = playDemoClients(graph, r.port, [&](int round) {
+        if (round < 3) kill(r.pid, kSignalAfterRound[round]);
+    });
+    kill(r.pid, SIGTERM);
+    waitpid(r.pid, nullptr, 0);
+    cout << "clients=" << kDemoClients << " matching_paths=" << ok << "\n";
+    return ok == kDemoClients ? 0 : 1;
+}
+
+int failoverDemo(const StoryGraph& graph, size_t maxLost) {
+    DemoRouter r;
+    if (!forkDemoRouter(graph, r, true, maxLost)) return 1;
+    int ok = playDemoClients(graph, r.port, [&](int round) {
+        if (round != 0 && round != 2) return;
+        kill(r.workerPids[round / 2], SIGKILL);
+        // Let the router notice before the next picks go out; lines sent
+        // to a dying worker would be lost and answered with a re-prompt.
+        this_thread::sleep_for(chrono::milliseconds(100));
+    });
+    kill(r.pid, SIGTERM);
+    waitpid(r.pid, nullptr, 0);
+    cout << "clients=" << kDemoClients << " matching_paths=" << ok << " workers_killed=2\n";
+    return ok == kDemoClients ? 0 : 1;
+}
+
+int upgradeDemo(const StoryGraph& graph) {
+    string path = "/tmp/nebula-upgrade-" + to_string(getpid()) + ".sock";
+    DemoRouter old, fresh;
+    if (!forkDemoRouter(graph, old, false, 0, path.c_str())) return 1;
+    pid_t oldPid = old.pid, newPid = -1;
+    bool oldExited = false;
+    int ok = playDemoClients(graph, old.port, [&](int round) {
+        if (round != 1) return;
+        // The players keep going while the handover is in progress.
+        forkDemoRouter(graph, fresh, false, 0, path.c_str());
+        newPid = fresh.pid;
+    });
+    if (newPid > 0) {
+        for (int i = 0; i < 100 && !oldExited; ++i) {
+            oldExited = waitpid(oldPid, nullptr, WNOHANG) == oldPid;
+            if (!oldExited) this_thread::sleep_for(chrono::milliseconds(20));
+        }
+        kill(newPid, SIGTERM);
+        waitpid(newPid, nullptr, 0);
+    }
+    if (!oldExited) {
+        kill(oldPid, SIGTERM);
+        waitpid(oldPid, nullptr, 0);
+    }
+    cout << "clients=" << kDemoClients << " matching_paths=" << ok << " same_port="
+         << (fresh.port == old.port) << " old_router_exited=" << oldExited << "\n";
+    return ok == kDemoClients && fresh.port == old.port && oldExited ? 0 : 1;
+}
+
+// One playthrough over the line protocol; returns bytes received.
+size_t playLineClient(int port, int player, string& transcript) {
+    int fd = connectLoopback(port);
+    if (fd < 0) return 0;
+    string buf;
+    size_t seen = 0;
+    for (int step = 0; recvSome(fd, buf);) {
+        if (buf.size() - seen >= 3 && buf.compare(buf.size() - 3, 3, "): ") == 0) {
+            seen = buf.size();
+            sendAll(fd, to_string(demoPick(player, step++)) + "\n");
+        }
+    }
+    close(fd);
+    transcript = buf;
+    return buf.size();
+}
+
+// The same over the binary protocol, with a scene cache that persists
+// across calls; 'transcript' is what the client would display. With a
+// dictionary (NEBULA_ZLIB builds) the client asks for compression.
+size_t playBinaryClient(int port, int player, unordered_map<uint64_t, string>& cache,
+                        string& transcript, const string* dictionary = nullptr) {
+    int fd = connectLoopback(port);
+    if (fd < 0) return 0;
+    string out(1, (char)BinaryMsg::Hello), raw, buf;
+    putU32(out, (uint32_t)cache.size());
+    for (auto& kv : cache) putU64(out, kv.first);
+    if (dictionary) out += (char)BinaryMsg::Compress;
+    sendAll(fd, out);
+    transcript.clear();
+#if NEBULA_ZLIB
+    unique_ptr<WireDecompressor> z;
+#endif
+    size_t received = 0, pos = 0;
+    bool over = false;
+    for (int step = 0; !over && recvSome(fd, raw);) {
+        received += raw.size();
+        bool switched = true;
+        while (switched && !over) {
+            switched = false;
+#if NEBULA_ZLIB
+            if (z && z->decompress(raw, buf)) z.reset();
+            if (!z) buf += raw;
+#else
+            buf += raw;
+#endif
+            raw.clear();
+            while (!switched && pos < buf.size()) {
+                size_t at = pos + 1;
+                uint64_t hash = 0;
+                string text;
+                BinaryMsg type = (BinaryMsg)buf[pos];
+                if (type == BinaryMsg::SceneFull) {
+                    if (!getU64(buf, at, hash) || !getStr(buf, at, text)) break;
+                    transcript += cache[hash] = text;
+                } else if (type == BinaryMsg::SceneRef) {
+                    if (!getU64(buf, at, hash)) break;
+                    transcript += cache[hash];
+                } else if (type == BinaryMsg::Text) {
+                    if (!getStr(buf, at, text)) break;
+                    transcript += text;
+                } else if (type == BinaryMsg::Prompt) {
+                    if (at >= buf.size()) break;
+                    appendPrompt(transcript, (unsigned char)buf[at++]);
+                    char pick[2] = {(char)BinaryMsg::Choice, (char)demoPick(player, step++)};
+                    sendAll(fd, string_view(pick, 2));
+                } else if (type == BinaryMsg::Compress && dictionary) {
+#if NEBULA_ZLIB
+                    // Everything after this byte is compressed: decode it again.
+                    z.reset(new WireDecompressor(*dictionary));
+                    raw = buf.substr(at);
+                    buf.resize(at);
+                    switched = true;
+#endif
+                } else {
+                    over = true;
+                }
+                pos = at;
+            }
+        }
+    }
+    close(fd);
+    return received;
+}
+
+int binaryDemo(const StoryGraph& graph, int plays) {
+    DemoRouter r;
+    if (!forkDemoRouter(graph, r) || r.binaryPort < 0) return 1;
+    unordered_map<uint64_t, string> cache;
+    size_t lineBytes = 0, binaryBytes = 0;
+    int mismatches = 0;
+    for (int i = 0; i < plays; ++i) {
+        string viaLine, viaBinary;
+        lineBytes += playLineClient(r.port, i, viaLine);
+        binaryBytes += playBinaryClient(r.binaryPort, i, cache, viaBinary);
+        if (viaLine != viaBinary && ++mismatches == 1)
+            cerr << "player " << i << " line protocol:\n" << viaLine << "\nbinary protocol:\n" << viaBinary << "\n";
+    }
+    kill(r.pid, SIGTERM);
+    waitpid(r.pid, nullptr, 0);
+    cout << "plays=" << plays << " line_bytes=" << lineBytes << " binary_bytes=" << binaryBytes
+         << " saved=" << (lineBytes ? 100.0 * (double)(lineBytes - binaryBytes) / (double)lineBytes : 0.0)
+         << "% transcripts_differ=" << mismatches << "\n";
+    return mismatches == 0 ? 0 : 1;
+}
+
+/* ------------------------------------------------------------------
+   benchCompression:
+   --compress-bench [plays]: how much the story dictionary buys.
+   1) For several dictionary sizes: bytes and CPU per scene with every
+      frame deflated on a fresh stream (the first scene on a new
+      connection, stream setup included), and with all frames sent
+      on one stream, sync-flushed after each (the steady state).
+   2) End to end through a router: binary clients with no scene cache
+      (every connection starts cold), plain versus compressed, with
+      their transcripts checked against the line protocol.
+-------------------------------------------------------------------*/
+int benchCompression(const StoryGraph& graph, int plays) {
+#if NEBULA_ZLIB
+    using Clock = chrono::steady_clock;
+    vector<string_view> frames;
+    size_t frameBytes = 0;
+    for (auto& kv : graph.allNodes()) {
+        frames.push_back(kv.second.frame);
+        frameBytes += kv.second.frame.size();
+    }
+    const int kReps = 200;
+    for (size_t dictBytes : {(size_t)0, (size_t)512, (size_t)1024, kStoryDictionaryBytes}) {
+        string dict = dictBytes ? storyDictionary(graph, dictBytes) : "";
+        size_t firstBytes = 0, streamBytes = 0;
+        uint64_t firstNs = 0, streamNs = 0, inflateNs = 0;
+        bool intact = true;
+        for (int rep = 0; rep < kReps; ++rep) {
+            // Each frame as the first thing on a new connection...
+            for (string_view frame : frames) {
+                string wire;
+                auto t0 = Clock::now();
+                WireCompressor(dict).compress(frame, wire, true);
+                firstNs += (uint64_t)chrono::duration_cast<chrono::nanoseconds>(Clock::now() - t0).count();
+                if (rep == 0) firstBytes += wire.size();
+            }
+            // ...and all of them on one connection, flushed scene by scene.
+            WireCompressor z(dict);
+            WireDecompressor unz(dict);
+            for (string_view frame : frames) {
+                string wire, back;
+                auto t0 = Clock::now();
+                z.compress(frame, wire, false);
+                auto t1 = Clock::now();
+                if (rep == 0) streamBytes += wire.size();
+                unz.decompress(wire, back);
+                auto t2 = Clock::now();
+                streamNs += (uint64_t)chrono::duration_cast<chrono::nanoseconds>(t1 - t0).count();
+                inflateNs += (uint64_t)chrono::duration_cast<chrono::nanoseconds>(t2 - t1).count();
+                intact = intact && back == frame;
+            }
+        }
+        double scenes = (double)kReps * (double)frames.size();
+        cout << "dict_bytes=" << dict.size() << " frame_bytes=" << frameBytes
+             << " first_visit_bytes=" << firstBytes << " stream_bytes=" << streamBytes
+             << " first_visit_us_per_scene=" << (double)firstNs / scenes / 1000
+             << " stream_deflate_us_per_scene=" << (double)streamNs / scenes / 1000
+             << " stream_inflate_us_per_scene=" << (double)inflateNs / scenes / 1000
+             << " roundtrip_ok=" << intact << "\n";
+    }
+
+    DemoRouter r;
+    if (!forkDemoRouter(graph, r) || r.binaryPort < 0) return 1;
+    string dict = storyDictionary(graph);
+    size_t lineBytes = 0, plainBytes = 0, packedBytes = 0;
+    int mismatches = 0;
+    for (int i = 0; i < plays; ++i) {
+        unordered_map<uint64_t, string> cold1, cold2;
+        string viaLine, viaPlain, viaPacked;
+        lineBytes += playLineClient(r.port, i, viaLine);
+        plainBytes += playBinaryClient(r.binaryPort, i, cold1, viaPlain);
+        packedBytes += playBinaryClient(r.binaryPort, i, cold2, viaPacked, &dict);
+        mismatches += viaPlain != viaLine || viaPacked != viaLine;
+    }
+    kill(r.pid, SIGTERM);
+    waitpid(r.pid, nullptr, 0);
+    cout << "plays=" << plays << " line_bytes=" << lineBytes << " binary_bytes=" << plainBytes
+         << " binary_deflate_bytes=" << packedBytes << " wire_saved_vs_binary="
+         << (plainBytes ? 100.0 * (double)(plainBytes - packedBytes) / (double)plainBytes : 0.0)
+         << "% transcripts_differ=" << mismatches << "\n";
+    return mismatches == 0 ? 0 : 1;
+#else
+    (void)graph;
+    (void)plays;
+    cerr << "--compress-bench needs a build with -DNEBULA_ZLIB=1 -lz\n";
+    return 2;
+#endif
+}
+
+/* ------------------------------------------------------------------
+   benchIngest:
+   A worker's tick as it was and as it is now (--ingest-bench
+   [sessions]). Every session sends one line per tick, 10% of them
+   invalid, framed as Input messages the way the router sends them;
+   sessions render scene markers, as in the cluster.
+   - per_line: each message taken off the front of the buffer, run
+     through sessionInput() and its reply written on its own.
+   - batched: the messages read in place into one InputBatch and all
+     replies written at once, as ClusterWorker does.
+   Replies go to /dev/null; only the tick is timed. Both runs play the
+   same script from the same start and must write identical bytes.
+-------------------------------------------------------------------*/
+int benchIngest(const StoryGraph& graph, int sessionCount) {
+    const int kTicks = 500;
+    mt19937 rng(7);
+    vector<string> script((size_t)sessionCount * kTicks);
+    const char* invalid[] = {"x", "0", "9", "", "12a", "99999999999"};
+    for (string& line : script)
+        line = rng() % 10 == 0 ? invalid[rng() % 6] : to_string(1 + rng() % 2);
+    int devNull = open("/dev/null", O_WRONLY);
+    if (devNull < 0) {
+        cerr << "cannot open /dev/null\n";
+        return 1;
+    }
+
+    double ns[2];
+    uint64_t digest[2], writes[2], inputs = 0;
+    for (int batched = 0; batched < 2; ++batched) {
+        vector<unique_ptr<Session>> sessions;
+        for (int i = 0; i < sessionCount; ++i) {
+            sessions.emplace_back(new Session(graph));
+            sessions.back()->markScenes = true;
+        }
+        string in, out, line, text, msg;
+        InputBatch batch;
+        uint64_t h = 1469598103934665603ULL;
+        auto fold = [&](string_view bytes) {
+            for (unsigned char c : bytes) h = (h ^ c) * 1099511628211ULL;
+        };
+        auto reply = [&](uint64_t sid, uint32_t steps, bool finished, string_view rendered) {
+            msg.assign(1, finished ? '\1' : '\0');
+            putU32(msg, steps);
+            msg += rendered;
+            appendMsg(out, ClusterMsg::Output, sid, msg);
+        };
+        chrono::steady_clock::duration spent{};
+        inputs = writes[batched] = 0;
+        for (int tick = 0; tick < kTicks; ++tick) {
+            text.clear();
+            for (auto& s : sessions)
+                if (s->history.empty()) sessionOpen(*s, text);
+            fold(text);
+            in.clear();
+            for (int i = 0; i < sessionCount; ++i)
+                appendMsg(in, ClusterMsg::Input, (uint64_t)i, script[(size_t)tick * sessionCount + i]);
+            out.clear();
+
+            auto t0 = chrono::steady_clock::now();
+            ClusterMsg type;
+            uint64_t sid;
+            if (!batched) {
+                while (takeMsg(in, type, sid, line)) {
+                    Session& s = *sessions[sid];
+                    text.clear();
+                    bool finished = sessionInput(s, line, text);
+                    size_t at = out.size();
+                    reply(sid, (uint32_t)s.history.size(), finished, text);
+                    if (finished) s.reset();
+                    writes[batched] += write(devNull, out.data() + at, out.size() - at) > 0;
+                }
+            } else {
+                size_t pos = 0;
+                string_view body;
+                batch.clear();
+                while (peekMsg(in, pos, type, sid, body)) batch.add(*sessions[sid], body);
+                batch.run();
+                for (size_t i = 0; i < batch.size(); ++i) {
+                    const InputBatch::Result& r = batch.result(i);
+                    reply(i, r.steps, r.finished, batch.output(i));
+                    if (r.finished) sessions[i]->reset();
+                }
+                writes[batched] += write(devNull, out.data(), out.size()) > 0;
+            }
+            spent += chrono::steady_clock::now() - t0;
+            fold(out);
+            inputs += sessionCount;
+        }
+        ns[batched] = chrono::duration<double, nano>(spent).count();
+        digest[batched] = h;
+    }
+    close(devNull);
+    cout << "sessions=" << sessionCount << " inputs=" << inputs
+         << " per_line_ns=" << ns[0] / inputs << " batched_ns=" << ns[1] / inputs
+         << " speedup=" << ns[0] / ns[1] << " writes=" << writes[0] << "->" << writes[1]
+         << " outputs_match=" << (digest[0] == digest[1]) << "\n";
+    return digest[0] == digest[1] ? 0 : 1;
+}
+
+/* ------------------------------------------------------------------
+   buildSyntheticStory:
+   A generated story of 'nodes' scenes for benchmarks: 2-4 choices per
+   scene (mostly a little further on, sometimes anywhere, so paths
+   reconverge and loop) and about one ending in twelve. Deterministic
+   for a given seed.
+-------------------------------------------------------------------*/
+StoryGraph buildSyntheticStory(int nodes, uint32_t seed) {
+    static const char* labels[] = {"Follow the signal", "Wait and listen", "Open the hatch",
+                                   "Turn back", "Wake the crew", "Trust the echo"};
+    StoryGraph graph;
+    mt19937 rng(seed);
+    for (int id = 0; id < nodes; ++id) {
+        StoryNode node{id, {}, {}};
+        string text = "Scene " + to_string(id) + ": the drift hums around you.";
+        if (id > 0 && rng() % 12 == 0) text += "\n*** ENDING: Drift " + to_string(id) + " ***";
+        else
+            for (uint32_t c = 0, n = 2 + rng() % 3; c < n; ++c) {
+                int to = rng() % 8 ? min(nodes - 1, id + 1 + (int)(rng() % 40)) : (int)(rng() % nodes);
+                node.choices.push_back({labels[rng() % 6], to});
+            }
+        node.text = text;
+        graph.addNode(node);
+    }
+    return graph;
+}
+
+/* ------------------------------------------------------------------
+   benchGraph:
+   StoryGraph against its CompactGraph on synthetic stories
+   (--graph-bench [nodes]; default 2k, 20k and 200k scenes):
+   - table bytes: node, edge and index structures, text excluded;
+   - walk: random playthroughs, restarting at node 0 after an ending,
+     reading each visited frame's first byte as a renderer would;
+   - bfs: every node reachable from node 0.
+   Both sides follow the same random picks and must agree on the walk
+   checksum and the reachable count.
+-------------------------------------------------------------------*/
+int benchGraph(int onlyNodes) {
+    vector<int> sizes = onlyNodes > 0 ? vector<int>{onlyNodes} : vector<int>{2000, 20000, 200000};
+    const int kSteps = 4000000;
+    bool same = true;
+    for (int n : sizes) {
+        StoryGraph graph = buildSyntheticStory(n, 42);
+        CompactGraph compact(graph);
+        MemoryFootprint before = graph.memoryFootprint(), after = compact.memoryFootprint();
+        size_t beforeBytes = before.nodeStructs + before.edgeArrays + before.indexes;
+        size_t afterBytes = after.nodeStructs + after.edgeArrays + after.indexes;
+
+        auto timed = [](const function<void()>& f) {
+            auto t0 = chrono::steady_clock::now();
+            f();
+            return chrono::duration<double, nano>(chrono::steady_clock::now() - t0).count();
+        };
+        uint64_t sumMap = 0, sumCompact = 0;
+        double walkMap = timed([&] {
+            uint64_t x = 88172645463325252ULL;
+            const StoryNode* node = graph.get(0);
+            for (int i = 0; i < kSteps; ++i) {
+                x ^= x << 13, x ^= x >> 7, x ^= x << 17;
+                sumMap += (unsigned char)node->frame[0] + (uint64_t)node->id;
+                const StoryNode* next =
+                    node->isEnding() ? nullptr : graph.get(node->choices[x % node->choices.size()].nextId);
+                node = next ? next : graph.get(0);
+            }
+        });
+        double walkCompact = timed([&] {
+            uint64_t x = 88172645463325252ULL;
+            uint32_t start = compact.indexOf(0), i = start;
+            for (int k = 0; k < kSteps; ++k) {
+                x ^= x << 13, x ^= x >> 7, x ^= x << 17;
+                sumCompact += (unsigned char)compact.frame(i)[0] + (uint64_t)compact.idAt(i);
+                uint32_t choices = compact.choiceCount(i);
+                uint32_t next = choices ? compact.next(i, (uint32_t)(x % choices)) : CompactGraph::kNone;
+                i = next != CompactGraph::kNone ? next : start;
+            }
+        });
+
+        size_t reachMap = 0, reachCompact = 0;
+        double bfsMap = timed([&] {
+            unordered_set<int> seen{0};
+            deque<int> queue{0};
+            while (!queue.empty()) {
+                const StoryNode* node = graph.get(queue.front());
+                queue.pop_front();
+                if (!node) continue;
+                for (const Choice& c : node->choices)
+                    if (seen.insert(c.nextId).second) queue.push_back(c.nextId);
+            }
+            reachMap = seen.size();
+        });
+        double bfsCompact = timed([&] {
+            vector<uint8_t> seen(compact.size());
+            vector<uint32_t> queue{compact.indexOf(0)};
+            seen[queue[0]] = 1;
+            for (size_t head = 0; head < queue.size(); ++head) {
+                uint32_t i = queue[head];
+                for (uint32_t c = 0, k = compact.choiceCount(i); c < k; ++c) {
+                    uint32_t to = compact.next(i, c);
+                    if (to != CompactGraph::kNone && !seen[to]) {
+                        seen[to] = 1;
+                        queue.push_back(to);
+                    }
+                }
+            }
+            reachCompact = queue.size();
+        });
+
+        bool agree = sumMap == sumCompact && reachMap == reachCompact;
+        same = same && agree;
+        cout << "nodes=" << n << " index_bits=" << compact.indexBits()
+             << " text_offset_bits=" << compact.textOffsetBits()
+             << " table_bytes=" << beforeBytes << "->" << afterBytes
+             << " walk_ns_per_step=" << walkMap / kSteps << "->" << walkCompact / kSteps
+             << " bfs_us=" << bfsMap / 1000 << "->" << bfsCompact / 1000
+             << " reachable=" << reachCompact << " same=" << agree << "\n";
+    }
+    return same ? 0 : 1;
+}
+
+/* ------------------------------------------------------------------
+   benchPopularity:
+   Cost of a menu render with "x% chose this" while every thread is
+   also recording choices (--popularity-bench [threads]):
+   - direct: percentages summed from the live ChoiceStats shards on
+     every render, reading cache lines the other threads are writing;
+   - snapshot: from a ChoicePopularity snapshot refreshed every 10 ms.
+   Prints one sample menu from the final snapshot.
+-------------------------------------------------------------------*/
+int benchPopularity(const StoryGraph& graph, int threads) {
+    const int kRenders = 400000;
+    vector<const StoryNode*> menus;
+    for (auto& kv : graph.allNodes())
+        if (!kv.second.isEnding()) menus.push_back(&kv.second);
+
+    for (int snapshot = 0; snapshot < 2; ++snapshot) {
+        ChoiceStats stats(graph);
+        ChoicePopularity popularity(stats);
+        if (snapshot) popularity.start(chrono::milliseconds(10));
+        vector<thread> workers;
+        atomic<uint64_t> bytes{0};
+        auto t0 = chrono::steady_clock::now();
+        for (int t = 0; t < threads; ++t) {
+            workers.emplace_back([&, t] {
+                mt19937 rng(100 + t);
+                string out;
+                const ChoicePopularity::Snapshot* held = nullptr;
+                uint8_t percent[16];
+                uint64_t rendered = 0;
+                for (int i = 0; i < kRenders; ++i) {
+                    const StoryNode& node = *menus[rng() % menus.size()];
+                    size_t n = min<size_t>(node.choices.size(), 16);
+                    // Skewed picks, so the percentages have something to show.
+                    stats.record(node.id, rng() % 4 == 0 ? (int)(rng() % n) : 0);
+                    const uint8_t* shown = percent;
+                    if (snapshot) {
+                        popularity.update(held);
+                        shown = popularity.percentages(*held, node.id);
+                    } else {
+                        uint64_t counts[16], total = 0;
+                        for (size_t c = 0; c < n; ++c) total += counts[c] = stats.count(node.id, (int)c);
+                        for (size_t c = 0; c < n; ++c)
+                            percent[c] = total < 20 ? kPercentUnknown
+                                                    : (uint8_t)((counts[c] * 200 + total) / (2 * total));
+                    }
+                    out.clear();
+                    appendFrame(out, node, shown);
+                    rendered += out.size();
+                }
+                bytes += rendered;
+            });
+        }
+        for (auto& w : workers) w.join();
+        double ns = chrono::duration<double, nano>(chrono::steady_clock::now() - t0).count();
+        cout << (snapshot ? "snapshot" : "direct") << " threads=" << threads
+             << " renders=" << (uint64_t)threads * kRenders
+             << " ns_per_render=" << ns / ((double)threads * kRenders)
+             << " wall_ms=" << ns / 1e6;
+        if (snapshot) cout << " snapshots=" << popularity.published();
+        cout << "\n";
+        if (snapshot) {
+            popularity.stop();
+            popularity.refresh();
+            const ChoicePopularity::Snapshot* held = nullptr;
+            popularity.update(held);
+            string menu;
+            appendFrame(menu, *menus[0], popularity.percentages(*held, menus[0]->id));
+            cout << menu;
+        }
+    }
+    return 0;
+}
+
+/* ------------------------------------------------------------------
+   reachDemo:
+   UniqueReach estimates against exact counts (--reach-demo [players]
+   [threads]). Twice as many sessions as players are played, each by a
+   player drawn at random (so some play often and some never), with
+   random valid picks, spread over threads; the sketches are merged
+   every 100 ms meanwhile. The exact counts keep one bit per player per
+   node, the memory HyperLogLog avoids.
+-------------------------------------------------------------------*/
+int reachDemo(const StoryGraph& graph, int players, int threads) {
+    UniqueReach reach(graph);
+    reach.start(chrono::milliseconds(100));
+    map<int, size_t> indexOf;
+    for (auto& kv : graph.allNodes()) indexOf.emplace(kv.first, indexOf.size());
+    size_t words = ((size_t)players + 63) / 64;
+    unique_ptr<atomic<uint64_t>[]> seen(new atomic<uint64_t>[indexOf.size() * words]());
+
+    auto t0 = chrono::steady_clock::now();
+    vector<thread> workers;
+    for (int t = 0; t < threads; ++t) {
+        workers.emplace_back([&, t] {
+            mt19937_64 rng(500 + t);
+            Session s(graph);
+            s.reach = &reach;
+            s.markScenes = true;
+            string out;
+            for (long k = t; k < 2L * players; k += threads) {
+                s.reset();
+                s.playerId = rng() % (uint64_t)players;
+                out.clear();
+                bool done = sessionOpen(s, out);
+                while (!done) {
+                    char pick = (char)('1' + rng() % graph.get(s.currentId)->choices.size());
+                    out.clear();
+                    done = sessionInput(s, string_view(&pick, 1), out);
+                }
+                for (int id : s.history)
+                    seen[indexOf[id] * words + s.playerId / 64].fetch_or(uint64_t(1) << (s.playerId % 64),
+                                                                        memory_order_relaxed);
+            }
+        });
+    }
+    for (auto& w : workers) w.join();
+    double secs = chrono::duration<double>(chrono::steady_clock::now() - t0).count();
+    reach.stop();
+    reach.merge();
+
+    auto exactOf = [&](const vector<int>& ids) {
+        uint64_t total = 0;
+        for (size_t w = 0; w < words; ++w) {
+            uint64_t bits = 0;
+            for (int id : ids) bits |= seen[indexOf[id] * words + w].load(memory_order_relaxed);
+            total += (uint64_t)__builtin_popcountll(bits);
+        }
+        return total;
+    };
+    double worst = 0;
+    auto report = [&](const string& what, const vector<int>& ids) {
+        uint64_t exact = exactOf(ids);
+        if (!exact) return;
+        double est = reach.estimateUnion(ids), err = 100.0 * (est - (double)exact) / (double)exact;
+        worst = max(worst, fabs(err));
+        cout << what << " exact=" << exact << " estimate=" << (uint64_t)(est + 0.5) << " error_pct=" << err << "\n";
+    };
+    vector<int> endings;
+    for (auto& kv : graph.allNodes()) {
+        if (kv.second.isEnding()) {
+            endings.push_back(kv.first);
+            report("ending=\"" + GameMetrics::endingName(kv.second) + "\"", {kv.first});
+        } else {
+            report("node=" + to_string(kv.first), {kv.first});
+        }
+    }
+    report("any_ending", endings);
+    cout << "players=" << players << " sessions=" << 2L * players << " threads=" << threads
+         << " seconds=" << secs << " merges=" << reach.mergeCount()
+         << " sketch_bytes_per_node=" << reach.sketchBytes() << " exact_bytes_per_node=" << words * 8
+         << " max_abs_error_pct=" << worst << "\n";
+    return 0;
+}
+
+/* ------------------------------------------------------------------
+   pathsDemo:
+   PathHeavyHitters against exact counts (--paths-demo [sessions]
+   [threads]) on a generated 2000-scene story, tracking prefixes of up
+   to 8 nodes with 64 paths per thread. Players favour earlier
+   choices (weights 1, 1/2, 1/3, ...), so some openings are common
+   and there are far more distinct ones than the summaries hold. The
+   exact counts keep a map of every prefix seen, per thread.
+-------------------------------------------------------------------*/
+int pathsDemo(int sessions, int threads) {
+    const size_t kLength = 8, kTop = 10;
+    StoryGraph graph = buildSyntheticStory(2000, 42);
+    PathHeavyHitters paths(kLength, 64);
+    vector<map<vector<int>, uint64_t>> exact(threads);
+
+    auto t0 = chrono::steady_clock::now();
+    vector<thread> workers;
+    for (int t = 0; t < threads; ++t) {
+        workers.emplace_back([&, t] {
+            mt19937 rng(900 + t);
+            Session s(graph);
+            s.paths = &paths;
+            s.markScenes = true;
+            string out;
+            for (int k = t; k < sessions; k += threads) {
+                s.reset();
+                out.clear();
+                bool done = sessionOpen(s, out);
+                while (!done && s.history.size() < kLength) {
+                    size_t n = graph.get(s.currentId)->choices.size();
+                    double r = uniform_real_distribution<double>(0, 1)(rng), total = 0, acc = 0;
+                    for (size_t c = 1; c <= n; ++c) total += 1.0 / c;
+                    size_t pick = 1;
+                    while (pick < n && (acc += 1.0 / pick / total) < r) ++pick;
+                    char line = (char)('0' + pick);
+                    out.clear();
+                    done = sessionInput(s, string_view(&line, 1), out);
+                }
+                for (size_t len = 2; len <= s.history.size(); ++len)
+                    ++exact[t][vector<int>(s.history.begin(), s.history.begin() + len)];
+            }
+        });
+    }
+    for (auto& w : workers) w.join();
+    double secs = chrono::duration<double>(chrono::steady_clock::now() - t0).count();
+
+    map<vector<int>, uint64_t> truth;
+    for (auto& m : exact)
+        for (auto& kv : m) truth[kv.first] += kv.second;
+    vector<pair<uint64_t, vector<int>>> ranked;
+    for (auto& kv : truth) ranked.push_back({kv.second, kv.first});
+    sort(ranked.begin(), ranked.end(), [](const pair<uint64_t, vector<int>>& a, const pair<uint64_t, vector<int>>& b) {
+        return a.first != b.first ? a.first > b.first : a.second < b.second;
+    });
+    vector<vector<int>> trueTop;
+    for (size_t i = 0; i < ranked.size() && i < kTop; ++i) trueTop.push_back(ranked[i].second);
+
+    size_t found = 0;
+    bool bounded = true;
+    for (const PathHeavyHitters::Path& p : paths.top(kTop)) {
+        uint64_t real = truth.count(p.nodes) ? truth[p.nodes] : 0;
+        found += find(trueTop.begin(), trueTop.end(), p.nodes) != trueTop.end();
+        bounded = bounded && p.guaranteed <= real && real <= p.estimate;
+        string shown;
+        for (size_t i = 0; i < p.nodes.size(); ++i) shown += (i ? " -> " : "") + to_string(p.nodes[i]);
+        cout << "path=\"" << shown << "\" estimate=" << p.estimate << " guaranteed=" << p.guaranteed
+             << " exact=" << real << "\n";
+    }
+    cout << "sessions=" << sessions << " threads=" << threads << " seconds=" << secs
+         << " distinct_prefixes=" << truth.size() << " top" << kTop << "_recall=" << found << "/"
+         << min(kTop, ranked.size()) << " bounds_hold=" << bounded
+         << " sketch_bytes_per_thread=" << paths.bytesPerThread() << "\n";
+    return bounded ? 0 : 1;
+}
+
+/* ------------------------------------------------------------------
+   benchEventLog:
+   EventLog end to end (--event-log-bench [sessions] [threads]):
+   threads play random sessions of a generated 2000-scene story through
+   the step engine with an EventLog attached, then the file is read
+   back several times.
+   - write: time to play with logging on (the writer runs meanwhile),
+     the file's size, and its bytes per row against a 22-byte row;
+   - read: rows/s and decoded GB/s (22 bytes a row) across all passes;
+   - check: every session's rows must replay as a valid walk from node
+     0, each row's node reached by its recorded choice, and the row
+     count must match the visits played. A group header claiming more
+     rows than its group holds must be refused without sizing columns.
+-------------------------------------------------------------------*/
+int benchEventLog(int sessions, int threads) {
+    const size_t kRowBytes = 8 + 8 + 4 + 2;
+    const int kReadPasses = 5;
+    StoryGraph graph = buildSyntheticStory(2000, 42);
+    string path = "/tmp/nebula-events-" + to_string(getpid()) + ".log";
+    EventLog log;
+    if (!log.open(path)) {
+        cerr << "cannot write " << path << "\n";
+        return 1;
+    }
+
+    vector<uint64_t> visits(threads, 0);
+    auto t0 = chrono::steady_clock::now();
+    vector<thread> workers;
+    for (int t = 0; t < threads; ++t) {
+        workers.emplace_back([&, t] {
+            mt19937 rng(700 + t);
+            Session s(graph);
+            s.events = &log;
+            s.markScenes = true;
+            string out;
+            for (int k = t; k < sessions; k += threads) {
+                s.reset();
+                s.sessionId = (uint64_t)k;
+                out.clear();
+                bool done = sessionOpen(s, out);
+                while (!done && s.history.size() < 64) {
+                    char line = (char)('1' + rng() % graph.get(s.currentId)->choices.size());
+                    out.clear();
+                    done = sessionInput(s, string_view(&line, 1), out);
+                }
+                visits[t] += s.history.size();
+            }
+        });
+    }
+    for (auto& w : workers) w.join();
+    log.close();
+    double writeSecs = chrono::duration<double>(chrono::steady_clock::now() - t0).count();
+    uint64_t played = 0;
+    for (uint64_t v : visits) played += v;
+
+    EventLogReader reader;
+    EventLogReader::Columns c;
+    if (!reader.open(path)) {
+        cerr << "cannot read " << path << "\n";
+        return 1;
+    }
+    uint64_t rowsRead = 0, checksum = 0;
+    auto t1 = chrono::steady_clock::now();
+    for (int pass = 0; pass < kReadPasses; ++pass) {
+        reader.rewind();
+        while (reader.next(c)) {
+            rowsRead += c.rows();
+            checksum += c.timeUs.back() + c.session[0] + (uint64_t)c.node.back() + (uint64_t)c.choice[0];
+        }
+    }
+    double readSecs = chrono::duration<double>(chrono::steady_clock::now() - t1).count();
+
+    unordered_map<uint64_t, int> at;   // session -> node it last visited
+    uint64_t rows = 0, broken = 0;
+    reader.rewind();
+    while (reader.next(c)) {
+        for (size_t i = 0; i < c.rows(); ++i, ++rows) {
+            int expected = 0;
+            if (c.choice[i] == EventLog::kRewound) expected = c.node[i];   // back where the undone choice was made
+            else if (c.choice[i] >= 0) {
+                auto it = at.find(c.session[i]);
+                const StoryNode* from = it == at.end() ? nullptr : graph.get(it->second);
+                expected = from && c.choice[i] < (int)from->choices.size() ? from->choices[c.choice[i]].nextId : -1;
+            }
+            broken += c.node[i] != expected;
+            at[c.session[i]] = c.node[i];
+        }
+    }
+    bool ok = !reader.failed() && !log.failed() && rows == played && broken == 0 && (int)at.size() == sessions;
+
+    // NBEL, version 2, then a group of 8 bytes claiming 0xFFFFFFFF rows.
+    bool refused = false;
+    if (FILE* f = fopen(path.c_str(), "wb")) {
+        const unsigned char bad[20] = {'N', 'B', 'E', 'L', 2, 0, 0, 0, 8, 0, 0, 0, 0xFF, 0xFF, 0xFF, 0xFF};
+        refused = fwrite(bad, 1, sizeof(bad), f) == sizeof(bad);
+        fclose(f);
+        EventLogReader malformed;
+        EventLogReader::Columns mc;
+        refused = refused && malformed.open(path) && !malformed.next(mc) && malformed.failed() &&
+                  mc.choice.capacity() == 0;
+    }
+    ok = ok && refused;
+    remove(path.c_str());
+
+    cout << "sessions=" << sessions << " threads=" << threads << " rows=" << rows
+         << " groups=" << log.groupsWritten() << " file_bytes=" << reader.fileBytes()
+         << " bytes_per_row=" << (double)reader.fileBytes() / max<uint64_t>(rows, 1)
+         << " raw_bytes_per_row=" << kRowBytes << "\n";
+    cout << "write seconds=" << writeSecs << " rows_per_s=" << (uint64_t)(rows / writeSecs) << "\n";
+    cout << "read passes=" << kReadPasses << " rows_per_s=" << (uint64_t)(rowsRead / readSecs)
+         << " decoded_gb_per_s=" << rowsRead * kRowBytes / readSecs / 1e9
+         << " file_gb_per_s=" << reader.fileBytes() * kReadPasses / readSecs / 1e9
+         << " checksum=" << checksum << "\n";
+    cout << "check rows_played=" << played << " broken_walks=" << broken
+         << " malformed_refused=" << (refused ? "yes" : "NO") << " " << (ok ? "PASS" : "FAIL") << "\n";
+    return ok ? 0 : 1;
+}
+
+/* ------------------------------------------------------------------
+   readEvents:
+   Summary of an EventLog file (--read-events <file>) against this
+   story: rows, sessions, time span, endings reached, choices taken
+   back and the most visited scenes.
+-------------------------------------------------------------------*/
+int readEvents(const StoryGraph& graph, const string& path) {
+    EventLogReader reader;
+    if (!reader.open(path)) {
+        cerr << "not an event log: " << path << "\n";
+        return 1;
+    }
+    EventLogReader::Columns c;
+    unordered_set<uint64_t> sessions;
+    map<int, uint64_t> visits;
+    uint64_t rows = 0, groups = 0, endings = 0, rewinds = 0, first = UINT64_MAX, last = 0;
+    while (reader.next(c)) {
+        ++groups;
+        rows += c.rows();
+        first = min(first, c.timeUs.front());
+        last = max(last, c.timeUs.back());
+        for (size_t i = 0; i < c.rows(); ++i) {
+            sessions.insert(c.session[i]);
+            if (c.choice[i] == EventLog::kRewound) {
+                ++rewinds;
+                continue;
+            }
+            ++visits[c.node[i]];
+            const StoryNode* node = graph.get(c.node[i]);
+            endings += node && node->isEnding();
+        }
+    }
+    if (reader.failed()) cerr << "warning: stopped at a malformed row group\n";
+    vector<pair<uint64_t, int>> ranked;
+    for (auto& kv : visits) ranked.push_back({kv.second, kv.first});
+    sort(ranked.rbegin(), ranked.rend());
+    cout << "rows=" << rows << " groups=" << groups << " sessions=" << sessions.size()
+         << " span_s=" << (rows ? (last - first) / 1e6 : 0.0) << " endings_reached=" << endings
+         << " choices_taken_back=" << rewinds << " file_bytes=" << reader.fileBytes() << "\n";
+    for (size_t i = 0; i < ranked.size() && i < 5; ++i)
+        cout << "node=" << ranked[i].second << " visits=" << ranked[i].first << "\n";
+    return reader.failed() ? 1 : 0;
+}
+
+/* ------------------------------------------------------------------
+   regressionDemo:
+   The corpus regression runner on a story edit (--regress-demo
+   [playthroughs] [threads]).
+   - Records random playthroughs of the story to an EventLog, then
+     loads them back as a PlaythroughCorpus.
+   - The "new" version is the story with three edits such as a
+     revision of buildGame() might make: node 6's second choice now
+     leads to ending 14, node 5 loses its second choice, and node 7's
+     first choice points at a node 16 that is not written yet.
+   - Compares the versions, prints every kind of divergence with
+     examples, and checks that the story against itself shows none.
+-------------------------------------------------------------------*/
+int regressionDemo(const StoryGraph& graph, int playthroughs, int threads) {
+    string path = "/tmp/nebula-corpus-" + to_string(getpid()) + ".log";
+    EventLog log;
+    if (!log.open(path)) {
+        cerr << "cannot write " << path << "\n";
+        return 1;
+    }
+    auto t0 = chrono::steady_clock::now();
+    vector<thread> players;
+    for (int t = 0; t < threads; ++t) {
+        players.emplace_back([&, t] {
+            mt19937 rng(300 + t);
+            Session s(graph);
+            s.events = &log;
+            s.markScenes = true;
+            string out;
+            for (int k = t; k < playthroughs; k += threads) {
+                s.reset();
+                s.sessionId = (uint64_t)k;
+                out.clear();
+                bool done = sessionOpen(s, out);
+                while (!done) {
+                    char line = (char)('1' + rng() % graph.get(s.currentId)->choices.size());
+                    out.clear();
+                    done = sessionInput(s, string_view(&line, 1), out);
+                }
+            }
+        });
+    }
+    for (auto& p : players) p.join();
+    log.close();
+    PlaythroughCorpus corpus;
+    bool loaded = corpus.loadEventLog(path);
+    remove(path.c_str());
+    double recordSecs = chrono::duration<double>(chrono::steady_clock::now() - t0).count();
+    if (!loaded) {
+        cerr << "could not read back " << path << "\n";
+        return 1;
+    }
+
+    StoryGraph revised;
+    for (auto& kv : graph.allNodes()) {
+        StoryNode node = kv.second;
+        if (node.id == 6) node.choices[1].nextId = 14;
+        if (node.id == 5) node.choices.pop_back();
+        if (node.id == 7) node.choices[0].nextId = 16;
+        revised.addNode(node);
+    }
+    CompactGraph before(graph), after(revised);
+
+    auto t1 = chrono::steady_clock::now();
+    RegressionReport report = compareStoryVersions(before, after, corpus, threads);
+    double secs = chrono::duration<double>(chrono::steady_clock::now() - t1).count();
+    RegressionReport same = compareStoryVersions(before, before, corpus, threads);
+
+    cout << "recorded playthroughs=" << corpus.size() << " choices=" << corpus.choiceCount()
+         << " corpus_bytes=" << corpus.choiceCount() + (corpus.size() + 1) * sizeof(size_t)
+         << " seconds=" << recordSecs << "\n";
+    cout << "replayed=" << report.replayed << " unchanged=" << report.unchanged
+         << " diverged=" << report.diverged() << " threads=" << threads << " seconds=" << secs
+         << " playthroughs_per_min=" << (uint64_t)(report.replayed / secs * 60) << "\n";
+    for (int c = 0; c < RegressionReport::kCategories; ++c) {
+        cout << RegressionReport::categoryName(c) << "=" << report.counts[c] << "\n";
+        for (const RegressionReport::Example& e : report.examples[c])
+            cout << "  #" << e.playthrough << " before: " << e.before.describe()
+                 << "; after: " << e.after.describe() << "\n";
+    }
+    bool ok = (int)corpus.size() == playthroughs && same.diverged() == 0 && same.replayed == corpus.size();
+    cout << "self_check diverged=" << same.diverged() << " " << (ok ? "PASS" : "FAIL") << "\n";
+    return ok ? 0 : 1;
+}
+
+/* ------------------------------------------------------------------
+   lintBench:
+   lintStory() with the default rules on a generated story (--lint-bench
+   [nodes] [threads]; default 1M scenes, 4 threads), against a run on
+   one thread: both must report the same counts and examples. Prints
+   ns per node and the time that implies for a 10M-node story.
+-------------------------------------------------------------------*/
+int lintBench(int nodes, int threads) {
+    auto t0 = chrono::steady_clock::now();
+    StoryGraph graph = buildSyntheticStory(nodes, 42);
+    double buildSecs = chrono::duration<double>(chrono::steady_clock::now() - t0).count();
+    vector<unique_ptr<LintRule>> rules = defaultLintRules();
+
+    auto t1 = chrono::steady_clock::now();
+    LintReport one = lintStory(graph, rules, 1);
+    double oneSecs = chrono::duration<double>(chrono::steady_clock::now() - t1).count();
+    auto t2 = chrono::steady_clock::now();
+    LintReport many = lintStory(graph, rules, threads);
+    double manySecs = chrono::duration<double>(chrono::steady_clock::now() - t2).count();
+
+    bool same = one.nodesChecked == many.nodesChecked && one.nodesChecked == (uint64_t)nodes;
+    for (size_t k = 0; k < rules.size(); ++k)
+        same = same && one.rules[k].count == many.rules[k].count &&
+               one.rules[k].exampleNodes == many.rules[k].exampleNodes;
+    printLintReport(cout, many, rules);
+    cout << "build_seconds=" << buildSecs << " threads=1 seconds=" << oneSecs << " threads=" << threads
+         << " seconds=" << manySecs << " ns_per_node=" << manySecs * 1e9 / max(nodes, 1)
+         << " projected_10m_seconds=" << manySecs * 1e7 / max(nodes, 1)
+         << " same_as_one_thread=" << same << "\n";
+    return same ? 0 : 1;
+}
+
+/* ------------------------------------------------------------------
+   healthBench:
+   measureStoryHealth() on a generated story (--health-bench [nodes]
+   [threads]; default 1M scenes, 4 threads) after one warm-up run,
+   timed against a run on one thread; both must produce the same JSON. Prints the headline
+   numbers, not the (long) histograms.
+-------------------------------------------------------------------*/
+int healthBench(int nodes, int threads) {
+    CompactGraph graph(buildSyntheticStory(nodes, 42));
+    measureStoryHealth(graph, threads);   // warm-up: first touch of the graph's pages
+    auto t0 = chrono::steady_clock::now();
+    StoryHealth one = measureStoryHealth(graph, 1);
+    double oneSecs = chrono::duration<double>(chrono::steady_clock::now() - t0).count();
+    auto t1 = chrono::steady_clock::now();
+    StoryHealth many = measureStoryHealth(graph, threads);
+    double manySecs = chrono::duration<double>(chrono::steady_clock::now() - t1).count();
+    bool same = one.json() == many.json();
+    cout << "nodes=" << many.nodes << " edges=" << many.edges << " reachable=" << many.reachable
+         << " max_depth=" << (many.depth.empty() ? 0 : many.depth.size() - 1) << " endings=" << many.endings
+         << " reconverging=" << many.reconverging << " cyclic_nodes=" << many.cyclicNodes
+         << " largest_scc=" << (many.sccSizes.empty() ? 0 : many.sccSizes.rbegin()->first) << "\n";
+    cout << "threads=1 seconds=" << oneSecs << " threads=" << threads << " seconds=" << manySecs
+         << " ns_per_node=" << manySecs * 1e9 / max(nodes, 1) << " same_as_one_thread=" << same << "\n";
+    return same ? 0 : 1;
+}
+
+/* ------------------------------------------------------------------
+   rewindBench:
+   Session::rewindTo() on long playthroughs (--rewind-bench [steps];
+   default 1k, 10k, 100k and 1M choices) of a generated 1000-scene
+   story with no endings, so a walk can go on forever. Each length is
+   played through sessionInput(), noting the state at every visit;
+   then 1000 rewinds to random earlier steps, furthest first, are
+   timed and each must land on the noted state. A restored copy (no
+   recorded choices) is rewound too, and "back" must return to the
+   previous scene. Finally, on 'game', a playthrough with a "back" in
+   it is logged to an EventLog, and the corpus read from the log must
+   hold only the choices that stood.
+-------------------------------------------------------------------*/
+int rewindBench(const StoryGraph& game, int onlySteps) {
+    struct Seen {
+        int currentId, arrivedBy, loopTortoise;
+        size_t loopPower, loopLength;
+        bool operator==(const Seen& o) const {
+            return currentId == o.currentId && arrivedBy == o.arrivedBy && loopTortoise == o.loopTortoise &&
+                   loopPower == o.loopPower && loopLength == o.loopLength;
+        }
+    };
+    auto seen = [](const Session& s) {
+        return Seen{s.currentId, s.arrivedBy, s.loopTortoise, s.loopPower, s.loopLength};
+    };
+    StoryGraph graph;
+    mt19937 rng(7);
+    for (int id = 0; id < 1000; ++id) {
+        string text = "Scene " + to_string(id) + ": the corridor bends again.";
+        StoryNode node{id, text, {}};
+        for (int c = 0; c < 3; ++c) node.choices.push_back({"Take a door", (int)(rng() % 1000)});
+        graph.addNode(node);
+    }
+
+    vector<int> sizes = onlySteps > 0 ? vector<int>{onlySteps} : vector<int>{1000, 10000, 100000, 1000000};
+    const int kRewinds = 1000;
+    bool same = true;
+    for (int steps : sizes) {
+        Session s(graph);
+        vector<Seen> states;        // before visit i
+        vector<int> visits;
+        string out;
+        sessionOpen(s, out);
+        for (int i = 0; i < steps; ++i) {
+            char line = (char)('1' + rng() % 3);
+            out.clear();
+            states.push_back(seen(s));
+            visits.push_back(s.currentId);
+            sessionInput(s, string_view(&line, 1), out);
+        }
+
+        string saved;
+        s.serialize(saved);
+        Session restored(graph);
+        restored.restore(saved);
+
+        vector<size_t> targets;
+        for (int r = 0; r < kRewinds; ++r) targets.push_back(rng() % (size_t)steps);
+        sort(targets.rbegin(), targets.rend());
+        auto t0 = chrono::steady_clock::now();
+        for (size_t t : targets) {
+            s.rewindTo(t);
+            same = same && seen(s) == states[t] && s.history.size() == t;
+        }
+        double ns = chrono::duration<double, nano>(chrono::steady_clock::now() - t0).count() / kRewinds;
+        for (size_t i = 0; i < s.history.size(); ++i) same = same && s.history[i] == visits[i];
+
+        auto t1 = chrono::steady_clock::now();
+        bool rebuilt = restored.rewindTo(targets.front());
+        double rebuildUs = chrono::duration<double, micro>(chrono::steady_clock::now() - t1).count();
+        Seen expect = states[targets.front()];
+        expect.arrivedBy = restored.arrivedBy;   // any choice leading there will do
+        same = same && rebuilt && seen(restored) == expect;
+
+        out.clear();
+        sessionRender(s, out);
+        int scene = s.currentId;
+        out.clear();
+        sessionInput(s, "1", out);
+        out.clear();
+        sessionInput(s, "back", out);
+        same = same && s.currentId == scene && s.history.back() == scene;
+
+        cout << "steps=" << steps << " rewind_ns=" << (long long)ns << " replay_bound=" << s.checkpointEvery - 1
+             << " rebuild_us=" << (long long)rebuildUs
+             << " checkpoints_kb=" << (steps / s.checkpointEvery + 1) * sizeof(Session::Checkpoint) / 1024
+             << "\n";
+    }
+    cout << "states_match=" << (same ? "yes" : "NO") << "\n";
+
+    // A history that does not follow the story cannot be rewound.
+    Session broken(graph);
+    broken.restore(string("\0\0\0\0\2\0\0\0\0\0\0\0\0\0\0\0", 16));   // 0 -> 0, no such choice
+    bool refused = !broken.canGoBack() && broken.unreplayableAt == 2 && !broken.canGoBack();
+
+    string path = "/tmp/nebula-rewind-" + to_string(getpid()) + ".log";
+    vector<uint8_t> kept;
+    {
+        EventLog log;
+        Session s(game);
+        s.events = &log;
+        s.sessionId = 1;
+        string out;
+        if (log.open(path)) {
+            sessionOpen(s, out);
+            for (const char* line : {"1", "1", "back", "2", "1"}) sessionInput(s, line, out);
+            kept.assign(s.history.size() - 1, 0);
+            for (size_t i = 0; i + 1 < s.history.size(); ++i)
+                while (game.get(s.history[i])->choices[kept[i]].nextId != s.history[i + 1]) ++kept[i];
+        }
+    }
+    PlaythroughCorpus corpus;
+    bool logged = corpus.loadEventLog(path) && corpus.size() == 1 &&
+                  vector<uint8_t>(corpus.begin(0), corpus.end(0)) == kept;
+    remove(path.c_str());
+    cout << "broken_history_refused=" << (refused ? "yes" : "NO") << " event_log_corpus="
+         << (logged ? "matches" : "WRONG") << "\n";
+    return same && refused && logged ? 0 : 1;
+}
+
+/* ------------------------------------------------------------------
+   reportMemory:
+   Prints the estimated footprint of the story graph, of one session
+   and of the graph's string pool (--mem), one key=value line each so
+   CI can diff them. In a build with
+   NEBULA_COUNT_ALLOCS=1 it also prints the heap actually measured while
+   building the graph and creating the session, as a cross-check.
+-------------------------------------------------------------------*/
+int reportMemory() {
+    int64_t before = heapLiveBytes();
+    StoryGraph graph = buildGame();
+    int64_t afterGraph = heapLiveBytes();
+    Session session(graph);
+    int64_t afterSession = heapLiveBytes();
+
+    graph.memoryFootprint().print(cout, "graph");
+    CompactGraph(graph).memoryFootprint().print(cout, "compact_graph");
+    session.memoryFootprint().print(cout, "session");
+    cout << "pool heap_bytes=" << graph.stringPool().heapBytes() << "\n";
+    if (NEBULA_COUNT_ALLOCS)
+        cout << "measured graph_heap=" << (afterGraph - before)
+             << " session_heap=" << (afterSession - afterGraph) << "\n";
+    return 0;
+}
+
+/* ------------------------------------------------------------------
+   benchPrefetch:
+   Measures how often a lazily loaded frame stalls the player
+   (--prefetch-bench [budgetBytes]). Simulated players pick option 1
+   80% of the time. For each prefetch depth the same scripted sessions
+   run against a fresh disk-backed store whose cache holds only about
+   three frames, after 200 warm-up sessions that train ChoiceStats.
+-------------------------------------------------------------------*/
+int benchPrefetch(const StoryGraph& graph, size_t budget) {
+    const int kWarmup = 200, kSessions = 2000;
+    mt19937 rng(42);
+    string script;
+    for (int i = 0; i < (kWarmup + kSessions) * 8; ++i)
+        script += (rng() % 10 < 8) ? "1\n" : "2\n";
+    ostream sink(nullptr);
+
+    for (int depth = 0; depth <= 3; ++depth) {
+        LazyFrameStore store(1536);
+        if (!store.open(graph)) {
+            cerr << "could not create frame store\n";
+            return 1;
+        }
+        ChoiceStats stats(graph);
+        FramePrefetcher prefetcher(graph, store, stats, depth, budget);
+        istringstream in(script);
+        Session session(graph);
+        session.choiceStats = &stats;
+        session.frameStore = &store;
+        session.prefetcher = &prefetcher;
+
+        uint64_t hits0 = 0, stalls0 = 0;
+        for (int i = 0; i < kWarmup + kSessions; ++i) {
+            if (i == kWarmup) { hits0 = store.hits; stalls0 = store.stalls; }
+            session.reset();
+            runSession(session, in, sink, false);
+        }
+        uint64_t hits = store.hits - hits0, stalls = store.stalls - stalls0;
+        cout << "depth=" << depth << " budget_bytes=" << budget << " demand_fetches="
+             << (hits + stalls) << " stalls=" << stalls << " stall_rate="
+             << (double)stalls / (double)max<uint64_t>(1, hits + stalls)
+             << " prefetches=" << store.prefetches << "\n";
+    }
+    return 0;
+}
+
+/* ------------------------------------------------------------------
+   reportStories:
+   Loads every known story into one StoryRegistry (--stories) and prints
+   per-story memory plus how much the shared pool deduplicated.
+-------------------------------------------------------------------*/
+int reportStories() {
+    StoryRegistry registry;
+    for (auto& b : kStoryBuilders) registry.load(b.first, b.second);
+    registry.report(cout);
+    return 0;
+}
+
+/* ------------------------------------------------------------------
+   metricsCheck:
+   Scrapes MetricsServer over loopback (--metrics-check): after a
+   scripted playthrough, GET /metrics must answer 200 with a matching
+   Content-Length and the registry's own transition count, and any
+   other path 404. Counters registered past the slot limit must land
+   in nebula_metrics_overflow_total and leave real series alone.
+-------------------------------------------------------------------*/
+int metricsCheck(const StoryGraph& graph) {
+    MetricsRegistry& metrics = MetricsRegistry::instance();
+    GameMetrics& gm = GameMetrics::instance();
+    Session session(graph);
+    istringstream in("1\n1\n1\n1\n1\n");
+    ostream sink(nullptr);
+    runSession(session, in, sink, false);
+
+    MetricsServer server;
+    int port = server.start(0);
+    if (port < 0) {
+        cerr << "could not open the metrics socket\n";
+        return 1;
+    }
+    auto scrape = [port](const string& path) {
+        string resp;
+        int fd = connectLoopback(port);
+        if (fd < 0 || !sendAll(fd, "GET " + path + " HTTP/1.0\r\n\r\n")) {
+            if (fd >= 0) close(fd);
+            return resp;
+        }
+        char buf[4096];
+        for (ssize_t n; (n = recv(fd, buf, sizeof(buf), 0)) > 0;) resp.append(buf, (size_t)n);
+        close(fd);
+        return resp;
+    };
+    auto has = [](const string& text, const string& part) { return text.find(part) != string::npos; };
+
+    string ok = scrape("/metrics"), missing = scrape("/nope");
+    size_t head = ok.find("\r\n\r\n");
+    string body = head == string::npos ? "" : ok.substr(head + 4);
+    uint64_t transitions = metrics.value(gm.transitions);
+    bool pass = ok.rfind("HTTP/1.0 200 OK\r\n", 0) == 0 &&
+                has(ok, "Content-Length: " + to_string(body.size()) + "\r\n") && transitions > 0 &&
+                has(body, "\nnebula_transitions_total " + to_string(transitions) + "\n") &&
+                missing.rfind("HTTP/1.0 404 Not Found\r\n", 0) == 0;
+    cout << "scrape_bytes=" << body.size() << " transitions=" << transitions << "\n";
+
+    for (int i = 0; i < MetricsRegistry::kMaxSlots; ++i) {
+        int slot = metrics.counter("nebula_check_fill_total", "Filler series.", "i=\"" + to_string(i) + "\"");
+        metrics.add(slot);
+    }
+    body = scrape("/metrics");
+    pass = pass && has(body, "\nnebula_metrics_overflow_total ") &&
+           has(body, "\nnebula_transitions_total " + to_string(transitions) + "\n") &&
+           has(body, "nebula_check_fill_total{i=\"0\"} 1\n");
+    cout << "metrics_check=" << (pass ? "ok" : "FAILED") << "\n";
+    return pass ? 0 : 1;
+}
+
+/* ------------------------------------------------------------------
+   main:
+   Orchestrates the entire game:
+     1) Configure I/O (important for web consoles).
+     2) Build the story graph.
+     3) Run one session (see runSession) on stdin/stdout.
+   Command-line modes:
+     --check-allocs   verify the steady-state loop never allocates
+     --mem            print graph and session memory footprints
+     --metrics-check  scrape the /metrics endpoint over loopback
+     --stories        load all stories into one registry; memory report
+     --serve [port] [workers]   multi-process session server on 127.0.0.1
+     --cluster-demo   play sessions through a live-rebalancing cluster
+     --failover-demo [maxLost]   kill workers mid-story; standbys take over
+     --upgrade-demo   hand a live server over to a new process mid-story
+     --binary-demo [plays]   bytes on the wire: line vs binary protocol
+     --compress-bench [plays]   deflate with the story dictionary: size, CPU
+     --ingest-bench [sessions]   per-line vs batched input ingestion
+     --graph-bench [nodes]   map-based vs compact graph: bytes, traversal
+     --popularity-bench [threads]   "x% chose this": live counters vs snapshots
+     --reach-demo [players] [threads]   HyperLogLog unique players vs exact
+     --paths-demo [sessions] [threads]   top opening paths, sketch vs exact
+     --event-log-bench [sessions] [threads]   columnar event log write/read
+     --read-events <file>          summary of an event log file
+     --regress-demo [playthroughs] [threads]   replay a recorded corpus
+                      on an edited story; report changed outcomes
+     --lint [threads]   check the story against the lint rules
+     --lint-bench [nodes] [threads]   lint a generated story, timed
+     --health [threads]   story structure metrics as JSON
+     --health-bench [nodes] [threads]   the same on a generated story, timed
+     --rewind-bench [steps]   rewind long playthroughs to earlier choices
+     --prefetch-bench [budget]   stall rate of lazily loaded frames
+                      with and without probability-driven prefetching
+     --loadgen [key=value...]   simulated players; throughput, latency, SLO
+-------------------------------------------------------------------*/
+int main(int argc, char** argv) {
+    // ONLINEGDB-FRIENDLY I/O SETTINGS:
+    //  - Keep C/C++ I/O in sync for safer buffering.
+    //  - Tie cin to cout so cout flushes before any cin operation.
+    ios::sync_with_stdio(true);   /* changed from ios::sync_with_stdio(false) */
+    cin.tie(&cout);               /* changed from cin.tie(nullptr) */
+
+    startInstrumentation();
+
+    StoryGraph graph = buildGame();  // build all nodes/edges once
+    GameMetrics::instance().registerEndings(graph);
+
+    string mode = argc > 1 ? argv[1] : "";
+    if (mode == "--check-allocs") return checkSteadyStateAllocs(graph);
+    if (mode == "--mem") return reportMemory();
+    if (mode == "--metrics-check") return metricsCheck(graph);
+    if (mode == "--stories") return reportStories();
+    if (mode == "--serve")
+        return serveCluster(graph, argc > 2 ? atoi(argv[2]) : 0, argc > 3 ? atoi(argv[3]) : 2);
+    if (mode == "--cluster-demo") return clusterDemo(graph);
+    if (mode == "--upgrade-demo") return upgradeDemo(graph);
+    if (mode == "--compress-bench") return benchCompression(graph, argc > 2 ? atoi(argv[2]) : 100);
+    if (mode == "--binary-demo") return binaryDemo(graph, argc > 2 ? atoi(argv[2]) : 200);
+    if (mode == "--failover-demo") return failoverDemo(graph, argc > 2 ? (size_t)atol(argv[2]) : 4);
+    if (mode == "--loadgen") {
+        LoadConfig cfg;
+        if (!parseLoadConfig(argc, argv, 2, cfg)) {
+            cerr << "usage: --loadgen [sessions=N] [seconds=S]\n"
+                    "                 [policy=uniform|recorded|shortest|adversarial|fixed:K]\n"
+                    "                 [think=none|fixed:MS|exp:MS] [slo_p99_us=US] [invalid_rate=R]\n"
+                    "                 [max_steps=N] [detect_loops=0|1] [popularity_ms=MS]\n"
+                    "                 [event_log=PATH] [recorded=PATH]\n";
+            return 2;
+        }
+        return runLoad(graph, cfg);
+    }
+    if (mode == "--lint") {
+        vector<unique_ptr<LintRule>> rules = defaultLintRules();
+        LintReport report = lintStory(graph, rules, argc > 2 ? max(1, atoi(argv[2])) : 4);
+        printLintReport(cout, report, rules);
+        return report.errors(rules) ? 1 : 0;
+    }
+    if (mode == "--health") {
+        cout << measureStoryHealth(CompactGraph(graph), argc > 2 ? max(1, atoi(argv[2])) : 4).json() << "\n";
+        return 0;
+    }
+    if (mode == "--rewind-bench") return rewindBench(graph, argc > 2 ? atoi(argv[2]) : 0);
+    if (mode == "--health-bench")
+        return healthBench(argc > 2 ? max(1, atoi(argv[2])) : 1000000, argc > 3 ? max(1, atoi(argv[3])) : 4);
+    if (mode == "--lint-bench")
+        return lintBench(argc > 2 ? max(1, atoi(argv[2])) : 1000000, argc > 3 ? max(1, atoi(argv[3])) : 4);
+    if (mode == "--regress-demo")
+        return regressionDemo(graph, argc > 2 ? max(1, atoi(argv[2])) : 1000000, argc > 3 ? max(1, atoi(argv[3])) : 4);
+    if (mode == "--event-log-bench")
+        return benchEventLog(argc > 2 ? max(1, atoi(argv[2])) : 200000, argc > 3 ? max(1, atoi(argv[3])) : 4);
+    if (mode == "--read-events") {
+        if (argc < 3) {
+            cerr << "usage: --read-events <file>\n";
+            return 2;
+        }
+        return readEvents(graph, argv[2]);
+    }
+    if (mode == "--paths-demo")
+        return pathsDemo(argc > 2 ? max(1, atoi(argv[2])) : 500000, argc > 3 ? max(1, atoi(argv[3])) : 4);
+    if (mode == "--reach-demo")
+        return reachDemo(graph, argc > 2 ? max(1, atoi(argv[2])) : 1000000, argc > 3 ? max(1, atoi(argv[3])) : 4);
+    if (mode == "--popularity-bench")
+        return benchPopularity(graph, argc > 2 ? max(1, atoi(argv[2])) : 4);
+    if (mode == "--graph-bench") return benchGraph(argc > 2 ? atoi(argv[2]) : 0);
+    if (mode == "--ingest-bench") return benchIngest(graph, argc > 2 ? max(1, atoi(argv[2])) : 1000);
+    if (mode == "--prefetch-bench") return benchPrefetch(graph, argc > 2 ? (size_t)atol(argv[2]) : 1024);
+
+    // Optional Prometheus endpoint: NEBULA_METRICS_PORT=9464 ./game
+    MetricsServer metricsServer;
+    if (const char* port = getenv("NEBULA_METRICS_PORT")) {
+        int bound = metricsServer.start(atoi(port));
+        if (bound >= 0) cerr << "metrics: http://127.0.0.1:" << bound << "/metrics\n";
+    }
+
+    banner();
+    printSlow("A narrative of first contact and transcendence.\n");
+    pauseDots();                      // small beat after the intro line
+
+    Session session(graph);           // start at node 0 (the intro)
+    EventLog events;
+    if (const char* path = getenv("NEBULA_EVENT_LOG")) {
+        if (events.open(path)) {
+            session.events = &events;
+            session.sessionId = (uint64_t)chrono::duration_cast<chrono::microseconds>(
+                chrono::system_clock::now().time_since_epoch()).count();
+        } else cerr << "event log: cannot write " << path << "\n";
+    }
+    int status = runSession(session, cin, cout, true);
+
+    flushInstrumentation();
+    return status;
+}